@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "encoding.hpp"
+#include "generation.hpp"
+#include "parser.hpp"
+#include "peephole.hpp"
+#include "tokenization.hpp"
+
+// Compiler throughput benchmark. Builds synthetic programs of a given shape and size in memory and
+// times the tokenizer (tokens/s), parser (AST nodes/s) and generator (machine code bytes/s) apart.
+//
+//     fue_bench [max-size [shape...]]
+//
+// Sizes run from 16K up to max-size (default 16M) in steps of 8x; suffixes K, M and G are accepted.
+
+namespace synth {
+    // Nesting is capped per statement so that the recursive parser and generator stay within the
+    // default stack; larger sizes repeat the statement instead of nesting deeper.
+    constexpr int max_expr_depth = 200;
+    constexpr int max_elif_arms = 500;
+    constexpr int max_loop_depth = 6;
+
+    void deep_exprs(std::string &out, const size_t size) {
+        out += "may d = 1;\n";
+        for (int stmt = 0; out.size() < size; stmt++) {
+            out += "d = ";
+            for (int i = 0; i < max_expr_depth; i++) {
+                out += "(d ";
+                out += "+-*<"[(stmt + i) % 4];
+                out += ' ';
+            }
+            out += "d";
+            out.append(max_expr_depth, ')');
+            out += ";\n";
+        }
+    }
+
+    void wide_scopes(std::string &out, const size_t size) {
+        for (size_t i = 0; out.size() < size; i++) {
+            const std::string name = "w" + std::to_string(i);
+            out += "may " + name + " = " + std::to_string(i % 1000) + " + " + (i == 0 ? "1" : "w" + std::to_string(i - 1))
+                    + ";\n";
+        }
+    }
+
+    void elif_chains(std::string &out, const size_t size) {
+        out += "may e = 7;\n";
+        while (out.size() < size) {
+            out += "if (e == 0) {\n    e = e + 1;\n}";
+            for (int arm = 1; arm < max_elif_arms; arm++) {
+                const std::string n = std::to_string(arm);
+                out += " elif (e == " + n + ") {\n    e = e - " + n + ";\n}";
+            }
+            out += " else {\n    e = 0;\n}\n";
+        }
+    }
+
+    void nested_loops(std::string &out, const size_t size) {
+        out += "may s = 0;\n";
+        while (out.size() < size) {
+            for (int depth = 0; depth < max_loop_depth; depth++) {
+                const std::string indent(depth * 4, ' ');
+                const std::string n = std::to_string(depth);
+                if (depth % 2 == 0) {
+                    out += indent + "for (may i" + n + " = 0; i" + n + " < 3; i" + n + " = i" + n + " + 1;) {\n";
+                } else {
+                    out += indent + "may c" + n + " = 2;\n";
+                    out += indent + "while (c" + n + " > 0;) {\n";
+                    out += indent + "    c" + n + " = c" + n + " - 1;\n";
+                }
+            }
+            out += std::string(max_loop_depth * 4, ' ') + "s = s + 1;\n";
+            for (int depth = max_loop_depth - 1; depth >= 0; depth--) {
+                out += std::string(depth * 4, ' ') + "}\n";
+            }
+        }
+    }
+
+    void literal_tables(std::string &out, const size_t size) {
+        out += "may t = 0;\n";
+        uint64_t state = 0x9e3779b97f4a7c15;
+        while (out.size() < size) {
+            out += "t = t";
+            for (int i = 0; i < 16; i++) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                out += " + " + std::to_string(state >> 1);
+            }
+            out += ";\n";
+        }
+    }
+
+    struct Shape {
+        std::string_view name;
+        void (*build)(std::string &, size_t);
+    };
+
+    constexpr Shape shapes[] = {
+        {"deep", deep_exprs},
+        {"wide", wide_scopes},
+        {"elif", elif_chains},
+        {"loops", nested_loops},
+        {"literals", literal_tables},
+    };
+
+    std::string program(const Shape &shape, const size_t size) {
+        std::string out;
+        out.reserve(size + 64 * 1024);
+        shape.build(out, size);
+        out += "exit(0);\n";
+        return out;
+    }
+}
+
+struct Sample {
+    size_t tokens = 0;
+    size_t nodes = 0;
+    size_t code_bytes = 0;
+    double tokenize_s = 0;
+    double parse_s = 0;
+    double codegen_s = 0;
+};
+
+static double seconds_since(const std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static Sample compile(const std::string_view src) {
+    Sample sample;
+
+    Interner symbols;
+    auto start = std::chrono::steady_clock::now();
+    Tokenizer tokenizer(src, symbols);
+    std::vector<Token> tokens = tokenizer.tokenize();
+    sample.tokenize_s = seconds_since(start);
+    sample.tokens = tokens.size();
+
+    start = std::chrono::steady_clock::now();
+    ArenaAllocator arena;
+    Parser parser(std::move(tokens), arena);
+    const std::optional<NodeProg> prog = parser.parse_prog();
+    sample.parse_s = seconds_since(start);
+    if (!prog.has_value()) {
+        std::cerr << "[Bench Error] Synthetic program failed to parse" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    sample.nodes = parser.allocator().object_count() + prog->exprs.size();
+
+    start = std::chrono::steady_clock::now();
+    X86Encoder encoder;
+    PeepholeOptimizer peephole(encoder);
+    Generator generator(prog.value(), peephole);
+    generator.gen_prog();
+    peephole.finish();
+    sample.code_bytes = encoder.finish().size();
+    sample.codegen_s = seconds_since(start);
+    return sample;
+}
+
+static std::optional<size_t> parse_size(const std::string_view arg) {
+    size_t value = 0;
+    size_t i = 0;
+    for (; i < arg.size() && arg[i] >= '0' && arg[i] <= '9'; i++) {
+        value = value * 10 + (arg[i] - '0');
+    }
+    if (i == 0 || i + 1 < arg.size()) {
+        return std::nullopt;
+    }
+    if (i < arg.size()) {
+        switch (arg[i]) {
+            case 'K': case 'k': return value << 10;
+            case 'M': case 'm': return value << 20;
+            case 'G': case 'g': return value << 30;
+            default: return std::nullopt;
+        }
+    }
+    return value;
+}
+
+static std::string human_size(const size_t bytes) {
+    if (bytes >= 1 << 20) {
+        return std::to_string(bytes >> 20) + "M";
+    }
+    return std::to_string(bytes >> 10) + "K";
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_size = 16 << 20;
+    if (argc > 1) {
+        const std::optional<size_t> size = parse_size(argv[1]);
+        if (!size.has_value()) {
+            std::cerr << "Incorrect usage. Correct usage is ..." << std::endl;
+            std::cerr << "fue_bench [max-size [deep|wide|elif|loops|literals ...]]" << std::endl;
+            return EXIT_FAILURE;
+        }
+        max_size = size.value();
+    }
+
+    std::vector<const synth::Shape *> selected;
+    for (const synth::Shape &shape: synth::shapes) {
+        if (argc <= 2 || std::find(argv + 2, argv + argc, shape.name) != argv + argc) {
+            selected.push_back(&shape);
+        }
+    }
+
+    std::printf("%-9s %7s %11s %10s %11s %10s %11s %10s\n", "shape", "size", "tokens", "Mtok/s", "nodes",
+                "Mnode/s", "code bytes", "MB/s");
+    for (const synth::Shape *shape: selected) {
+        for (size_t size = 16 << 10; size <= max_size; size *= 8) {
+            const std::string src = synth::program(*shape, size);
+
+            // Small inputs are compiled repeatedly and the fastest run of each phase is kept.
+            const size_t runs = std::clamp<size_t>((4 << 20) / size, 1, 32);
+            Sample best = compile(src);
+            for (size_t run = 1; run < runs; run++) {
+                const Sample sample = compile(src);
+                best.tokenize_s = std::min(best.tokenize_s, sample.tokenize_s);
+                best.parse_s = std::min(best.parse_s, sample.parse_s);
+                best.codegen_s = std::min(best.codegen_s, sample.codegen_s);
+            }
+
+            std::printf("%-9s %7s %11zu %10.2f %11zu %10.2f %11zu %10.2f\n", std::string(shape->name).c_str(),
+                        human_size(src.size()).c_str(), best.tokens, best.tokens / best.tokenize_s / 1e6,
+                        best.nodes, best.nodes / best.parse_s / 1e6, best.code_bytes,
+                        best.code_bytes / best.codegen_s / 1e6);
+            std::fflush(stdout);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,32 +1,173 @@
-#pragma once
-
-#include <cstddef>
-#include <cstdlib>
-
-class ArenaAllocator {
-public:
-    explicit ArenaAllocator(const size_t bytes) : m_size(bytes) {
-        m_buffer = static_cast<std::byte *>(malloc(m_size));
-        m_offset = m_buffer;
-    }
-
-    template<typename T>
-    T *alloc() {
-        void *offset = m_offset;
-        m_offset += sizeof(T);
-        return static_cast<T *>(offset);
-    }
-
-    ArenaAllocator(const ArenaAllocator &other) = delete;
-
-    ArenaAllocator operator=(const ArenaAllocator &other) = delete;
-
-    ~ArenaAllocator() {
-        free(m_buffer);
-    }
-
-private:
-    size_t m_size;
-    std::byte *m_buffer;
-    std::byte *m_offset;
-};
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "errors.hpp"
+
+// Bump allocator over a chain of blocks that grow geometrically. Objects are constructed in place
+// and, when they own resources (e.g. the vector in NodeStmtScope), destroyed with the arena.
+class ArenaAllocator {
+public:
+    explicit ArenaAllocator(const size_t first_block = 64 * 1024) : m_next_block(std::max<size_t>(first_block, 256)) {
+    }
+
+    template<typename T, typename... Args>
+    T *alloc(Args &&... args) {
+        T *object = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        track(object, 1);
+        m_objects++;
+        return object;
+    }
+
+    template<typename T>
+    T *alloc_array(const size_t count) {
+        if (count > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            std::cerr << "[Arena Error] Array of " << count << " elements is too large" << std::endl;
+            fail();
+        }
+
+        T *objects = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; i++) {
+            new(objects + i) T();
+        }
+        track(objects, count);
+        m_objects += count;
+        return objects;
+    }
+
+    ArenaAllocator(const ArenaAllocator &other) = delete;
+
+    ArenaAllocator operator=(const ArenaAllocator &other) = delete;
+
+    ~ArenaAllocator() {
+        destroy_objects();
+        for (std::byte *block: m_blocks) {
+            free(block);
+        }
+    }
+
+    // Destroys every object and starts over in the largest block, freeing the others. An arena that is
+    // reset between compiles settles on a single block that fits them, and stops calling malloc.
+    void reset() {
+        destroy_objects();
+        m_destructors.clear();
+        if (m_blocks.empty()) {
+            return;
+        }
+
+        const auto largest = std::max_element(m_block_sizes.begin(), m_block_sizes.end()) - m_block_sizes.begin();
+        std::byte *const kept = m_blocks[largest];
+        const size_t kept_size = m_block_sizes[largest];
+        for (std::byte *block: m_blocks) {
+            if (block != kept) {
+                free(block);
+            }
+        }
+        m_blocks.assign(1, kept);
+        m_block_sizes.assign(1, kept_size);
+        m_offset = kept;
+        m_end = kept + kept_size;
+        m_next_block = kept_size * 2;
+        m_used = 0;
+        m_wasted = 0;
+        m_reserved = kept_size;
+        m_objects = 0;
+    }
+
+    // Bytes handed out to objects.
+    [[nodiscard]] size_t bytes_used() const {
+        return m_used;
+    }
+
+    // Objects constructed so far; for the parser's arena this is the AST node count.
+    [[nodiscard]] size_t object_count() const {
+        return m_objects;
+    }
+
+    // Alignment padding plus the unused tails of blocks that have been retired.
+    [[nodiscard]] size_t bytes_wasted() const {
+        return m_wasted;
+    }
+
+    // Bytes in the blocks the arena holds.
+    [[nodiscard]] size_t bytes_reserved() const {
+        return m_reserved;
+    }
+
+private:
+    struct Destructor {
+        void *object;
+        size_t count;
+        void (*destroy)(void *, size_t);
+    };
+
+    void *allocate(const size_t size, const size_t align) {
+        size_t padding = (align - reinterpret_cast<uintptr_t>(m_offset) % align) % align;
+        if (m_offset == nullptr || size + padding > static_cast<size_t>(m_end - m_offset)) {
+            grow(size + align);
+            padding = (align - reinterpret_cast<uintptr_t>(m_offset) % align) % align;
+        }
+
+        std::byte *object = m_offset + padding;
+        m_offset = object + size;
+        m_used += size;
+        m_wasted += padding;
+        return object;
+    }
+
+    void grow(const size_t min_size) {
+        const size_t size = std::max(m_next_block, min_size);
+        auto *block = static_cast<std::byte *>(malloc(size));
+        if (block == nullptr) {
+            std::cerr << "[Arena Error] Out of memory allocating " << size << " bytes" << std::endl;
+            fail();
+        }
+
+        if (m_offset != nullptr) {
+            m_wasted += m_end - m_offset;
+        }
+        m_blocks.push_back(block);
+        m_block_sizes.push_back(size);
+        m_reserved += size;
+        m_offset = block;
+        m_end = block + size;
+        m_next_block = size * 2;
+    }
+
+    void destroy_objects() {
+        for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it) {
+            it->destroy(it->object, it->count);
+        }
+    }
+
+    template<typename T>
+    void track(T *objects, const size_t count) {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            m_destructors.push_back({objects, count, [](void *ptr, const size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    static_cast<T *>(ptr)[i].~T();
+                }
+            }});
+        }
+    }
+
+    std::vector<std::byte *> m_blocks{};
+    std::vector<size_t> m_block_sizes{};
+    std::vector<Destructor> m_destructors{};
+    std::byte *m_offset = nullptr;
+    std::byte *m_end = nullptr;
+    size_t m_next_block;
+    size_t m_used = 0;
+    size_t m_wasted = 0;
+    size_t m_reserved = 0;
+    size_t m_objects = 0;
+};
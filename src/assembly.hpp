@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include "output.hpp"
+
+enum class Reg {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15
+};
+
+inline const char *reg_name(const Reg reg) {
+    static constexpr const char *names[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+    };
+    return names[static_cast<int>(reg)];
+}
+
+// Low byte of each register, as written by setcc and read by movzx.
+inline const char *reg8_name(const Reg reg) {
+    static constexpr const char *names[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+    };
+    return names[static_cast<int>(reg)];
+}
+
+// Values match the x86 condition code encoding.
+enum class Cond {
+    o, no, b, ae, e, ne, be, a, s, ns, p, np, l, ge, le, g
+};
+
+inline const char *cond_name(const Cond cond) {
+    static constexpr const char *names[] = {
+        "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"
+    };
+    return names[static_cast<int>(cond)];
+}
+
+// Conditions come in complementary pairs that differ only in the lowest bit.
+inline Cond invert(const Cond cond) {
+    return static_cast<Cond>(static_cast<int>(cond) ^ 1);
+}
+
+// The condition that tests the same relation with the cmp operands swapped.
+inline Cond mirror(const Cond cond) {
+    switch (cond) {
+        case Cond::l: return Cond::g;
+        case Cond::g: return Cond::l;
+        case Cond::ge: return Cond::le;
+        case Cond::le: return Cond::ge;
+        case Cond::b: return Cond::a;
+        case Cond::a: return Cond::b;
+        case Cond::ae: return Cond::be;
+        case Cond::be: return Cond::ae;
+        default: return cond;
+    }
+}
+
+// imul takes two forms: with a source it is the truncating `imul dst, src` (or `imul dst, imm`), and
+// without one it is the widening `imul src` into rdx:rax.
+enum class Op {
+    label, mov, push, pop, add, sub, imul, idiv, cqo, cmp, test, lea, dec, jmp, jcc, setcc, movzx, shl, shr, sar,
+    neg, syscall, ud2
+};
+
+struct Operand {
+    enum class Kind { none, reg, imm, mem, label, msg, msg_len };
+
+    Kind kind = Kind::none;
+    Reg reg = Reg::rax;
+    int64_t value = 0;
+    // Memory operands only: [reg + index * scale + value] when scale is non-zero.
+    Reg index = Reg::rax;
+    int scale = 0;
+};
+
+inline Operand reg_op(const Reg reg) {
+    return {.kind = Operand::Kind::reg, .reg = reg};
+}
+
+inline Operand imm_op(const int64_t value) {
+    return {.kind = Operand::Kind::imm, .value = value};
+}
+
+inline Operand stack_op(const int64_t offset) {
+    return {.kind = Operand::Kind::mem, .reg = Reg::rsp, .value = offset};
+}
+
+inline Operand scaled_op(const Reg base, const Reg index, const int scale) {
+    return {.kind = Operand::Kind::mem, .reg = base, .index = index, .scale = scale};
+}
+
+inline Operand label_op(const int label) {
+    return {.kind = Operand::Kind::label, .value = label};
+}
+
+inline Operand msg_op() {
+    return {.kind = Operand::Kind::msg};
+}
+
+inline Operand msg_len_op() {
+    return {.kind = Operand::Kind::msg_len};
+}
+
+struct Instr {
+    Op op;
+    Operand dst{};
+    Operand src{};
+    Cond cond = Cond::e;
+};
+
+inline constexpr std::string_view tle_message = "Oops! Time Limit Exceeded, check your logic\n";
+
+class AsmSink {
+public:
+    virtual void emit(const Instr &instr) = 0;
+
+    virtual ~AsmSink() = default;
+};
+
+// NASM source for the textual debugging path, streamed straight to the output file.
+class TextAsm final : public AsmSink {
+public:
+    explicit TextAsm(OutputFile &out) : m_out(out) {
+        m_out << "section .data\n";
+        m_out << "    msg db \"" << tle_message.substr(0, tle_message.size() - 1) << "\", 0xa\n";
+        m_out << "    len EQU $ - msg\n";
+
+        m_out << "\nsection .text\n";
+        m_out << "    global _start\n_start:\n";
+    }
+
+    void emit(const Instr &instr) override {
+        if (instr.op == Op::label) {
+            m_out << "label" << instr.dst.value << ":\n";
+            return;
+        }
+
+        m_out << "    ";
+        write_mnemonic(instr);
+        if (instr.dst.kind != Operand::Kind::none) {
+            m_out << " ";
+            write_operand(instr, instr.dst);
+        }
+        if (instr.src.kind != Operand::Kind::none) {
+            m_out << ", ";
+            write_operand(instr, instr.src);
+        }
+        m_out << "\n";
+    }
+
+private:
+    void write_mnemonic(const Instr &instr) const {
+        static constexpr const char *names[] = {
+            "", "mov", "push", "pop", "add", "sub", "imul", "idiv", "cqo", "cmp", "test", "lea", "dec", "jmp", "j",
+            "set", "movzx", "shl", "shr", "sar", "neg", "syscall", "ud2"
+        };
+        m_out << names[static_cast<int>(instr.op)];
+        if (instr.op == Op::jcc || instr.op == Op::setcc) {
+            m_out << cond_name(instr.cond);
+        }
+    }
+
+    void write_operand(const Instr &instr, const Operand &operand) const {
+        switch (operand.kind) {
+            case Operand::Kind::reg:
+                if (instr.op == Op::setcc || (instr.op == Op::movzx && &operand == &instr.src)) {
+                    m_out << reg8_name(operand.reg);
+                } else {
+                    m_out << reg_name(operand.reg);
+                }
+                break;
+            case Operand::Kind::imm:
+                m_out << operand.value;
+                break;
+            case Operand::Kind::mem:
+                if (instr.op != Op::lea) {
+                    m_out << "QWORD ";
+                }
+                m_out << "[" << reg_name(operand.reg);
+                if (operand.scale != 0) {
+                    m_out << " + " << reg_name(operand.index) << "*" << operand.scale;
+                }
+                if (operand.value != 0) {
+                    m_out << " + " << operand.value;
+                }
+                m_out << "]";
+                break;
+            case Operand::Kind::label:
+                if (instr.op == Op::lea) {
+                    m_out << "[rel label" << operand.value << "]";
+                    break;
+                }
+                m_out << "label" << operand.value;
+                break;
+            case Operand::Kind::msg:
+                m_out << "msg";
+                break;
+            case Operand::Kind::msg_len:
+                m_out << "len";
+                break;
+            case Operand::Kind::none:
+                break;
+        }
+    }
+
+    OutputFile &m_out;
+};
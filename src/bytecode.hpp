@@ -0,0 +1,326 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "errors.hpp"
+#include "parser.hpp"
+#include "runtime.hpp"
+#include "symbols.hpp"
+
+// Register bytecode for --interp. Every instruction names up to three registers of one flat frame:
+// a variable's register is fixed for its scope, temporaries sit above the variables in scope, and
+// literals live in read-only registers at negative indices, so operands never need decoding.
+namespace bc {
+
+using Reg = int32_t;
+
+enum class Op : uint8_t {
+    // a = b
+    move,
+    // a = b <op> c; comparisons produce 0 or 1.
+    add, sub, mul, div, gt, lt, eq, ge, le, ne,
+    // Jump to c, unconditionally, when a is zero, or when a <cmp> b holds.
+    jump, jump_zero, jump_gt, jump_lt, jump_eq, jump_ge, jump_le, jump_ne,
+    // The per-loop iteration cap: guard_init arms it on loop entry, guard counts one iteration.
+    // Watchdog builds poll the timer at the same spots instead.
+    guard_init, guard, poll,
+    // Ends the program with a's low byte as the status; halt is the end of the program text.
+    exit, halt
+};
+
+inline bool is_jump(const Op op) {
+    return op >= Op::jump && op <= Op::jump_ne;
+}
+
+struct Instr {
+    Op op;
+    Reg a = 0;
+    Reg b = 0;
+    Reg c = 0;
+};
+
+struct Program {
+    std::vector<Instr> code{};
+    // Literal -1 - k is constants[k].
+    std::vector<int64_t> constants{};
+    // Registers at index 0 and up: variables and temporaries.
+    size_t register_count = 0;
+    std::optional<uint64_t> watchdog_ms{};
+};
+
+}
+
+// Compiles the AST into bytecode. Expressions are evaluated into the register that wants them:
+// an assignment's top operator writes the variable directly, an identifier operand is used where it
+// lives, and a comparison that decides a branch becomes the branch. Loops test their condition at
+// the bottom, so each iteration costs one jump.
+class BytecodeCompiler {
+public:
+    explicit BytecodeCompiler(const NodeProg &prog, const GenOptions options = {})
+        : m_prog(prog), m_exprs(prog.exprs), m_options(options) {
+    }
+
+    bc::Program compile() {
+        m_vars.begin_scope();
+        for (const NodeStmt &stmt: m_prog.stmts) {
+            gen_stmt(&stmt);
+        }
+        m_vars.end_scope();
+        // Running off the end is not defined for compiled programs; here it ends with status 0.
+        emit(bc::Op::halt);
+
+        for (bc::Instr &instr: m_program.code) {
+            if (bc::is_jump(instr.op)) {
+                instr.c = m_labels[instr.c];
+            }
+        }
+        m_program.register_count = m_register_count;
+        m_program.watchdog_ms = m_options.watchdog_ms;
+        return std::move(m_program);
+    }
+
+private:
+    static bc::Op bin_op(const ExprKind kind) {
+        switch (kind) {
+            case ExprKind::add: return bc::Op::add;
+            case ExprKind::sub: return bc::Op::sub;
+            case ExprKind::mul: return bc::Op::mul;
+            case ExprKind::div: return bc::Op::div;
+            case ExprKind::greater: return bc::Op::gt;
+            case ExprKind::less: return bc::Op::lt;
+            case ExprKind::equal: return bc::Op::eq;
+            case ExprKind::greater_eq: return bc::Op::ge;
+            case ExprKind::less_eq: return bc::Op::le;
+            default: return bc::Op::ne;
+        }
+    }
+
+    // The branch taken when comparison kind holds, or when it fails if negate is set.
+    static bc::Op branch_op(const ExprKind kind, const bool negate) {
+        switch (kind) {
+            case ExprKind::greater: return negate ? bc::Op::jump_le : bc::Op::jump_gt;
+            case ExprKind::less: return negate ? bc::Op::jump_ge : bc::Op::jump_lt;
+            case ExprKind::equal: return negate ? bc::Op::jump_ne : bc::Op::jump_eq;
+            case ExprKind::greater_eq: return negate ? bc::Op::jump_lt : bc::Op::jump_ge;
+            case ExprKind::less_eq: return negate ? bc::Op::jump_gt : bc::Op::jump_le;
+            default: return negate ? bc::Op::jump_eq : bc::Op::jump_ne;
+        }
+    }
+
+    void emit(const bc::Op op, const bc::Reg a = 0, const bc::Reg b = 0, const bc::Reg c = 0) {
+        m_program.code.push_back({.op = op, .a = a, .b = b, .c = c});
+    }
+
+    int create_label() {
+        m_labels.push_back(0);
+        return static_cast<int>(m_labels.size() - 1);
+    }
+
+    void place(const int label) {
+        m_labels[label] = static_cast<bc::Reg>(m_program.code.size());
+    }
+
+    bc::Reg constant(const int64_t value) {
+        const auto [it, inserted] = m_constants.try_emplace(value, static_cast<bc::Reg>(m_program.constants.size()));
+        if (inserted) {
+            m_program.constants.push_back(value);
+        }
+        return -1 - it->second;
+    }
+
+    bc::Reg temp() {
+        const bc::Reg reg = m_next_reg++;
+        m_register_count = std::max<size_t>(m_register_count, m_next_reg);
+        return reg;
+    }
+
+    bc::Reg find_var(const Token &ident) const {
+        const bc::Reg *reg = m_vars.find(ident.symbol);
+        if (reg == nullptr) {
+            std::cerr << "ERROR: Unknown identifier '" << ident.value << "'\n";
+            fail();
+        }
+        return *reg;
+    }
+
+    // Register holding the value of expr, which is dst when one is given.
+    bc::Reg gen_expr(const ExprIndex expr, const std::optional<bc::Reg> dst = {}) {
+        bc::Reg reg;
+        switch (m_exprs.kind(expr)) {
+            case ExprKind::int_lit:
+                reg = constant(m_exprs.value(expr));
+                break;
+            case ExprKind::ident:
+                reg = find_var(m_exprs.ident(expr));
+                break;
+            default: {
+                // Temporaries of the operands are dead once the operator has read them.
+                const bc::Reg saved = m_next_reg;
+                const bc::Reg lhs = gen_expr(m_exprs.lhs(expr));
+                const bc::Reg rhs = gen_expr(m_exprs.rhs(expr));
+                m_next_reg = saved;
+                const bc::Reg target = dst.has_value() ? dst.value() : temp();
+                emit(bin_op(m_exprs.kind(expr)), target, lhs, rhs);
+                return target;
+            }
+        }
+        if (dst.has_value() && dst.value() != reg) {
+            emit(bc::Op::move, dst.value(), reg);
+            return dst.value();
+        }
+        return reg;
+    }
+
+    // Jumps to label when expr is zero, or when it is non-zero if negate is clear.
+    void gen_branch(const ExprIndex expr, const int label, const bool negate) {
+        const bc::Reg saved = m_next_reg;
+        if (is_cmp(m_exprs.kind(expr))) {
+            const bc::Reg lhs = gen_expr(m_exprs.lhs(expr));
+            const bc::Reg rhs = gen_expr(m_exprs.rhs(expr));
+            emit(branch_op(m_exprs.kind(expr), negate), lhs, rhs, label);
+        } else if (negate) {
+            emit(bc::Op::jump_zero, gen_expr(expr), 0, label);
+        } else {
+            emit(bc::Op::jump_ne, gen_expr(expr), constant(0), label);
+        }
+        m_next_reg = saved;
+    }
+
+    void begin_scope() {
+        m_vars.begin_scope();
+    }
+
+    void end_scope() {
+        m_next_reg -= static_cast<bc::Reg>(m_vars.scope_entries().size());
+        m_vars.end_scope();
+    }
+
+    void gen_scope(const NodeStmtScope *scope) {
+        if (scope == nullptr) {
+            return;
+        }
+        begin_scope();
+        for (const NodeStmt *stmt: scope->stmts) {
+            gen_stmt(stmt);
+        }
+        end_scope();
+    }
+
+    void gen_if_pred(const NodeStmtIfPred *pred, const int end_label) {
+        if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred->var)) {
+            const int label = create_label();
+            gen_branch((*elif)->expr, label, true);
+            gen_scope((*elif)->scope);
+            emit(bc::Op::jump, 0, 0, end_label);
+            place(label);
+            if ((*elif)->pred.has_value()) {
+                gen_if_pred((*elif)->pred.value(), end_label);
+            }
+        } else {
+            gen_scope(std::get<NodeStmtIfPredElse *>(pred->var)->scope);
+        }
+    }
+
+    // The guard counts an iteration each time the condition has held, the same as in compiled code.
+    void gen_loop(const ExprIndex cond, const NodeStmtScope *body, const NodeStmt *iter) {
+        const int top_label = create_label();
+        const int end_label = create_label();
+        gen_branch(cond, end_label, true);
+        place(top_label);
+        emit(m_options.watchdog_ms.has_value() ? bc::Op::poll : bc::Op::guard);
+        gen_scope(body);
+        if (iter != nullptr) {
+            gen_stmt(iter);
+        }
+        gen_branch(cond, top_label, false);
+        place(end_label);
+    }
+
+    void gen_stmt(const NodeStmt *stmt) {
+        struct StmtVisitor {
+            BytecodeCompiler &gen;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                const bc::Reg saved = gen.m_next_reg;
+                gen.emit(bc::Op::exit, gen.gen_expr(stmt_exit->expr));
+                gen.m_next_reg = saved;
+            }
+
+            void operator()(const NodeStmtMay *stmt_may) const {
+                if (gen.m_vars.find(stmt_may->ident.symbol) != nullptr) {
+                    std::cerr << "Identifier already used: " << stmt_may->ident.value << "\n";
+                    fail();
+                }
+                // The initialiser cannot see the variable, so its temporaries may start at its register.
+                const bc::Reg reg = gen.m_next_reg;
+                gen.gen_expr(stmt_may->expr, reg);
+                gen.m_next_reg = reg;
+                gen.temp();
+                gen.m_vars.declare(stmt_may->ident.symbol, reg);
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                const bc::Reg *reg = gen.m_vars.find(stmt_assign->ident.symbol);
+                if (reg == nullptr) {
+                    std::cerr << "Undeclared Identifier" << stmt_assign->ident.value << std::endl;
+                    fail();
+                }
+                gen.gen_expr(stmt_assign->expr, *reg);
+            }
+
+            void operator()(const NodeStmtScope *stmt_scope) const {
+                gen.gen_scope(stmt_scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                const int label = gen.create_label();
+                gen.gen_branch(stmt_if->expr, label, true);
+                gen.gen_scope(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    const int end_label = gen.create_label();
+                    gen.emit(bc::Op::jump, 0, 0, end_label);
+                    gen.place(label);
+                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
+                    gen.place(end_label);
+                } else {
+                    gen.place(label);
+                }
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                gen.gen_guard_init();
+                gen.gen_loop(stmt_while->expr, stmt_while->scope, nullptr);
+            }
+
+            void operator()(const NodeStmtFor *stmt_for) const {
+                gen.begin_scope();
+                gen.gen_guard_init();
+                gen.gen_stmt(stmt_for->init);
+                gen.gen_loop(stmt_for->cond, stmt_for->scope, stmt_for->iter);
+                gen.end_scope();
+            }
+        };
+
+        StmtVisitor visitor{.gen = *this};
+        std::visit(visitor, stmt->var);
+    }
+
+    void gen_guard_init() {
+        if (!m_options.watchdog_ms.has_value()) {
+            emit(bc::Op::guard_init);
+        }
+    }
+
+    const NodeProg &m_prog;
+    const ExprPool &m_exprs;
+    const GenOptions m_options;
+    bc::Program m_program{};
+    ScopedSymbolTable<bc::Reg> m_vars{};
+    std::unordered_map<int64_t, bc::Reg> m_constants{};
+    std::vector<bc::Reg> m_labels{};
+    bc::Reg m_next_reg = 0;
+    size_t m_register_count = 0;
+};
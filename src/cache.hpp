@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+// 128-bit hash of data in two independent 64-bit lanes, eight bytes per step. Not cryptographic; the
+// width is there so that accidental collisions between cached programs are out of reach.
+inline std::pair<uint64_t, uint64_t> hash128(const std::string_view data) {
+    constexpr uint64_t k1 = 0x9e3779b97f4a7c15;
+    constexpr uint64_t k2 = 0xc2b2ae3d27d4eb4f;
+    uint64_t h1 = 0x243f6a8885a308d3 ^ data.size();
+    uint64_t h2 = 0x13198a2e03707344 + data.size() * k2;
+
+    const auto mix = [&](const uint64_t word) {
+        h1 = std::rotl(h1 ^ (word * k1), 31) * k2;
+        h2 = std::rotl(h2 + (word ^ k2), 27) * k1 + h1;
+    };
+
+    size_t pos = 0;
+    for (; pos + 8 <= data.size(); pos += 8) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + pos, 8);
+        mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data.data() + pos, data.size() - pos);
+    mix(tail);
+
+    const auto finish = [](uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53;
+        return h ^ (h >> 33);
+    };
+    return {finish(h1 ^ h2), finish(h2 + h1)};
+}
+
+// On-disk cache of finished executables, one file per key, shared by every fue process that is given
+// the same directory. Entries are written to a temporary name and published with rename(), so readers
+// never see a partial file; an entry removed while it is being copied stays readable through the open
+// descriptor. Hits refresh an entry's mtime, and once the directory outgrows its limit the entries
+// with the oldest mtime are evicted first.
+class CompileCache {
+public:
+    CompileCache(std::filesystem::path dir, const uint64_t limit_bytes)
+        : m_dir(std::move(dir)), m_limit(limit_bytes) {
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+    }
+
+    CompileCache(const CompileCache &other) = delete;
+
+    CompileCache operator=(const CompileCache &other) = delete;
+
+    // Key for source compiled under config, which must name everything that changes the output.
+    static std::string key(const std::string_view source, const std::string_view config) {
+        const auto [src_lo, src_hi] = hash128(source);
+        const auto [cfg_lo, cfg_hi] = hash128(config);
+        const uint64_t words[2] = {src_lo ^ std::rotl(cfg_lo, 17), src_hi ^ std::rotl(cfg_hi, 41)};
+
+        std::string hex(32, '0');
+        for (size_t i = 0; i < 32; i++) {
+            hex[i] = "0123456789abcdef"[(words[i / 16] >> (60 - i % 16 * 4)) & 0xf];
+        }
+        return hex;
+    }
+
+    // Copies the entry for key to dest as an executable. Returns false on a miss.
+    bool fetch(const std::string &key, const std::string &dest) const {
+        const std::filesystem::path entry = entry_path(key);
+        std::error_code ec;
+        if (!std::filesystem::copy_file(entry, dest, std::filesystem::copy_options::overwrite_existing, ec)) {
+            return false;
+        }
+        std::filesystem::permissions(dest, executable_perms, ec);
+        std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+        return true;
+    }
+
+    // Publishes the file at path as the entry for key. Failures only cost the next run a compile.
+    void store(const std::string &key, const std::string &path) {
+        const std::filesystem::path entry = entry_path(key);
+        const std::filesystem::path temp = m_dir / (key + "." + std::to_string(getpid()) + "." +
+                                                    std::to_string(m_temp_count.fetch_add(1)) + ".tmp");
+        std::error_code ec;
+        if (!std::filesystem::copy_file(path, temp, std::filesystem::copy_options::overwrite_existing, ec)) {
+            return;
+        }
+        const uintmax_t size = std::filesystem::file_size(temp, ec);
+        std::filesystem::rename(temp, entry, ec);
+        if (ec) {
+            std::filesystem::remove(temp, ec);
+            return;
+        }
+
+        // Sweeping walks the whole directory, so it waits until a slice of the limit has been added.
+        if (m_unswept.fetch_add(size) + size >= m_limit / 16) {
+            trim();
+        }
+    }
+
+    // Runs the sweep that store() has been putting off, if anything was stored since the last one.
+    void finish() {
+        if (m_unswept.load() > 0) {
+            trim();
+        }
+    }
+
+    // Entries this process has evicted.
+    [[nodiscard]] size_t evicted() const {
+        return m_evicted.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Evicts least recently used entries until the directory is back under its limit, and clears out
+    // temporaries that a crashed writer left behind.
+    void trim() {
+        const std::lock_guard lock(m_trim_mutex);
+        m_unswept = 0;
+
+        struct Entry {
+            std::filesystem::file_time_type used;
+            uintmax_t size;
+            std::filesystem::path path;
+        };
+        std::vector<Entry> entries;
+        uintmax_t total = 0;
+        const auto stale = std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it(m_dir, ec), end; !ec && it != end; it.increment(ec)) {
+            std::error_code entry_ec;
+            const uintmax_t size = it->file_size(entry_ec);
+            const auto used = it->last_write_time(entry_ec);
+            if (entry_ec) {
+                continue;
+            }
+            const std::filesystem::path &path = it->path();
+            if (path.extension() == ".tmp") {
+                if (used < stale) {
+                    std::filesystem::remove(path, entry_ec);
+                }
+            } else if (path.extension() == ".elf") {
+                entries.push_back({used, size, path});
+                total += size;
+            }
+        }
+        if (total <= m_limit) {
+            return;
+        }
+
+        // Evict down to 7/8 of the limit so the next sweeps are not immediately due again.
+        std::ranges::sort(entries, {}, &Entry::used);
+        const uintmax_t target = m_limit - m_limit / 8;
+        for (const Entry &entry: entries) {
+            if (total <= target) {
+                break;
+            }
+            std::filesystem::remove(entry.path, ec);
+            total -= entry.size;
+            m_evicted.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static constexpr auto executable_perms = std::filesystem::perms::owner_all | std::filesystem::perms::group_read |
+                                             std::filesystem::perms::group_exec | std::filesystem::perms::others_read |
+                                             std::filesystem::perms::others_exec;
+
+    [[nodiscard]] std::filesystem::path entry_path(const std::string &key) const {
+        return m_dir / (key + ".elf");
+    }
+
+    const std::filesystem::path m_dir;
+    const uint64_t m_limit;
+    std::mutex m_trim_mutex{};
+    std::atomic<uint64_t> m_unswept{0};
+    std::atomic<size_t> m_evicted{0};
+    std::atomic<uint64_t> m_temp_count{0};
+};
@@ -0,0 +1,492 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "parser.hpp"
+#include "symbols.hpp"
+
+// Removes code that cannot affect the exit code: statements after an unconditional exit, branches
+// whose condition folded to a constant, `may` variables that are never read, and assignments that
+// are overwritten or go out of scope before being read. Runs after constant folding, until nothing
+// changes. Expressions are side-effect free except for division, which may trap, so stores whose
+// value involves a division by anything but a safe literal are always kept.
+class DeadCodeEliminator {
+public:
+    DeadCodeEliminator(ArenaAllocator &allocator, const ExprPool &exprs) : m_allocator(allocator), m_exprs(exprs) {
+    }
+
+    void eliminate_prog(NodeProg &prog) {
+        std::vector<NodeStmt *> stmts;
+        stmts.reserve(prog.stmts.size());
+        for (NodeStmt &stmt: prog.stmts) {
+            stmts.push_back(&stmt);
+        }
+
+        do {
+            m_changed = false;
+            m_reads.clear();
+            m_pinned.clear();
+            m_valid = true;
+            count_scope(stmts);
+            if (!m_valid) {
+                // Leave unknown or redeclared identifiers for the generator to report.
+                break;
+            }
+            sweep_scope(stmts);
+        } while (m_changed);
+
+        std::vector<NodeStmt> live;
+        live.reserve(stmts.size());
+        for (const NodeStmt *stmt: stmts) {
+            live.push_back(*stmt);
+        }
+        prog.stmts = std::move(live);
+    }
+
+    // Number of statements removed or replaced so far.
+    [[nodiscard]] size_t eliminated() const {
+        return m_eliminated;
+    }
+
+private:
+    // Calls fn on every identifier expr reads, scanning the node range of its subtree.
+    template<typename Fn>
+    void for_each_read(const ExprIndex expr, Fn &&fn) const {
+        for (ExprIndex i = m_exprs.first(expr); i <= expr; i++) {
+            if (m_exprs.kind(i) == ExprKind::ident) {
+                fn(m_exprs.ident(i));
+            }
+        }
+    }
+
+    // True if evaluating expr can fault: a division by a non-literal, by zero, or by -1.
+    [[nodiscard]] bool may_trap(const ExprIndex expr) const {
+        for (ExprIndex i = m_exprs.first(expr); i <= expr; i++) {
+            if (m_exprs.kind(i) != ExprKind::div) {
+                continue;
+            }
+            const auto divisor = m_exprs.lit_value(m_exprs.rhs(i));
+            if (!divisor.has_value() || divisor.value() == 0 || divisor.value() == -1) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Scopes of an if statement in source order; the else scope, if any, comes last.
+    static std::vector<NodeStmtScope *> if_scopes(const NodeStmtIf *stmt_if, bool &has_else) {
+        std::vector<NodeStmtScope *> scopes{stmt_if->scope};
+        has_else = false;
+        std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                scopes.push_back((*elif)->scope);
+                pred = (*elif)->pred;
+            } else {
+                scopes.push_back(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope);
+                has_else = true;
+                pred = {};
+            }
+        }
+        return scopes;
+    }
+
+    // Calls fn on every identifier read anywhere inside stmt.
+    template<typename Fn>
+    void for_each_read(const NodeStmt *stmt, Fn &&fn) const {
+        struct ReadVisitor {
+            const DeadCodeEliminator &dce;
+            Fn &fn;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                dce.for_each_read(stmt_exit->expr, fn);
+            }
+
+            void operator()(const NodeStmtMay *stmt_may) const {
+                dce.for_each_read(stmt_may->expr, fn);
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                dce.for_each_read(stmt_assign->expr, fn);
+            }
+
+            void operator()(const NodeStmtScope *stmt_scope) const {
+                for (const NodeStmt *stmt: stmt_scope->stmts) {
+                    dce.for_each_read(stmt, fn);
+                }
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                dce.for_each_read(stmt_if->expr, fn);
+                std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                        dce.for_each_read((*elif)->expr, fn);
+                        pred = (*elif)->pred;
+                    } else {
+                        pred = {};
+                    }
+                }
+                bool has_else;
+                for (const NodeStmtScope *scope: if_scopes(stmt_if, has_else)) {
+                    (*this)(scope);
+                }
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                dce.for_each_read(stmt_while->expr, fn);
+                (*this)(stmt_while->scope);
+            }
+
+            void operator()(const NodeStmtFor *stmt_for) const {
+                dce.for_each_read(stmt_for->init, fn);
+                dce.for_each_read(stmt_for->cond, fn);
+                dce.for_each_read(stmt_for->iter, fn);
+                (*this)(stmt_for->scope);
+            }
+        };
+
+        std::visit(ReadVisitor{.dce = *this, .fn = fn}, stmt->var);
+    }
+
+    // True if control never continues past stmt: it exits on every path, or loops forever.
+    [[nodiscard]] bool never_falls_through(const NodeStmt *stmt) const {
+        struct ExitVisitor {
+            const DeadCodeEliminator &dce;
+
+            bool operator()(const NodeStmtExit *) const {
+                return true;
+            }
+
+            bool operator()(const NodeStmtMay *) const {
+                return false;
+            }
+
+            bool operator()(const NodeStmtAssign *) const {
+                return false;
+            }
+
+            bool operator()(const NodeStmtScope *stmt_scope) const {
+                return std::ranges::any_of(stmt_scope->stmts, [this](const NodeStmt *stmt) {
+                    return dce.never_falls_through(stmt);
+                });
+            }
+
+            bool operator()(const NodeStmtIf *stmt_if) const {
+                bool has_else;
+                const auto scopes = if_scopes(stmt_if, has_else);
+                return has_else && std::ranges::all_of(scopes, [this](const NodeStmtScope *scope) {
+                    return (*this)(scope);
+                });
+            }
+
+            bool operator()(const NodeStmtWhile *stmt_while) const {
+                const auto cond = dce.m_exprs.lit_value(stmt_while->expr);
+                return cond.has_value() && cond.value() != 0;
+            }
+
+            bool operator()(const NodeStmtFor *stmt_for) const {
+                const auto cond = dce.m_exprs.lit_value(stmt_for->cond);
+                return cond.has_value() && cond.value() != 0;
+            }
+        };
+
+        return std::visit(ExitVisitor{.dce = *this}, stmt->var);
+    }
+
+    // First walk: resolve every identifier to its declaration and count the reads of each one.
+    void count_scope(const std::vector<NodeStmt *> &stmts) {
+        m_bindings.begin_scope();
+        for (const NodeStmt *stmt: stmts) {
+            count_stmt(stmt);
+        }
+        m_bindings.end_scope();
+    }
+
+    void count_reads(const ExprIndex expr) {
+        for_each_read(expr, [this](const Token &ident) {
+            if (const auto binding = m_bindings.find(ident.symbol)) {
+                m_reads[*binding]++;
+            } else {
+                m_valid = false;
+            }
+        });
+    }
+
+    void count_stmt(const NodeStmt *stmt) {
+        struct CountVisitor {
+            DeadCodeEliminator &dce;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                dce.count_reads(stmt_exit->expr);
+            }
+
+            void operator()(const NodeStmtMay *stmt_may) const {
+                dce.count_reads(stmt_may->expr);
+                if (dce.m_bindings.find(stmt_may->ident.symbol) != nullptr) {
+                    dce.m_valid = false;
+                }
+                if (dce.may_trap(stmt_may->expr)) {
+                    dce.m_pinned.insert(stmt_may);
+                }
+                dce.m_bindings.declare(stmt_may->ident.symbol, stmt_may);
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                dce.count_reads(stmt_assign->expr);
+                const auto binding = dce.m_bindings.find(stmt_assign->ident.symbol);
+                if (binding == nullptr) {
+                    dce.m_valid = false;
+                } else if (dce.may_trap(stmt_assign->expr)) {
+                    dce.m_pinned.insert(*binding);
+                }
+            }
+
+            void operator()(const NodeStmtScope *stmt_scope) const {
+                dce.count_scope(stmt_scope->stmts);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                dce.count_reads(stmt_if->expr);
+                dce.count_scope(stmt_if->scope->stmts);
+                std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                        dce.count_reads((*elif)->expr);
+                        dce.count_scope((*elif)->scope->stmts);
+                        pred = (*elif)->pred;
+                    } else {
+                        dce.count_scope(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope->stmts);
+                        pred = {};
+                    }
+                }
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                dce.count_reads(stmt_while->expr);
+                dce.count_scope(stmt_while->scope->stmts);
+            }
+
+            void operator()(const NodeStmtFor *stmt_for) const {
+                dce.m_bindings.begin_scope();
+                dce.count_stmt(stmt_for->init);
+                if (const auto init = std::get_if<NodeStmtMay *>(&stmt_for->init->var)) {
+                    dce.m_pinned.insert(*init);
+                }
+                dce.count_reads(stmt_for->cond);
+                dce.count_stmt(stmt_for->iter);
+                dce.count_scope(stmt_for->scope->stmts);
+                dce.m_bindings.end_scope();
+            }
+        };
+
+        std::visit(CountVisitor{.dce = *this}, stmt->var);
+    }
+
+    [[nodiscard]] bool is_read(const NodeStmtMay *binding) const {
+        const auto it = m_reads.find(binding);
+        return it != m_reads.end() && it->second > 0;
+    }
+
+    // Rewrites an if whose conditions folded to constants. Returns false if no branch is left.
+    bool simplify_if(NodeStmt *stmt, NodeStmtIf *stmt_if) {
+        // Drop constant-false elifs and cut the chain at the first constant-true one.
+        std::optional<NodeStmtIfPred *> *link = &stmt_if->pred;
+        while (link->has_value()) {
+            const auto elif = std::get_if<NodeStmtIfPredElif *>(&link->value()->var);
+            if (elif == nullptr) {
+                break;
+            }
+            const auto cond = m_exprs.lit_value((*elif)->expr);
+            if (cond.has_value() && cond.value() == 0) {
+                *link = (*elif)->pred;
+                m_changed = true;
+            } else if (cond.has_value()) {
+                auto else_ = m_allocator.alloc<NodeStmtIfPredElse>();
+                else_->scope = (*elif)->scope;
+                link->value()->var = else_;
+                m_changed = true;
+                break;
+            } else {
+                link = &(*elif)->pred;
+            }
+        }
+
+        const auto cond = m_exprs.lit_value(stmt_if->expr);
+        if (!cond.has_value()) {
+            return true;
+        }
+
+        m_changed = true;
+        m_eliminated++;
+        if (cond.value() != 0) {
+            stmt->var = stmt_if->scope;
+            return true;
+        }
+        if (!stmt_if->pred.has_value()) {
+            return false;
+        }
+        if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&stmt_if->pred.value()->var)) {
+            auto next = m_allocator.alloc<NodeStmtIf>();
+            next->expr = (*elif)->expr;
+            next->scope = (*elif)->scope;
+            next->pred = (*elif)->pred;
+            stmt->var = next;
+            return simplify_if(stmt, next);
+        }
+        stmt->var = std::get<NodeStmtIfPredElse *>(stmt_if->pred.value()->var)->scope;
+        return true;
+    }
+
+    // Second walk: drop what the counts show to be dead, tracking stores not yet read in this scope.
+    void sweep_scope(std::vector<NodeStmt *> &stmts) {
+        m_bindings.begin_scope();
+        std::vector<bool> dead(stmts.size());
+        std::unordered_map<Symbol, size_t> pending;
+        std::unordered_set<Symbol> declared;
+
+        const auto read = [&](const Token &ident) {
+            pending.erase(ident.symbol);
+        };
+        const auto kill = [&](const size_t index) {
+            dead[index] = true;
+            m_changed = true;
+            m_eliminated++;
+        };
+
+        size_t end = stmts.size();
+        for (size_t i = 0; i < end; i++) {
+            NodeStmt *stmt = stmts[i];
+
+            if (const auto stmt_may = std::get_if<NodeStmtMay *>(&stmt->var)) {
+                for_each_read((*stmt_may)->expr, read);
+                m_bindings.declare((*stmt_may)->ident.symbol, *stmt_may);
+                declared.insert((*stmt_may)->ident.symbol);
+                if (!is_read(*stmt_may) && !m_pinned.contains(*stmt_may)) {
+                    kill(i);
+                }
+                continue;
+            }
+
+            if (const auto stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->var)) {
+                const NodeStmtAssign *assign = *stmt_assign;
+                for_each_read(assign->expr, read);
+                const NodeStmtMay *binding = *m_bindings.find(assign->ident.symbol);
+                if (may_trap(assign->expr)) {
+                    pending.erase(assign->ident.symbol);
+                } else if (!is_read(binding)) {
+                    kill(i);
+                } else {
+                    if (const auto it = pending.find(assign->ident.symbol); it != pending.end()) {
+                        kill(it->second);
+                    }
+                    pending[assign->ident.symbol] = i;
+                }
+                continue;
+            }
+
+            if (const auto stmt_if = std::get_if<NodeStmtIf *>(&stmt->var)) {
+                if (!simplify_if(stmt, *stmt_if)) {
+                    dead[i] = true;
+                    continue;
+                }
+            } else if (const auto stmt_while = std::get_if<NodeStmtWhile *>(&stmt->var)) {
+                const auto cond = m_exprs.lit_value((*stmt_while)->expr);
+                if (cond.has_value() && cond.value() == 0) {
+                    kill(i);
+                    continue;
+                }
+            } else if (const auto stmt_for = std::get_if<NodeStmtFor *>(&stmt->var)) {
+                const auto cond = m_exprs.lit_value((*stmt_for)->cond);
+                const auto init = std::get_if<NodeStmtMay *>(&(*stmt_for)->init->var);
+                if (cond.has_value() && cond.value() == 0 && init != nullptr && !may_trap((*init)->expr)) {
+                    kill(i);
+                    continue;
+                }
+            }
+
+            for_each_read(stmt, read);
+            sweep_stmt(stmt);
+
+            if (never_falls_through(stmt)) {
+                // Whatever is still unread will never be read, and nothing after this runs.
+                for (const auto &[symbol, index]: pending) {
+                    kill(index);
+                }
+                pending.clear();
+                for (size_t j = i + 1; j < end; j++) {
+                    kill(j);
+                }
+                end = i + 1;
+            }
+        }
+
+        // Stores to variables that go out of scope here are never read.
+        for (const auto &[symbol, index]: pending) {
+            if (declared.contains(symbol)) {
+                kill(index);
+            }
+        }
+
+        size_t live = 0;
+        for (size_t i = 0; i < stmts.size(); i++) {
+            if (!dead[i]) {
+                stmts[live++] = stmts[i];
+            }
+        }
+        stmts.resize(live);
+        m_bindings.end_scope();
+    }
+
+    void sweep_stmt(NodeStmt *stmt) {
+        struct SweepVisitor {
+            DeadCodeEliminator &dce;
+
+            void operator()(NodeStmtExit *) const {
+            }
+
+            void operator()(NodeStmtMay *) const {
+            }
+
+            void operator()(NodeStmtAssign *) const {
+            }
+
+            void operator()(NodeStmtScope *stmt_scope) const {
+                dce.sweep_scope(stmt_scope->stmts);
+            }
+
+            void operator()(NodeStmtIf *stmt_if) const {
+                bool has_else;
+                for (NodeStmtScope *scope: if_scopes(stmt_if, has_else)) {
+                    dce.sweep_scope(scope->stmts);
+                }
+            }
+
+            void operator()(NodeStmtWhile *stmt_while) const {
+                dce.sweep_scope(stmt_while->scope->stmts);
+            }
+
+            void operator()(NodeStmtFor *stmt_for) const {
+                dce.m_bindings.begin_scope();
+                if (const auto init = std::get_if<NodeStmtMay *>(&stmt_for->init->var)) {
+                    dce.m_bindings.declare((*init)->ident.symbol, *init);
+                }
+                dce.sweep_scope(stmt_for->scope->stmts);
+                dce.m_bindings.end_scope();
+            }
+        };
+
+        std::visit(SweepVisitor{.dce = *this}, stmt->var);
+    }
+
+    ArenaAllocator &m_allocator;
+    const ExprPool &m_exprs;
+    ScopedSymbolTable<const NodeStmtMay *> m_bindings{};
+    std::unordered_map<const NodeStmtMay *, size_t> m_reads{};
+    std::unordered_set<const NodeStmtMay *> m_pinned{};
+    bool m_valid = true;
+    bool m_changed = false;
+    size_t m_eliminated = 0;
+};
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include "assembly.hpp"
+#include "errors.hpp"
+#include "output.hpp"
+
+// Encodes the instructions Generator emits straight into x86-64 machine code.
+// Jumps always use rel32 and are patched in a single pass once every label is known.
+class X86Encoder final : public AsmSink {
+public:
+    X86Encoder() = default;
+
+    // Encodes into buffer, keeping the capacity left over from an earlier image.
+    explicit X86Encoder(std::vector<uint8_t> buffer) : m_code(std::move(buffer)) {
+        m_code.clear();
+    }
+
+    void emit(const Instr &instr) override {
+        switch (instr.op) {
+            case Op::label:
+                define_label(static_cast<int>(instr.dst.value));
+                break;
+            case Op::mov:
+                encode_mov(instr.dst, instr.src);
+                break;
+            case Op::push:
+                rex(false, 0, instr.dst.reg);
+                byte(0x50 + (low_bits(instr.dst.reg)));
+                break;
+            case Op::pop:
+                rex(false, 0, instr.dst.reg);
+                byte(0x58 + (low_bits(instr.dst.reg)));
+                break;
+            case Op::add:
+                encode_alu(0, instr.dst, instr.src);
+                break;
+            case Op::sub:
+                encode_alu(5, instr.dst, instr.src);
+                break;
+            case Op::cmp:
+                encode_alu(7, instr.dst, instr.src);
+                break;
+            case Op::imul:
+                if (instr.src.kind == Operand::Kind::none) {
+                    encode_rm({0xf7}, 5, instr.dst);
+                } else if (instr.src.kind == Operand::Kind::imm && fits_i8(instr.src.value)) {
+                    encode_rm({0x6b}, num(instr.dst.reg), instr.dst);
+                    byte(static_cast<int>(instr.src.value & 0xff));
+                } else if (instr.src.kind == Operand::Kind::imm) {
+                    encode_rm({0x69}, num(instr.dst.reg), instr.dst);
+                    imm32(instr.src.value);
+                } else {
+                    encode_rm({0x0f, 0xaf}, num(instr.dst.reg), instr.src);
+                }
+                break;
+            case Op::idiv:
+                encode_rm({0xf7}, 7, instr.dst);
+                break;
+            case Op::cqo:
+                byte(0x48);
+                byte(0x99);
+                break;
+            case Op::test:
+                encode_rm({0x85}, num(instr.src.reg), instr.dst);
+                break;
+            case Op::lea:
+                encode_rm({0x8d}, num(instr.dst.reg), instr.src);
+                break;
+            case Op::dec:
+                encode_rm({0xff}, 1, instr.dst);
+                break;
+            case Op::jmp:
+                byte(0xe9);
+                label_fixup(static_cast<int>(instr.dst.value));
+                break;
+            case Op::jcc:
+                byte(0x0f);
+                byte(0x80 + static_cast<int>(instr.cond));
+                label_fixup(static_cast<int>(instr.dst.value));
+                break;
+            case Op::setcc:
+                // Any REX prefix selects spl/bpl/sil/dil over ah/ch/dh/bh.
+                if (num(instr.dst.reg) >= 4) {
+                    byte(0x40 | ((num(instr.dst.reg) & 8) ? 1 : 0));
+                }
+                byte(0x0f);
+                byte(0x90 + static_cast<int>(instr.cond));
+                byte(0xc0 | low_bits(instr.dst.reg));
+                break;
+            case Op::movzx:
+                encode_rm({0x0f, 0xb6}, num(instr.dst.reg), instr.src);
+                break;
+            case Op::shl:
+                encode_shift(4, instr.dst, instr.src);
+                break;
+            case Op::shr:
+                encode_shift(5, instr.dst, instr.src);
+                break;
+            case Op::sar:
+                encode_shift(7, instr.dst, instr.src);
+                break;
+            case Op::neg:
+                encode_rm({0xf7}, 3, instr.dst);
+                break;
+            case Op::syscall:
+                byte(0x0f);
+                byte(0x05);
+                break;
+            case Op::ud2:
+                byte(0x0f);
+                byte(0x0b);
+                break;
+        }
+    }
+
+    // Resolves label and data references and returns the code followed by the message data.
+    std::vector<uint8_t> finish() {
+        for (const auto &[pos, label]: m_fixups) {
+            if (label >= m_labels.size() || m_labels[label] < 0) {
+                std::cerr << "[Encoding Error] Undefined label " << label << "\n";
+                fail();
+            }
+            patch32(pos, m_labels[label] - static_cast<int64_t>(pos + 4));
+        }
+
+        const size_t msg_pos = m_code.size();
+        for (const size_t pos: m_msg_fixups) {
+            patch32(pos, static_cast<int64_t>(msg_pos) - static_cast<int64_t>(pos + 4));
+        }
+        m_code.insert(m_code.end(), tle_message.begin(), tle_message.end());
+
+        return std::move(m_code);
+    }
+
+private:
+    static int num(const Reg reg) {
+        return static_cast<int>(reg);
+    }
+
+    static int low_bits(const Reg reg) {
+        return num(reg) & 7;
+    }
+
+    static bool fits_i8(const int64_t value) {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    static bool fits_i32(const int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    void byte(const int value) {
+        m_code.push_back(static_cast<uint8_t>(value));
+    }
+
+    void imm32(const int64_t value) {
+        for (int i = 0; i < 4; i++) {
+            byte(static_cast<int>((value >> (i * 8)) & 0xff));
+        }
+    }
+
+    void imm64(const int64_t value) {
+        for (int i = 0; i < 8; i++) {
+            byte(static_cast<int>((value >> (i * 8)) & 0xff));
+        }
+    }
+
+    void patch32(const size_t pos, const int64_t value) {
+        for (int i = 0; i < 4; i++) {
+            m_code[pos + i] = static_cast<uint8_t>((value >> (i * 8)) & 0xff);
+        }
+    }
+
+    void rex(const bool wide, const int reg, const Reg rm, const int index = 0) {
+        const int prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((num(rm) & 8) ? 1 : 0);
+        if (prefix != 0x40) {
+            byte(prefix);
+        }
+    }
+
+    // Emits REX.W, the opcode bytes and a ModRM (plus SIB/displacement) addressing rm.
+    void encode_rm(const std::initializer_list<int> opcode, const int reg, const Operand &rm) {
+        const bool rip_relative = rm.kind == Operand::Kind::msg || rm.kind == Operand::Kind::label;
+        const Reg base = rip_relative ? Reg::rax : rm.reg;
+        const bool indexed = rm.kind == Operand::Kind::mem && rm.scale != 0;
+        rex(true, reg, base, indexed ? num(rm.index) : 0);
+        for (const int op: opcode) {
+            byte(op);
+        }
+
+        const int reg_bits = (reg & 7) << 3;
+        if (rm.kind == Operand::Kind::reg) {
+            byte(0xc0 | reg_bits | low_bits(base));
+            return;
+        }
+
+        if (rm.kind == Operand::Kind::msg) {
+            byte(0x05 | reg_bits);
+            m_msg_fixups.push_back(m_code.size());
+            imm32(0);
+            return;
+        }
+
+        if (rm.kind == Operand::Kind::label) {
+            byte(0x05 | reg_bits);
+            label_fixup(static_cast<int>(rm.value));
+            return;
+        }
+
+        const int64_t disp = rm.value;
+        int mod = 0x80;
+        if (disp == 0 && low_bits(base) != 5) {
+            mod = 0x00;
+        } else if (fits_i8(disp)) {
+            mod = 0x40;
+        }
+
+        if (indexed) {
+            const int scale_bits = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+            byte(mod | reg_bits | 4);
+            byte(scale_bits << 6 | low_bits(rm.index) << 3 | low_bits(base));
+        } else {
+            byte(mod | reg_bits | low_bits(base));
+            if (low_bits(base) == 4) {
+                byte(0x24);
+            }
+        }
+        if (mod == 0x40) {
+            byte(static_cast<int>(disp & 0xff));
+        } else if (mod == 0x80) {
+            imm32(disp);
+        }
+    }
+
+    void encode_mov(const Operand &dst, const Operand &src) {
+        if (src.kind == Operand::Kind::msg) {
+            encode_rm({0x8d}, num(dst.reg), src);
+            return;
+        }
+
+        if (src.kind == Operand::Kind::imm || src.kind == Operand::Kind::msg_len) {
+            const int64_t value = src.kind == Operand::Kind::imm
+                                      ? src.value
+                                      : static_cast<int64_t>(tle_message.size());
+            if (dst.kind == Operand::Kind::mem || fits_i32(value)) {
+                encode_rm({0xc7}, 0, dst);
+                imm32(value);
+            } else if (value >= 0 && value <= UINT32_MAX) {
+                rex(false, 0, dst.reg);
+                byte(0xb8 + low_bits(dst.reg));
+                imm32(value);
+            } else {
+                rex(true, 0, dst.reg);
+                byte(0xb8 + low_bits(dst.reg));
+                imm64(value);
+            }
+            return;
+        }
+
+        if (src.kind == Operand::Kind::reg) {
+            encode_rm({0x89}, num(src.reg), dst);
+        } else {
+            encode_rm({0x8b}, num(dst.reg), src);
+        }
+    }
+
+    // add/sub/cmp share one encoding scheme, selected by the ModRM extension digit.
+    void encode_alu(const int digit, const Operand &dst, const Operand &src) {
+        if (src.kind == Operand::Kind::imm) {
+            if (fits_i8(src.value)) {
+                encode_rm({0x83}, digit, dst);
+                byte(static_cast<int>(src.value & 0xff));
+            } else {
+                encode_rm({0x81}, digit, dst);
+                imm32(src.value);
+            }
+        } else if (src.kind == Operand::Kind::reg) {
+            encode_rm({digit << 3 | 0x01}, num(src.reg), dst);
+        } else {
+            encode_rm({digit << 3 | 0x03}, num(dst.reg), src);
+        }
+    }
+
+    // shl/shr/sar by an immediate count, selected by the ModRM extension digit.
+    void encode_shift(const int digit, const Operand &dst, const Operand &count) {
+        if (count.value == 1) {
+            encode_rm({0xd1}, digit, dst);
+        } else {
+            encode_rm({0xc1}, digit, dst);
+            byte(static_cast<int>(count.value & 0x3f));
+        }
+    }
+
+    void define_label(const int label) {
+        if (label >= m_labels.size()) {
+            m_labels.resize(label + 1, -1);
+        }
+        m_labels[label] = static_cast<int64_t>(m_code.size());
+    }
+
+    void label_fixup(const int label) {
+        m_fixups.emplace_back(m_code.size(), label);
+        imm32(0);
+    }
+
+    std::vector<uint8_t> m_code{};
+    std::vector<int64_t> m_labels{};
+    std::vector<std::pair<size_t, int>> m_fixups{};
+    std::vector<size_t> m_msg_fixups{};
+};
+
+// Writes a static, single-segment ELF64 executable whose entry point is the start of image.
+inline void write_elf(const std::string &path, const std::vector<uint8_t> &image) {
+    constexpr uint64_t base = 0x400000;
+    constexpr uint64_t header_size = 64 + 56;
+
+    std::vector<uint8_t> out(header_size);
+    const auto put = [&](const size_t pos, const uint64_t value, const int size) {
+        for (int i = 0; i < size; i++) {
+            out[pos + i] = static_cast<uint8_t>((value >> (i * 8)) & 0xff);
+        }
+    };
+
+    constexpr uint8_t ident[] = {0x7f, 'E', 'L', 'F', 2, 1, 1, 0};
+    std::memcpy(out.data(), ident, sizeof(ident));
+    put(16, 2, 2);                          // e_type: ET_EXEC
+    put(18, 0x3e, 2);                       // e_machine: x86-64
+    put(20, 1, 4);                          // e_version
+    put(24, base + header_size, 8);         // e_entry
+    put(32, 64, 8);                         // e_phoff
+    put(52, 64, 2);                         // e_ehsize
+    put(54, 56, 2);                         // e_phentsize
+    put(56, 1, 2);                          // e_phnum
+
+    put(64, 1, 4);                          // p_type: PT_LOAD
+    put(68, 5, 4);                          // p_flags: R + X
+    put(72, 0, 8);                          // p_offset
+    put(80, base, 8);                       // p_vaddr
+    put(88, base, 8);                       // p_paddr
+    put(96, header_size + image.size(), 8); // p_filesz
+    put(104, header_size + image.size(), 8);// p_memsz
+    put(112, 0x1000, 8);                    // p_align
+
+    {
+        OutputFile file(path.c_str());
+        file << std::string_view(reinterpret_cast<const char *>(out.data()), out.size());
+        file << std::string_view(reinterpret_cast<const char *>(image.data()), image.size());
+        file.close();
+    }
+
+    std::filesystem::permissions(path, std::filesystem::perms::owner_all | std::filesystem::perms::group_read |
+                                       std::filesystem::perms::group_exec | std::filesystem::perms::others_read |
+                                       std::filesystem::perms::others_exec);
+}
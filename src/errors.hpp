@@ -0,0 +1,10 @@
+#pragma once
+
+// Thrown once a compile error has been printed to std::cerr. The driver catches it per input, so a
+// bad file in a parallel batch fails on its own instead of taking the other jobs down with it.
+struct CompileError {
+};
+
+[[noreturn]] inline void fail() {
+    throw CompileError{};
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#include "parser.hpp"
+#include "symbols.hpp"
+
+class ConstantFolder {
+public:
+    explicit ConstantFolder(ExprPool &exprs) : m_exprs(exprs) {
+    }
+
+    std::optional<int64_t> fold_expr(const ExprIndex expr) {
+        std::optional<int64_t> value;
+        switch (m_exprs.kind(expr)) {
+            case ExprKind::int_lit:
+                return m_exprs.value(expr);
+            case ExprKind::ident:
+                value = lookup(m_exprs.ident(expr).symbol);
+                break;
+            case ExprKind::add:
+                value = fold_bin(expr, wrap_add);
+                if (!value.has_value()) {
+                    reassociate(expr);
+                }
+                break;
+            case ExprKind::sub:
+                value = fold_bin(expr, wrap_sub);
+                if (!value.has_value()) {
+                    reassociate(expr);
+                }
+                break;
+            case ExprKind::mul:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    return static_cast<int64_t>(static_cast<uint64_t>(lhs) * static_cast<uint64_t>(rhs));
+                });
+                break;
+            case ExprKind::div:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    if (rhs == 0 || (lhs == std::numeric_limits<int64_t>::min() && rhs == -1)) {
+                        return {};
+                    }
+                    return lhs / rhs;
+                });
+                break;
+            case ExprKind::greater:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    return lhs > rhs;
+                });
+                break;
+            case ExprKind::less:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    return lhs < rhs;
+                });
+                break;
+            case ExprKind::equal:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    return lhs == rhs;
+                });
+                break;
+            case ExprKind::greater_eq:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    return lhs >= rhs;
+                });
+                break;
+            case ExprKind::less_eq:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    return lhs <= rhs;
+                });
+                break;
+            case ExprKind::not_equal:
+                value = fold_bin(expr, [](const int64_t lhs, const int64_t rhs) -> std::optional<int64_t> {
+                    return lhs != rhs;
+                });
+                break;
+        }
+
+        if (value.has_value()) {
+            m_exprs.set_lit(expr, value.value());
+        }
+        return value;
+    }
+
+    void fold_scope(NodeStmtScope *scope) {
+        m_consts.begin_scope();
+        for (NodeStmt *stmt: scope->stmts) {
+            fold_stmt(stmt);
+        }
+        m_consts.end_scope();
+    }
+
+    void fold_if_pred(NodeStmtIfPred *pred) {
+        struct PredVisitor {
+            ConstantFolder &folder;
+
+            void operator()(NodeStmtIfPredElif *elif) const {
+                folder.fold_expr(elif->expr);
+                folder.fold_scope(elif->scope);
+                if (elif->pred.has_value()) {
+                    folder.fold_if_pred(elif->pred.value());
+                }
+            }
+
+            void operator()(NodeStmtIfPredElse *else_) const {
+                folder.fold_scope(else_->scope);
+            }
+        };
+
+        PredVisitor visitor{.folder = *this};
+        std::visit(visitor, pred->var);
+    }
+
+    void fold_stmt(NodeStmt *stmt) {
+        struct StmtVisitor {
+            ConstantFolder &folder;
+
+            void operator()(NodeStmtExit *stmt_exit) const {
+                folder.fold_expr(stmt_exit->expr);
+            }
+
+            void operator()(NodeStmtMay *stmt_may) const {
+                const auto value = folder.fold_expr(stmt_may->expr);
+                const Symbol symbol = stmt_may->ident.symbol;
+                if (value.has_value() && (symbol >= folder.m_assigned.size() || !folder.m_assigned[symbol])) {
+                    folder.m_consts.declare(symbol, value.value());
+                }
+            }
+
+            void operator()(NodeStmtAssign *stmt_assign) const {
+                folder.fold_expr(stmt_assign->expr);
+            }
+
+            void operator()(NodeStmtScope *stmt_scope) const {
+                folder.fold_scope(stmt_scope);
+            }
+
+            void operator()(NodeStmtIf *stmt_if) const {
+                folder.fold_expr(stmt_if->expr);
+                folder.fold_scope(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    folder.fold_if_pred(stmt_if->pred.value());
+                }
+            }
+
+            void operator()(NodeStmtWhile *stmt_while) const {
+                folder.fold_expr(stmt_while->expr);
+                folder.fold_scope(stmt_while->scope);
+            }
+
+            void operator()(NodeStmtFor *stmt_for) const {
+                folder.m_consts.begin_scope();
+                folder.fold_stmt(stmt_for->init);
+                folder.fold_expr(stmt_for->cond);
+                folder.fold_stmt(stmt_for->iter);
+                folder.fold_scope(stmt_for->scope);
+                folder.m_consts.end_scope();
+            }
+        };
+
+        StmtVisitor visitor{.folder = *this};
+        std::visit(visitor, stmt->var);
+    }
+
+    void fold_prog(NodeProg &prog) {
+        for (const NodeStmt &stmt: prog.stmts) {
+            collect_assigned(&stmt);
+        }
+
+        m_consts.begin_scope();
+        for (NodeStmt &stmt: prog.stmts) {
+            fold_stmt(&stmt);
+        }
+        m_consts.end_scope();
+    }
+
+private:
+    static std::optional<int64_t> wrap_add(const int64_t lhs, const int64_t rhs) {
+        return static_cast<int64_t>(static_cast<uint64_t>(lhs) + static_cast<uint64_t>(rhs));
+    }
+
+    static std::optional<int64_t> wrap_sub(const int64_t lhs, const int64_t rhs) {
+        return static_cast<int64_t>(static_cast<uint64_t>(lhs) - static_cast<uint64_t>(rhs));
+    }
+
+    template<typename Op>
+    std::optional<int64_t> fold_bin(const ExprIndex bin, Op op) {
+        const auto lhs = fold_expr(m_exprs.lhs(bin));
+        const auto rhs = fold_expr(m_exprs.rhs(bin));
+        if (!lhs.has_value() || !rhs.has_value()) {
+            return {};
+        }
+        return op(lhs.value(), rhs.value());
+    }
+
+    // (e + c1) + c2 and friends become e + (c1 + c2), so chains with a non-constant head still collapse.
+    // The combined constant overwrites the c2 literal, which keeps every node inside the range of bin.
+    void reassociate(const ExprIndex bin) {
+        const ExprIndex rhs = m_exprs.rhs(bin);
+        const ExprIndex inner = m_exprs.lhs(bin);
+        const auto c2 = m_exprs.lit_value(rhs);
+        const ExprKind inner_kind = m_exprs.kind(inner);
+        if (!c2.has_value() || (inner_kind != ExprKind::add && inner_kind != ExprKind::sub)) {
+            return;
+        }
+        const auto c1 = m_exprs.lit_value(m_exprs.rhs(inner));
+        if (!c1.has_value()) {
+            return;
+        }
+
+        const bool outer_add = m_exprs.kind(bin) == ExprKind::add;
+        const bool inner_add = inner_kind == ExprKind::add;
+        const int64_t k = wrap_add(inner_add ? c1.value() : wrap_sub(0, c1.value()).value(),
+                                   outer_add ? c2.value() : wrap_sub(0, c2.value()).value()).value();
+        m_exprs.set_lit(rhs, outer_add ? k : wrap_sub(0, k).value());
+        m_exprs.set_operands(bin, m_exprs.lhs(inner), rhs);
+    }
+
+    [[nodiscard]] std::optional<int64_t> lookup(const Symbol symbol) const {
+        if (const int64_t *value = m_consts.find(symbol)) {
+            return *value;
+        }
+        return {};
+    }
+
+    void collect_assigned(const NodeStmt *stmt) {
+        struct AssignVisitor {
+            ConstantFolder &folder;
+
+            void operator()(const NodeStmtExit *) const {
+            }
+
+            void operator()(const NodeStmtMay *) const {
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                const Symbol symbol = stmt_assign->ident.symbol;
+                if (symbol >= folder.m_assigned.size()) {
+                    folder.m_assigned.resize(symbol + 1);
+                }
+                folder.m_assigned[symbol] = true;
+            }
+
+            void operator()(const NodeStmtScope *stmt_scope) const {
+                for (const NodeStmt *stmt: stmt_scope->stmts) {
+                    folder.collect_assigned(stmt);
+                }
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                (*this)(stmt_if->scope);
+                std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                        (*this)((*elif)->scope);
+                        pred = (*elif)->pred;
+                    } else {
+                        (*this)(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope);
+                        pred = {};
+                    }
+                }
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                (*this)(stmt_while->scope);
+            }
+
+            void operator()(const NodeStmtFor *stmt_for) const {
+                folder.collect_assigned(stmt_for->init);
+                folder.collect_assigned(stmt_for->iter);
+                (*this)(stmt_for->scope);
+            }
+        };
+
+        AssignVisitor visitor{.folder = *this};
+        std::visit(visitor, stmt->var);
+    }
+
+    ExprPool &m_exprs;
+    std::vector<bool> m_assigned{};
+    ScopedSymbolTable<int64_t> m_consts{};
+};
@@ -1,449 +1,721 @@
-#pragma once
-
-#include "parser.hpp"
-#include <algorithm>
-#include <assert.h>
-
-class Generator {
-public:
-    explicit Generator(NodeProg prog) : m_prog(std::move(prog)) {
-    }
-
-    void gen_term(const NodeTerm *term) {
-        struct TermVisitor {
-            Generator &gen;
-
-            void operator()(const NodeTermIntLit *term_int_lit) const {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeTermIdent *term_ident) const {
-                const auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(),
-                                             [&](const Vars &var) {
-                                                 return var.name == term_ident->ident.value.value();
-                                             });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "ERROR: Unknown identifier '" << term_ident->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]";
-                gen.push(offset.str());
-            }
-
-            void operator()(const NodeTermParen *term_paren) const {
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-
-
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
-    }
-
-    void gen_bin_expr(const NodeBinExpr *bin_expr) {
-        struct BinExprVisitor {
-            Generator &gen;
-
-            void operator()(const BinExprAdd *expr_add) const {
-                gen.gen_expr(expr_add->rhs);
-                gen.gen_expr(expr_add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprMulti *expr_multi) const {
-                gen.gen_expr(expr_multi->rhs);
-                gen.gen_expr(expr_multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprSub *expr_sub) const {
-                gen.gen_expr(expr_sub->rhs);
-                gen.gen_expr(expr_sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprDiv *expr_div) const {
-                gen.gen_expr(expr_div->rhs);
-                gen.gen_expr(expr_div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprGreater *expr_greater) const {
-                gen.gen_expr(expr_greater->rhs);
-                gen.gen_expr(expr_greater->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string label = gen.create_label();
-                const std::string newLabel = gen.create_label();
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    jg " << label << "\n";
-                gen.m_output << "    mov rax, 0\n";
-                gen.m_output << "    jmp " << newLabel << "\n\n";
-                gen.m_output << label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << newLabel << ":\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprLess *less) const {
-                gen.gen_expr(less->rhs);
-                gen.gen_expr(less->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string label = gen.create_label();
-                const std::string newLabel = gen.create_label();
-
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    jl " << label << "\n";
-                gen.m_output << "    mov rax, 0\n";
-                gen.m_output << "    jmp " << newLabel << "\n\n";
-                gen.m_output << label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << newLabel << ":\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprEqual *expr_equal) const {
-                gen.gen_expr(expr_equal->rhs);
-                gen.gen_expr(expr_equal->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string label = gen.create_label();
-                const std::string newLabel = gen.create_label();
-
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    je " << label << "\n";
-                gen.m_output << "    mov rax, 0\n";
-                gen.m_output << "    jmp " << newLabel << "\n\n";
-                gen.m_output << label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << newLabel << ":\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprGreaterEqual *expr_greater_equal) const {
-                gen.gen_expr(expr_greater_equal->rhs);
-                gen.gen_expr(expr_greater_equal->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string label = gen.create_label();
-                const std::string newLabel = gen.create_label();
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    jge " << label << "\n";
-                gen.m_output << "    mov rax, 0\n";
-                gen.m_output << "    jmp " << newLabel << "\n\n";
-                gen.m_output << label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << newLabel << ":\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprLessEqual *expr_less_equal) const {
-                gen.gen_expr(expr_less_equal->rhs);
-                gen.gen_expr(expr_less_equal->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string label = gen.create_label();
-                const std::string newLabel = gen.create_label();
-
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    jle " << label << "\n";
-                gen.m_output << "    mov rax, 0\n";
-                gen.m_output << "    jmp " << newLabel << "\n\n";
-                gen.m_output << label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << newLabel << ":\n";
-                gen.push("rax");
-            }
-
-            void operator()(const BinExprNotEqual *expr_not_equal) const {
-                gen.gen_expr(expr_not_equal->rhs);
-                gen.gen_expr(expr_not_equal->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                const std::string label = gen.create_label();
-                const std::string newLabel = gen.create_label();
-
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    jne " << label << "\n";
-                gen.m_output << "    mov rax, 0\n";
-                gen.m_output << "    jmp " << newLabel << "\n\n";
-                gen.m_output << label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << newLabel << ":\n";
-                gen.push("rax");
-            }
-        };
-
-        BinExprVisitor visitor({.gen = *this});
-        std::visit(visitor, bin_expr->var);
-    }
-
-    void gen_scope(const NodeStmtScope *scope) {
-        begin_scopes();
-        for (const NodeStmt *stmt: scope->stmts) {
-            gen_stmt(stmt);
-        }
-        end_scopes();
-    }
-
-    void gen_expr(const NodeExpr *expr) {
-        struct ExprVisitor {
-            Generator &gen;
-
-            void operator()(const NodeTerm *term) const {
-                gen.gen_term(term);
-            }
-
-            void operator()(const NodeBinExpr *bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
-            }
-        };
-
-        ExprVisitor visitor{.gen = *this};
-        std::visit(visitor, expr->var);
-    }
-
-    void gen_if_pred(const NodeStmtIfPred *pred, const std::string &end_label) {
-        struct PredVisitor {
-            Generator &gen;
-            const std::string &end_label;
-
-            void operator()(const NodeStmtIfPredElif *elif) const {
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << label << ":\n";
-                if (elif->pred.has_value()) {
-                    gen.gen_if_pred(elif->pred.value(), end_label);
-                }
-            }
-
-            void operator()(const NodeStmtIfPredElse *else_) const {
-                gen.gen_scope(else_->scope);
-            }
-        };
-
-        PredVisitor visitor{.gen = *this, .end_label = end_label};
-        std::visit(visitor, pred->var);
-    }
-
-    void gen_stmt(const NodeStmt *stmt) {
-        struct StmtVisitor {
-            Generator &gen;
-
-            void operator()(const NodeStmtExit *stmt_exit) const {
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-            }
-
-            void operator()(const NodeStmtMay *stmt_may) const {
-                const auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(),
-                            [&](const Vars &var) { return var.name == stmt_may->ident.value.value(); });
-
-                if (it != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_may->ident.value.value() << "\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({.name = stmt_may->ident.value.value(), .stack_loc = gen.m_stack_size});
-                gen.gen_expr(stmt_may->expr);
-            }
-
-            void operator()(const NodeStmtAssign *stmt_assign) const {
-                const auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(),
-                                [&](const Vars &var) {return var.name == stmt_assign->ident.value.value();});
-
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared Identifier" << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
-            }
-
-            void operator()(const NodeStmtScope *stmt_scope) const {
-                gen.gen_scope(stmt_scope);
-            }
-
-            void operator()(const NodeStmtIf *stmt_if) const {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
-                } else {
-                    gen.m_output << label << ":\n";
-                }
-            }
-
-            void operator()(const NodeStmtWhile *stmt_while) const {
-                const std::string begin_label = gen.create_label();
-                const std::string tle_label = gen.create_label();
-                const std::string end_label = gen.create_label();
-                gen.m_output << "    mov rcx, 1000000000\n";
-
-                gen.m_output << begin_label << ":\n";
-                gen.gen_expr(stmt_while->expr);
-                gen.pop("rax");
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << end_label << "\n";
-                gen.m_output << "    dec rcx\n";
-                gen.m_output << "    cmp rcx, $0\n";
-                gen.m_output << "    jle " << tle_label << "\n";
-
-                gen.gen_scope(stmt_while->scope);
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jnz " << begin_label << "\n";
-
-                gen.m_output << tle_label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << "    mov rdi, 1\n";
-                gen.m_output << "    mov rsi, msg\n";
-                gen.m_output << "    mov rdx, len\n";
-                gen.m_output << "    syscall\n";
-
-                gen.m_output << "    mov rax, 60\n";
-                gen.m_output << "    mov rdi, 0\n";
-                gen.m_output << "    syscall\n";
-
-                gen.m_output << end_label << ":\n";
-            }
-
-            void operator()(const NodeStmtFor* for_stmt) const {
-                gen.begin_scopes();
-    
-                const std::string start_label = gen.create_label();
-                const std::string end_label = gen.create_label();        
-                const std::string increment_label = gen.create_label();  
-                const std::string tle_label = gen.create_label();        
-            
-                gen.m_output << "    mov rcx, 1000000000\n";  
-            
-                gen.gen_stmt(for_stmt->init);
-                gen.m_output << "    jmp " << start_label << "\n";
-            
-                gen.m_output << start_label << ":\n";
-                gen.gen_expr(for_stmt->cond);
-                gen.pop("rax");
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << end_label << "\n";
-            
-                gen.m_output << "    dec rcx\n";
-                gen.m_output << "    cmp rcx, $0\n";
-                gen.m_output << "    jle " << tle_label << "\n";
-            
-                gen.gen_scope(for_stmt->scope);
-            
-                gen.m_output << increment_label << ":\n";
-                gen.gen_stmt(for_stmt->iter);
-                gen.m_output << "    jmp " << start_label << "\n";
-            
-                gen.m_output << tle_label << ":\n";
-                gen.m_output << "    mov rax, 1\n";
-                gen.m_output << "    mov rdi, 1\n";
-                gen.m_output << "    mov rsi, msg\n";
-                gen.m_output << "    mov rdx, len\n";
-                gen.m_output << "    syscall\n";
-            
-                gen.m_output << "    mov rax, 60\n";
-                gen.m_output << "    mov rdi, 0\n";
-                gen.m_output << "    syscall\n";
-            
-                gen.m_output << end_label << ":\n";
-                gen.end_scopes();
-            }                    
-        };
-
-        StmtVisitor visitor{.gen = *this};
-        std::visit(visitor, stmt->var);
-    }
-
-    [[nodiscard]] std::string gen_prog() {
-        std::stringstream output;
-        m_output << "section .data\n";
-        m_output << "    msg db \"Oops! Time Limit Exceeded, check your logic\", 0xa\n";
-        m_output << "    len EQU $ - msg\n";
-
-        m_output << "\nsection .text\n";
-        m_output << "    global _start\n_start:\n";
-
-        for (const NodeStmt &stmt: m_prog.stmts) {
-            gen_stmt(&stmt);
-        }
-
-        return m_output.str();
-    }
-
-private:
-    void push(const std::string &reg) {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
-    }
-
-    void pop(const std::string &reg) {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
-    }
-
-    void begin_scopes() {
-        m_scopes.push_back(m_vars.size());
-    }
-
-    void end_scopes() {
-        const size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-        m_stack_size -= pop_count;
-
-        for (int i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
-        }
-
-        m_scopes.pop_back();
-    }
-
-    struct Vars {
-        std::string name;
-        size_t stack_loc;
-    };
-
-    std::string create_label() {
-        return "label" + std::to_string(m_label_count++);
-    }
-
-    const NodeProg m_prog;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
-    std::vector<Vars> m_vars{};
-    std::vector<size_t> m_scopes{};
-    int m_label_count = 0;
-};
+#pragma once
+
+#include "assembly.hpp"
+#include "errors.hpp"
+#include "parser.hpp"
+#include "runtime.hpp"
+#include "symbols.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <functional>
+#include <assert.h>
+#include <unordered_map>
+
+class Generator {
+public:
+    Generator(NodeProg prog, AsmSink &out, const GenOptions options = {})
+        : m_prog(std::move(prog)), m_out(out), m_options(options) {
+    }
+
+    Reg gen_expr(const ExprIndex expr) {
+        switch (m_exprs.kind(expr)) {
+            case ExprKind::int_lit: {
+                const Reg reg = alloc_reg();
+                emit(Op::mov, reg_op(reg), imm_op(m_exprs.value(expr)));
+                return reg;
+            }
+            case ExprKind::ident: {
+                const Reg reg = alloc_reg();
+                emit(Op::mov, reg_op(reg), var_operand(find_var(m_exprs.ident(expr))));
+                return reg;
+            }
+            case ExprKind::add:
+                if (is_lit(m_exprs.lhs(expr))) {
+                    return gen_arith(Op::add, m_exprs.rhs(expr), m_exprs.lhs(expr));
+                }
+                return gen_arith(Op::add, m_exprs.lhs(expr), m_exprs.rhs(expr));
+            case ExprKind::sub:
+                return gen_arith(Op::sub, m_exprs.lhs(expr), m_exprs.rhs(expr));
+            case ExprKind::mul:
+                return gen_mul(m_exprs.lhs(expr), m_exprs.rhs(expr));
+            case ExprKind::div:
+                return gen_div(m_exprs.lhs(expr), m_exprs.rhs(expr));
+            default:
+                if (is_lit(m_exprs.lhs(expr))) {
+                    return gen_cmp(mirror(cmp_cond(m_exprs.kind(expr)).value()), m_exprs.rhs(expr), m_exprs.lhs(expr));
+                }
+                return gen_cmp(cmp_cond(m_exprs.kind(expr)).value(), m_exprs.lhs(expr), m_exprs.rhs(expr));
+        }
+    }
+
+    void gen_scope(const NodeStmtScope *scope) {
+        begin_scopes();
+        for (const NodeStmt *stmt: scope->stmts) {
+            gen_stmt(stmt);
+        }
+        end_scopes();
+    }
+
+    // Jumps to label when expr is false. Comparisons compile to a cmp and the inverted jcc instead of
+    // materialising a boolean first.
+    void gen_jump_unless(const ExprIndex expr, const int label) {
+        if (const std::optional<Cond> cond = cmp_cond(m_exprs.kind(expr))) {
+            const bool swap = is_lit(m_exprs.lhs(expr));
+            const Operands operands = swap ? gen_operands(m_exprs.rhs(expr), m_exprs.lhs(expr))
+                                           : gen_operands(m_exprs.lhs(expr), m_exprs.rhs(expr));
+            release_reg(operands.reg);
+            emit(Op::cmp, reg_op(operands.reg), operands.rhs);
+            drop_spill(operands);
+            emit_jump(invert(swap ? mirror(cond.value()) : cond.value()), label);
+            return;
+        }
+
+        const Reg reg = gen_expr(expr);
+        release_reg(reg);
+        emit(Op::test, reg_op(reg), reg_op(reg));
+        emit_jump(Cond::e, label);
+    }
+
+    void gen_if_pred(const NodeStmtIfPred *pred, const int end_label) {
+        struct PredVisitor {
+            Generator &gen;
+            const int end_label;
+
+            void operator()(const NodeStmtIfPredElif *elif) const {
+                const int label = gen.create_label();
+                gen.gen_jump_unless(elif->expr, label);
+                gen.gen_scope(elif->scope);
+                gen.emit(Op::jmp, label_op(end_label));
+                gen.emit(Op::label, label_op(label));
+                if (elif->pred.has_value()) {
+                    gen.gen_if_pred(elif->pred.value(), end_label);
+                }
+            }
+
+            void operator()(const NodeStmtIfPredElse *else_) const {
+                gen.gen_scope(else_->scope);
+            }
+        };
+
+        PredVisitor visitor{.gen = *this, .end_label = end_label};
+        std::visit(visitor, pred->var);
+    }
+
+    void gen_stmt(const NodeStmt *stmt) {
+        struct StmtVisitor {
+            Generator &gen;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                const Reg reg = gen.gen_expr(stmt_exit->expr);
+                gen.release_reg(reg);
+                gen.emit(Op::mov, reg_op(Reg::rax), imm_op(60));
+                gen.emit(Op::mov, reg_op(Reg::rdi), reg_op(reg));
+                gen.emit(Op::syscall);
+            }
+
+            void operator()(const NodeStmtMay *stmt_may) const {
+                if (gen.m_vars.find(stmt_may->ident.symbol) != nullptr) {
+                    std::cerr << "Identifier already used: " << stmt_may->ident.value << "\n";
+                    fail();
+                }
+
+                const auto var_reg = gen.m_var_regs.find(stmt_may);
+                if (var_reg != gen.m_var_regs.end()) {
+                    gen.gen_expr_into(stmt_may->expr, var_reg->second);
+                    gen.m_vars.declare(stmt_may->ident.symbol, {.stack_loc = 0, .reg = var_reg->second});
+                } else {
+                    const Reg reg = gen.gen_expr(stmt_may->expr);
+                    gen.release_reg(reg);
+                    gen.m_vars.declare(stmt_may->ident.symbol, {.stack_loc = gen.m_stack_size});
+                    gen.push(reg);
+                }
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                const Vars *it = gen.m_vars.find(stmt_assign->ident.symbol);
+                if (it == nullptr) {
+                    std::cerr << "Undeclared Identifier" << stmt_assign->ident.value << std::endl;
+                    fail();
+                }
+
+                if (it->reg.has_value()) {
+                    gen.gen_expr_into(stmt_assign->expr, it->reg.value());
+                } else {
+                    const Reg reg = gen.gen_expr(stmt_assign->expr);
+                    gen.release_reg(reg);
+                    gen.emit(Op::mov, gen.var_operand(*it), reg_op(reg));
+                }
+            }
+
+            void operator()(const NodeStmtScope *stmt_scope) const {
+                gen.gen_scope(stmt_scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                const int label = gen.create_label();
+                gen.gen_jump_unless(stmt_if->expr, label);
+                gen.gen_scope(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    const int end_label = gen.create_label();
+                    gen.emit(Op::jmp, label_op(end_label));
+                    gen.emit(Op::label, label_op(label));
+                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
+                    gen.emit(Op::label, label_op(end_label));
+                } else {
+                    gen.emit(Op::label, label_op(label));
+                }
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                const int begin_label = gen.create_label();
+                const std::optional<int> tle_label = gen.gen_guard_init();
+                const int end_label = gen.create_label();
+
+                gen.emit(Op::label, label_op(begin_label));
+                gen.gen_jump_unless(stmt_while->expr, end_label);
+                gen.gen_guard_check(tle_label);
+
+                gen.gen_scope(stmt_while->scope);
+                gen.emit(Op::jmp, label_op(begin_label));
+
+                gen.gen_guard_exit(tle_label);
+
+                gen.emit(Op::label, label_op(end_label));
+            }
+
+            void operator()(const NodeStmtFor* for_stmt) const {
+                gen.begin_scopes();
+
+                const int start_label = gen.create_label();
+                const int end_label = gen.create_label();
+                const int increment_label = gen.create_label();
+                const std::optional<int> tle_label = gen.gen_guard_init();
+
+                gen.gen_stmt(for_stmt->init);
+                gen.emit(Op::jmp, label_op(start_label));
+
+                gen.emit(Op::label, label_op(start_label));
+                gen.gen_jump_unless(for_stmt->cond, end_label);
+                gen.gen_guard_check(tle_label);
+
+                gen.gen_scope(for_stmt->scope);
+
+                gen.emit(Op::label, label_op(increment_label));
+                gen.gen_stmt(for_stmt->iter);
+                gen.emit(Op::jmp, label_op(start_label));
+
+                gen.gen_guard_exit(tle_label);
+
+                gen.emit(Op::label, label_op(end_label));
+                gen.end_scopes();
+            }
+        };
+
+        StmtVisitor visitor{.gen = *this};
+        std::visit(visitor, stmt->var);
+    }
+
+    void gen_prog() {
+        m_reg_need.assign(m_exprs.size(), 0);
+        alloc_vars();
+        if (m_options.watchdog_ms.has_value()) {
+            gen_watchdog(m_options.watchdog_ms.value());
+        }
+        begin_scopes();
+        for (const NodeStmt &stmt: m_prog.stmts) {
+            gen_stmt(&stmt);
+        }
+    }
+
+    // Instructions emitted so far, not counting labels.
+    [[nodiscard]] size_t instruction_count() const {
+        return m_instr_count;
+    }
+
+private:
+    struct Vars {
+        size_t stack_loc;
+        std::optional<Reg> reg{};
+    };
+
+    // Live range of a `may` variable, from its declaration to the end of its scope.
+    struct Interval {
+        const NodeStmtMay *may;
+        size_t start;
+        size_t end;
+    };
+
+    void emit(const Op op, const Operand dst = {}, const Operand src = {}) {
+        m_instr_count += op != Op::label;
+        m_out.emit({.op = op, .dst = dst, .src = src});
+    }
+
+    void emit_jump(const Cond cond, const int label) {
+        m_instr_count++;
+        m_out.emit({.op = Op::jcc, .dst = label_op(label), .cond = cond});
+    }
+
+    void emit_set(const Cond cond, const Reg reg) {
+        m_instr_count += 2;
+        m_out.emit({.op = Op::setcc, .dst = reg_op(reg), .cond = cond});
+        m_out.emit({.op = Op::movzx, .dst = reg_op(reg), .src = reg_op(reg)});
+    }
+
+    void push(const Reg reg) {
+        emit(Op::push, reg_op(reg));
+        m_stack_size++;
+    }
+
+    void pop(const Reg reg) {
+        emit(Op::pop, reg_op(reg));
+        m_stack_size--;
+    }
+
+    // The rcx guard caps each loop at 1e9 iterations. Watchdog builds leave loops unguarded.
+    std::optional<int> gen_guard_init() {
+        if (m_options.watchdog_ms.has_value()) {
+            return {};
+        }
+        const int tle_label = create_label();
+        emit(Op::mov, reg_op(Reg::rcx), imm_op(1000000000));
+        return tle_label;
+    }
+
+    void gen_guard_check(const std::optional<int> tle_label) {
+        if (tle_label.has_value()) {
+            emit(Op::dec, reg_op(Reg::rcx));
+            emit(Op::cmp, reg_op(Reg::rcx), imm_op(0));
+            emit_jump(Cond::le, tle_label.value());
+        }
+    }
+
+    void gen_guard_exit(const std::optional<int> tle_label) {
+        if (tle_label.has_value()) {
+            emit(Op::label, label_op(tle_label.value()));
+            m_instr_count += emit_tle_exit(m_out);
+        }
+    }
+
+    void gen_watchdog(const uint64_t ms) {
+        const int handler_label = create_label();
+        const int start_label = create_label();
+        m_instr_count += emit_watchdog(m_out, ms, handler_label, start_label);
+    }
+
+    Reg alloc_reg() {
+        assert(!m_free_regs.empty());
+        const Reg reg = m_free_regs.back();
+        m_free_regs.pop_back();
+        return reg;
+    }
+
+    void release_reg(const Reg reg) {
+        m_free_regs.push_back(reg);
+    }
+
+    const Vars &find_var(const Token &ident) const {
+        const Vars *it = m_vars.find(ident.symbol);
+        if (it == nullptr) {
+            std::cerr << "ERROR: Unknown identifier '" << ident.value << "'\n";
+            fail();
+        }
+        return *it;
+    }
+
+    [[nodiscard]] Operand var_operand(const Vars &var) const {
+        if (var.reg.has_value()) {
+            return reg_op(var.reg.value());
+        }
+        return stack_op(static_cast<int64_t>((m_stack_size - var.stack_loc - 1) * 8));
+    }
+
+    static bool fits_i32(const int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    // A literal that can be an operator's imm32, which add and cmp take on their right.
+    [[nodiscard]] bool is_lit(const ExprIndex expr) const {
+        return m_exprs.kind(expr) == ExprKind::int_lit && fits_i32(m_exprs.value(expr));
+    }
+
+    // An identifier on the right of an operator can be used in place, without loading it into a scratch register,
+    // and so can an imm32 literal unless imm is clear (idiv has no immediate form).
+    [[nodiscard]] std::optional<Operand> direct_operand(const ExprIndex expr, const bool imm = true) const {
+        if (m_exprs.kind(expr) == ExprKind::ident) {
+            return var_operand(find_var(m_exprs.ident(expr)));
+        }
+        if (imm && is_lit(expr)) {
+            return imm_op(m_exprs.value(expr));
+        }
+        return {};
+    }
+
+    // The condition a comparison tests for, or nothing for arithmetic and leaves.
+    static std::optional<Cond> cmp_cond(const ExprKind kind) {
+        switch (kind) {
+            case ExprKind::greater: return Cond::g;
+            case ExprKind::less: return Cond::l;
+            case ExprKind::equal: return Cond::e;
+            case ExprKind::greater_eq: return Cond::ge;
+            case ExprKind::less_eq: return Cond::le;
+            case ExprKind::not_equal: return Cond::ne;
+            default: return {};
+        }
+    }
+
+    // Sethi-Ullman number: scratch registers needed to evaluate expr without spilling. Memoised per
+    // node, with 0 meaning not yet computed.
+    int reg_need(const ExprIndex expr) {
+        if (m_reg_need[expr] != 0) {
+            return m_reg_need[expr];
+        }
+
+        int need = 1;
+        const ExprKind kind = m_exprs.kind(expr);
+        if (kind != ExprKind::int_lit && kind != ExprKind::ident) {
+            ExprIndex lhs = m_exprs.lhs(expr);
+            ExprIndex rhs = m_exprs.rhs(expr);
+            // gen_expr moves a literal on the left of add or a comparison over to the right.
+            if ((kind == ExprKind::add || cmp_cond(kind).has_value()) && is_lit(lhs)) {
+                std::swap(lhs, rhs);
+            }
+
+            const int lhs_need = reg_need(lhs);
+            if (direct_operand(rhs, kind != ExprKind::div).has_value()) {
+                need = lhs_need;
+            } else {
+                const int rhs_need = reg_need(rhs);
+                need = lhs_need == rhs_need ? lhs_need + 1 : std::max(lhs_need, rhs_need);
+            }
+        }
+
+        m_reg_need[expr] = need;
+        return need;
+    }
+
+    struct Operands {
+        Reg reg;
+        Operand rhs;
+        bool spilled = false;
+    };
+
+    // Evaluates lhs and rhs in Sethi-Ullman order. Returns the register holding lhs and the rhs operand;
+    // when both sides need more registers than are free, rhs is spilled and left at [rsp]. The spill slot
+    // is dropped with lea so the flags of a following cmp survive.
+    Operands gen_operands(const ExprIndex lhs, const ExprIndex rhs, const bool imm = true) {
+        if (const auto operand = direct_operand(rhs, imm)) {
+            const Reg reg = gen_expr(lhs);
+            return {reg, operand.value()};
+        }
+
+        const int lhs_need = reg_need(lhs);
+        const int rhs_need = reg_need(rhs);
+        const int free = static_cast<int>(m_free_regs.size());
+
+        if (std::min(lhs_need, rhs_need) >= free) {
+            const Reg rhs_reg = gen_expr(rhs);
+            release_reg(rhs_reg);
+            push(rhs_reg);
+            const Reg reg = gen_expr(lhs);
+            return {reg, stack_op(0), true};
+        }
+
+        if (lhs_need >= rhs_need) {
+            const Reg reg = gen_expr(lhs);
+            const Reg rhs_reg = gen_expr(rhs);
+            release_reg(rhs_reg);
+            return {reg, reg_op(rhs_reg)};
+        }
+
+        const Reg rhs_reg = gen_expr(rhs);
+        const Reg reg = gen_expr(lhs);
+        release_reg(rhs_reg);
+        return {reg, reg_op(rhs_reg)};
+    }
+
+    // Literals are moved straight into a register destination, skipping the scratch register.
+    void gen_expr_into(const ExprIndex expr, const Reg dest) {
+        if (m_exprs.kind(expr) == ExprKind::int_lit) {
+            emit(Op::mov, reg_op(dest), imm_op(m_exprs.value(expr)));
+            return;
+        }
+
+        const Reg reg = gen_expr(expr);
+        release_reg(reg);
+        emit(Op::mov, reg_op(dest), reg_op(reg));
+    }
+
+    void drop_spill(const Operands &operands) {
+        if (operands.spilled) {
+            emit(Op::lea, reg_op(Reg::rsp), stack_op(8));
+            m_stack_size--;
+        }
+    }
+
+    Reg gen_arith(const Op op, const ExprIndex lhs, const ExprIndex rhs) {
+        const Operands operands = gen_operands(lhs, rhs, op != Op::idiv);
+        if (op == Op::idiv) {
+            emit(Op::mov, reg_op(Reg::rax), reg_op(operands.reg));
+            emit(Op::cqo);
+            emit(Op::idiv, operands.rhs);
+            emit(Op::mov, reg_op(operands.reg), reg_op(Reg::rax));
+        } else {
+            emit(op, reg_op(operands.reg), operands.rhs);
+        }
+        drop_spill(operands);
+        return operands.reg;
+    }
+
+    // Multiplying by a constant: shifts and lea for factors of the form {1,3,5,9} * 2^k, otherwise
+    // imul with an immediate when the factor fits in one.
+    Reg gen_mul(const ExprIndex lhs, const ExprIndex rhs) {
+        std::optional<int64_t> factor = m_exprs.lit_value(rhs);
+        ExprIndex operand = lhs;
+        if (!factor.has_value()) {
+            factor = m_exprs.lit_value(lhs);
+            operand = rhs;
+        }
+        if (!factor.has_value()) {
+            return gen_arith(Op::imul, lhs, rhs);
+        }
+
+        const uint64_t magnitude = *factor < 0 ? 0 - static_cast<uint64_t>(*factor) : *factor;
+        const int shift = magnitude == 0 ? 0 : std::countr_zero(magnitude);
+        const uint64_t odd = magnitude >> shift;
+        const bool fits_imm = fits_i32(*factor);
+        if (magnitude != 0 && odd != 1 && odd != 3 && odd != 5 && odd != 9 && !fits_imm) {
+            return gen_arith(Op::imul, lhs, rhs);
+        }
+
+        const Reg reg = gen_expr(operand);
+        if (magnitude == 0) {
+            emit(Op::mov, reg_op(reg), imm_op(0));
+        } else if (odd == 1 || odd == 3 || odd == 5 || odd == 9) {
+            if (odd != 1) {
+                emit(Op::lea, reg_op(reg), scaled_op(reg, reg, static_cast<int>(odd - 1)));
+            }
+            if (shift != 0) {
+                emit(Op::shl, reg_op(reg), imm_op(shift));
+            }
+            if (*factor < 0) {
+                emit(Op::neg, reg_op(reg));
+            }
+        } else {
+            emit(Op::imul, reg_op(reg), imm_op(*factor));
+        }
+        return reg;
+    }
+
+    // Signed division by a constant, truncating toward zero like idiv. Powers of two bias negative
+    // dividends by 2^k - 1 and shift; other divisors multiply by a magic reciprocal (Hacker's Delight
+    // 10-1) and keep the high half. rax and rdx are free here, as they are reserved for idiv anyway.
+    // Dividing by 0 or -1 still goes through idiv so that the trap is preserved.
+    Reg gen_div(const ExprIndex lhs, const ExprIndex rhs) {
+        const std::optional<int64_t> divisor = m_exprs.lit_value(rhs);
+        if (!divisor.has_value() || *divisor == 0 || *divisor == -1) {
+            return gen_arith(Op::idiv, lhs, rhs);
+        }
+
+        const Reg reg = gen_expr(lhs);
+        const uint64_t magnitude = *divisor < 0 ? 0 - static_cast<uint64_t>(*divisor) : *divisor;
+        if (std::has_single_bit(magnitude)) {
+            const int shift = std::countr_zero(magnitude);
+            if (shift != 0) {
+                emit(Op::mov, reg_op(Reg::rax), reg_op(reg));
+                if (shift > 1) {
+                    emit(Op::sar, reg_op(Reg::rax), imm_op(63));
+                }
+                emit(Op::shr, reg_op(Reg::rax), imm_op(64 - shift));
+                emit(Op::add, reg_op(reg), reg_op(Reg::rax));
+                emit(Op::sar, reg_op(reg), imm_op(shift));
+            }
+            if (*divisor < 0) {
+                emit(Op::neg, reg_op(reg));
+            }
+            return reg;
+        }
+
+        const auto [magic, shift] = signed_magic(*divisor);
+        emit(Op::mov, reg_op(Reg::rax), imm_op(magic));
+        emit(Op::imul, reg_op(reg));
+        if (*divisor > 0 && magic < 0) {
+            emit(Op::add, reg_op(Reg::rdx), reg_op(reg));
+        } else if (*divisor < 0 && magic > 0) {
+            emit(Op::sub, reg_op(Reg::rdx), reg_op(reg));
+        }
+        if (shift != 0) {
+            emit(Op::sar, reg_op(Reg::rdx), imm_op(shift));
+        }
+        emit(Op::mov, reg_op(Reg::rax), reg_op(Reg::rdx));
+        emit(Op::shr, reg_op(Reg::rax), imm_op(63));
+        emit(Op::add, reg_op(Reg::rdx), reg_op(Reg::rax));
+        emit(Op::mov, reg_op(reg), reg_op(Reg::rdx));
+        return reg;
+    }
+
+    // Magic multiplier and post-shift for signed 64-bit division by d, where |d| >= 2 is not a power of two.
+    static std::pair<int64_t, int> signed_magic(const int64_t d) {
+        constexpr uint64_t two63 = 1ULL << 63;
+        const uint64_t ad = d < 0 ? 0 - static_cast<uint64_t>(d) : d;
+        const uint64_t t = two63 + (static_cast<uint64_t>(d) >> 63);
+        const uint64_t anc = t - 1 - t % ad;
+        int p = 63;
+        uint64_t q1 = two63 / anc;
+        uint64_t r1 = two63 - q1 * anc;
+        uint64_t q2 = two63 / ad;
+        uint64_t r2 = two63 - q2 * ad;
+        uint64_t delta;
+        do {
+            p++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= anc) {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= ad) {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+
+        const uint64_t magic = q2 + 1;
+        return {static_cast<int64_t>(d < 0 ? 0 - magic : magic), p - 64};
+    }
+
+    Reg gen_cmp(const Cond cond, const ExprIndex lhs, const ExprIndex rhs) {
+        const Operands operands = gen_operands(lhs, rhs);
+        emit(Op::cmp, reg_op(operands.reg), operands.rhs);
+        drop_spill(operands);
+        emit_set(cond, operands.reg);
+        return operands.reg;
+    }
+
+    void begin_scopes() {
+        m_vars.begin_scope();
+    }
+
+    void end_scopes() {
+        const auto scope = m_vars.scope_entries();
+        const size_t pop_count = std::count_if(scope.begin(), scope.end(),
+                                               [](const auto &entry) { return !entry.value.reg.has_value(); });
+        emit(Op::add, reg_op(Reg::rsp), imm_op(static_cast<int64_t>(pop_count * 8)));
+        m_stack_size -= pop_count;
+
+        m_vars.end_scope();
+    }
+
+    // Linear-scan allocation of `may` variables over their scope-bounded live intervals.
+    // Variables that lose out stay on the stack, as before.
+    void alloc_vars() {
+        std::vector<Interval> intervals;
+        std::vector<std::vector<size_t>> open_scopes;
+        size_t pos = 0;
+
+        const auto open_scope = [&] { open_scopes.emplace_back(); };
+        const auto close_scope = [&] {
+            for (const size_t index: open_scopes.back()) {
+                intervals[index].end = pos;
+            }
+            open_scopes.pop_back();
+            pos++;
+        };
+
+        std::function<void(const NodeStmt *)> scan_stmt;
+        const auto scan_scope = [&](const NodeStmtScope *scope) {
+            open_scope();
+            for (const NodeStmt *stmt: scope->stmts) {
+                scan_stmt(stmt);
+            }
+            close_scope();
+        };
+
+        scan_stmt = [&](const NodeStmt *stmt) {
+            if (const auto may = std::get_if<NodeStmtMay *>(&stmt->var)) {
+                open_scopes.back().push_back(intervals.size());
+                intervals.push_back({.may = *may, .start = pos, .end = pos});
+            } else if (const auto scope = std::get_if<NodeStmtScope *>(&stmt->var)) {
+                scan_scope(*scope);
+            } else if (const auto stmt_if = std::get_if<NodeStmtIf *>(&stmt->var)) {
+                scan_scope((*stmt_if)->scope);
+                std::optional<NodeStmtIfPred *> pred = (*stmt_if)->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                        scan_scope((*elif)->scope);
+                        pred = (*elif)->pred;
+                    } else {
+                        scan_scope(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope);
+                        pred = {};
+                    }
+                }
+            } else if (const auto stmt_while = std::get_if<NodeStmtWhile *>(&stmt->var)) {
+                scan_scope((*stmt_while)->scope);
+            } else if (const auto stmt_for = std::get_if<NodeStmtFor *>(&stmt->var)) {
+                open_scope();
+                scan_stmt((*stmt_for)->init);
+                scan_stmt((*stmt_for)->iter);
+                scan_scope((*stmt_for)->scope);
+                close_scope();
+            }
+            pos++;
+        };
+
+        open_scope();
+        for (const NodeStmt &stmt: m_prog.stmts) {
+            scan_stmt(&stmt);
+        }
+        close_scope();
+
+        std::vector<Reg> free_regs(s_var_regs.rbegin(), s_var_regs.rend());
+        std::vector<size_t> active;
+        for (size_t i = 0; i < intervals.size(); i++) {
+            Interval &curr = intervals[i];
+            while (!active.empty() && intervals[active.front()].end < curr.start) {
+                free_regs.push_back(m_var_regs.at(intervals[active.front()].may));
+                active.erase(active.begin());
+            }
+
+            if (free_regs.empty()) {
+                const size_t spill = active.back();
+                if (intervals[spill].end <= curr.end) {
+                    continue;
+                }
+                free_regs.push_back(m_var_regs.at(intervals[spill].may));
+                m_var_regs.erase(intervals[spill].may);
+                active.pop_back();
+            }
+
+            m_var_regs[curr.may] = free_regs.back();
+            free_regs.pop_back();
+            const auto at = std::upper_bound(active.begin(), active.end(), curr.end,
+                                             [&](const size_t end, const size_t index) {
+                                                 return end < intervals[index].end;
+                                             });
+            active.insert(at, i);
+        }
+    }
+
+    static constexpr std::array<Reg, 8> s_var_regs = {
+        Reg::rbx, Reg::r12, Reg::r13, Reg::r14, Reg::r15, Reg::rsi, Reg::rdi, Reg::rbp
+    };
+
+    int create_label() {
+        return m_label_count++;
+    }
+
+    const NodeProg m_prog;
+    const ExprPool &m_exprs = m_prog.exprs;
+    AsmSink &m_out;
+    const GenOptions m_options;
+    size_t m_stack_size = 0;
+    ScopedSymbolTable<Vars> m_vars{};
+    std::vector<Reg> m_free_regs{Reg::r11, Reg::r10, Reg::r9, Reg::r8};
+    std::unordered_map<const NodeStmtMay *, Reg> m_var_regs{};
+    std::vector<int> m_reg_need{};
+    int m_label_count = 0;
+    size_t m_instr_count = 0;
+};
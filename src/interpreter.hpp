@@ -0,0 +1,160 @@
+#pragma once
+
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sys/time.h>
+#include <vector>
+
+#include "assembly.hpp"
+#include "bytecode.hpp"
+
+// Runs bytecode for --interp. Before it starts, each instruction is rewritten to hold the address of
+// its handler, and every handler ends by jumping straight to the next one (direct threading with
+// GCC's labels as values), so there is no central switch for the branch predictor to guess through.
+// Division traps the same way the compiled idiv does; the time limit prints the same message.
+class Interpreter {
+public:
+    explicit Interpreter(const bc::Program &program) : m_program(program) {
+    }
+
+    // Runs the program to its end and returns the status the executable would exit with.
+    int run() {
+        m_frame.assign(m_program.constants.rbegin(), m_program.constants.rend());
+        m_frame.resize(m_program.constants.size() + m_program.register_count, 0);
+
+        if (m_program.watchdog_ms.has_value()) {
+            arm_watchdog(m_program.watchdog_ms.value());
+        }
+        const int status = execute();
+        if (m_program.watchdog_ms.has_value()) {
+            disarm_watchdog();
+        }
+        return status;
+    }
+
+private:
+    struct Threaded {
+        const void *handler;
+        bc::Reg a;
+        bc::Reg b;
+        bc::Reg c;
+    };
+
+    int execute() {
+        // In the order of bc::Op.
+        static const void *const handlers[] = {
+            &&op_move,
+            &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_gt, &&op_lt, &&op_eq, &&op_ge, &&op_le, &&op_ne,
+            &&op_jump, &&op_jump_zero, &&op_jump_gt, &&op_jump_lt, &&op_jump_eq, &&op_jump_ge, &&op_jump_le,
+            &&op_jump_ne,
+            &&op_guard_init, &&op_guard, &&op_poll,
+            &&op_exit, &&op_halt,
+        };
+        static_assert(std::size(handlers) == static_cast<size_t>(bc::Op::halt) + 1);
+
+        std::vector<Threaded> code;
+        code.reserve(m_program.code.size());
+        for (const bc::Instr &instr: m_program.code) {
+            code.push_back({handlers[static_cast<uint8_t>(instr.op)], instr.a, instr.b, instr.c});
+        }
+
+        int64_t *const r = m_frame.data() + m_program.constants.size();
+        const Threaded *pc = code.data();
+        int64_t guard = 0;
+
+#define FUE_DISPATCH() goto *pc->handler
+#define FUE_NEXT() do { ++pc; FUE_DISPATCH(); } while (false)
+#define FUE_ARITH(expr) do { r[pc->a] = (expr); FUE_NEXT(); } while (false)
+#define FUE_BRANCH(cond) do { pc = (cond) ? code.data() + pc->c : pc + 1; FUE_DISPATCH(); } while (false)
+
+        FUE_DISPATCH();
+
+    op_move: FUE_ARITH(r[pc->b]);
+    op_add: FUE_ARITH(static_cast<int64_t>(static_cast<uint64_t>(r[pc->b]) + static_cast<uint64_t>(r[pc->c])));
+    op_sub: FUE_ARITH(static_cast<int64_t>(static_cast<uint64_t>(r[pc->b]) - static_cast<uint64_t>(r[pc->c])));
+    op_mul: FUE_ARITH(static_cast<int64_t>(static_cast<uint64_t>(r[pc->b]) * static_cast<uint64_t>(r[pc->c])));
+    op_div:
+        if (r[pc->c] == 0 || (r[pc->b] == std::numeric_limits<int64_t>::min() && r[pc->c] == -1)) {
+            trap();
+        }
+        FUE_ARITH(r[pc->b] / r[pc->c]);
+    op_gt: FUE_ARITH(r[pc->b] > r[pc->c]);
+    op_lt: FUE_ARITH(r[pc->b] < r[pc->c]);
+    op_eq: FUE_ARITH(r[pc->b] == r[pc->c]);
+    op_ge: FUE_ARITH(r[pc->b] >= r[pc->c]);
+    op_le: FUE_ARITH(r[pc->b] <= r[pc->c]);
+    op_ne: FUE_ARITH(r[pc->b] != r[pc->c]);
+
+    op_jump: FUE_BRANCH(true);
+    op_jump_zero: FUE_BRANCH(r[pc->a] == 0);
+    op_jump_gt: FUE_BRANCH(r[pc->a] > r[pc->b]);
+    op_jump_lt: FUE_BRANCH(r[pc->a] < r[pc->b]);
+    op_jump_eq: FUE_BRANCH(r[pc->a] == r[pc->b]);
+    op_jump_ge: FUE_BRANCH(r[pc->a] >= r[pc->b]);
+    op_jump_le: FUE_BRANCH(r[pc->a] <= r[pc->b]);
+    op_jump_ne: FUE_BRANCH(r[pc->a] != r[pc->b]);
+
+    op_guard_init:
+        guard = 1000000000;
+        FUE_NEXT();
+    op_guard:
+        if (--guard <= 0) {
+            return time_limit_exceeded();
+        }
+        FUE_NEXT();
+    op_poll:
+        if (s_watchdog_fired != 0) {
+            return time_limit_exceeded();
+        }
+        FUE_NEXT();
+
+    op_exit:
+        return static_cast<int>(r[pc->a] & 0xff);
+    op_halt:
+        return 0;
+
+#undef FUE_BRANCH
+#undef FUE_ARITH
+#undef FUE_NEXT
+#undef FUE_DISPATCH
+    }
+
+    static int time_limit_exceeded() {
+        std::cout << tle_message << std::flush;
+        return 0;
+    }
+
+    // Dies of SIGFPE, as the executable would on a zero divisor or an overflowing quotient.
+    [[noreturn]] static void trap() {
+        std::cout.flush();
+        std::cerr.flush();
+        std::signal(SIGFPE, SIG_DFL);
+        std::raise(SIGFPE);
+        std::abort();
+    }
+
+    // The timer only raises a flag; loops poll it on every iteration.
+    static void arm_watchdog(const uint64_t ms) {
+        s_watchdog_fired = 0;
+        std::signal(SIGALRM, [](int) { s_watchdog_fired = 1; });
+        itimerval timer{};
+        timer.it_value.tv_sec = static_cast<time_t>(ms / 1000);
+        timer.it_value.tv_usec = static_cast<suseconds_t>(ms % 1000 * 1000);
+        setitimer(ITIMER_REAL, &timer, nullptr);
+    }
+
+    static void disarm_watchdog() {
+        itimerval timer{};
+        setitimer(ITIMER_REAL, &timer, nullptr);
+        std::signal(SIGALRM, SIG_DFL);
+    }
+
+    static inline volatile std::sig_atomic_t s_watchdog_fired = 0;
+
+    const bc::Program &m_program;
+    std::vector<int64_t> m_frame{};
+};
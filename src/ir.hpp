@@ -0,0 +1,562 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "output.hpp"
+
+// Lowered SSA form of a program: a control-flow graph of basic blocks over typed virtual registers.
+// Every register is assigned exactly once. Values that meet at a join come in through phi nodes,
+// whose incoming values line up one-to-one with the block's predecessors.
+namespace ir {
+
+using VReg = uint32_t;
+using BlockId = uint32_t;
+
+inline constexpr uint32_t none = UINT32_MAX;
+
+// i1 holds the result of a comparison, i64 every other value.
+enum class Type { i1, i64 };
+
+enum class Opcode {
+    constant, add, sub, mul, div, cmp, zext, phi,
+    // The per-loop iteration cap: guard_init arms it on loop entry, guard_tick counts one iteration.
+    guard_init, guard_tick,
+    // Terminators.
+    br, cond_br, exit, unreachable
+};
+
+enum class CmpKind { eq, ne, lt, le, gt, ge };
+
+struct Instr {
+    Opcode op;
+    VReg dst = none;
+    // zext, cond_br and exit only read lhs.
+    VReg lhs = none;
+    VReg rhs = none;
+    int64_t imm = 0;
+    CmpKind cmp = CmpKind::eq;
+    // cond_br continues at targets[0] when lhs is true and at targets[1] otherwise.
+    BlockId targets[2] = {none, none};
+    // Phi only: one incoming value per predecessor, in predecessor order.
+    std::vector<VReg> incoming{};
+};
+
+struct Block {
+    std::vector<Instr> phis{};
+    // Ends in exactly one terminator.
+    std::vector<Instr> instrs{};
+    std::vector<BlockId> preds{};
+};
+
+struct Function {
+    // blocks[0] is the entry.
+    std::vector<Block> blocks{};
+    // Indexed by VReg.
+    std::vector<Type> types{};
+
+    VReg new_vreg(const Type type) {
+        types.push_back(type);
+        return static_cast<VReg>(types.size() - 1);
+    }
+
+    BlockId new_block() {
+        blocks.emplace_back();
+        return static_cast<BlockId>(blocks.size() - 1);
+    }
+
+    [[nodiscard]] size_t instruction_count() const {
+        size_t count = 0;
+        for (const Block &block: blocks) {
+            count += block.phis.size() + block.instrs.size();
+        }
+        return count;
+    }
+};
+
+inline bool is_terminator(const Opcode op) {
+    return op >= Opcode::br;
+}
+
+inline std::span<const BlockId> successors(const Block &block) {
+    if (block.instrs.empty()) {
+        return {};
+    }
+    const Instr &term = block.instrs.back();
+    const size_t count = term.op == Opcode::br ? 1 : term.op == Opcode::cond_br ? 2 : 0;
+    return std::span<const BlockId>(term.targets, count);
+}
+
+inline std::span<BlockId> successors(Block &block) {
+    const std::span<const BlockId> succs = successors(std::as_const(block));
+    return {const_cast<BlockId *>(succs.data()), succs.size()};
+}
+
+// Registers read by a non-phi instruction.
+template<typename F>
+void for_each_use(const Instr &instr, F &&f) {
+    if (instr.lhs != none) {
+        f(instr.lhs);
+    }
+    if (instr.rhs != none) {
+        f(instr.rhs);
+    }
+}
+
+// Blocks reachable from the entry, each before all of its successors except along back edges.
+inline std::vector<BlockId> reverse_postorder(const Function &fn) {
+    std::vector<BlockId> order;
+    std::vector<bool> visited(fn.blocks.size());
+    std::vector<std::pair<BlockId, size_t>> stack{{0, 0}};
+    visited[0] = true;
+    while (!stack.empty()) {
+        auto &[block, next] = stack.back();
+        const std::span<const BlockId> succs = successors(fn.blocks[block]);
+        if (next < succs.size()) {
+            const BlockId succ = succs[next++];
+            if (!visited[succ]) {
+                visited[succ] = true;
+                stack.emplace_back(succ, 0);
+            }
+            continue;
+        }
+        order.push_back(block);
+        stack.pop_back();
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+// Immediate dominators (Cooper, Harvey and Kennedy), numbered so dominance queries are O(1).
+class DomTree {
+public:
+    explicit DomTree(const Function &fn) : m_idom(fn.blocks.size(), none), m_pre(fn.blocks.size()),
+                                           m_post(fn.blocks.size()) {
+        const std::vector<BlockId> order = reverse_postorder(fn);
+        std::vector<uint32_t> rank(fn.blocks.size(), none);
+        for (uint32_t i = 0; i < order.size(); i++) {
+            rank[order[i]] = i;
+        }
+
+        const auto intersect = [&](BlockId a, BlockId b) {
+            while (a != b) {
+                while (rank[a] > rank[b]) {
+                    a = m_idom[a];
+                }
+                while (rank[b] > rank[a]) {
+                    b = m_idom[b];
+                }
+            }
+            return a;
+        };
+
+        m_idom[0] = 0;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (const BlockId block: order) {
+                if (block == 0) {
+                    continue;
+                }
+                BlockId idom = none;
+                for (const BlockId pred: fn.blocks[block].preds) {
+                    if (rank[pred] == none || m_idom[pred] == none) {
+                        continue;
+                    }
+                    idom = idom == none ? pred : intersect(pred, idom);
+                }
+                if (idom != m_idom[block]) {
+                    m_idom[block] = idom;
+                    changed = true;
+                }
+            }
+        }
+
+        // Children of each block in the dominator tree, as ranges of one array.
+        std::vector<uint32_t> first(fn.blocks.size() + 1);
+        for (const BlockId block: order) {
+            if (block != 0 && m_idom[block] != none) {
+                first[m_idom[block] + 1]++;
+            }
+        }
+        for (size_t i = 1; i < first.size(); i++) {
+            first[i] += first[i - 1];
+        }
+        std::vector<BlockId> children(first.back());
+        std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+        for (const BlockId block: order) {
+            if (block != 0 && m_idom[block] != none) {
+                children[fill[m_idom[block]]++] = block;
+            }
+        }
+
+        uint32_t clock = 0;
+        std::vector<std::pair<BlockId, uint32_t>> stack{{0, first[0]}};
+        m_pre[0] = clock++;
+        while (!stack.empty()) {
+            auto &[block, next] = stack.back();
+            if (next < first[block + 1]) {
+                const BlockId child = children[next++];
+                m_pre[child] = clock++;
+                stack.emplace_back(child, first[child]);
+                continue;
+            }
+            m_post[block] = clock++;
+            stack.pop_back();
+        }
+    }
+
+    [[nodiscard]] bool reachable(const BlockId block) const {
+        return m_idom[block] != none;
+    }
+
+    [[nodiscard]] BlockId idom(const BlockId block) const {
+        return m_idom[block];
+    }
+
+    // Whether every path from the entry to b passes through a. Both must be reachable.
+    [[nodiscard]] bool dominates(const BlockId a, const BlockId b) const {
+        return m_pre[a] <= m_pre[b] && m_post[b] <= m_post[a];
+    }
+
+private:
+    std::vector<BlockId> m_idom;
+    std::vector<uint32_t> m_pre;
+    std::vector<uint32_t> m_post;
+};
+
+// Drops blocks the entry cannot reach, together with their edges into reachable blocks.
+inline void remove_unreachable(Function &fn) {
+    std::vector<BlockId> order = reverse_postorder(fn);
+    if (order.size() == fn.blocks.size()) {
+        return;
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<BlockId> renumber(fn.blocks.size(), none);
+    for (BlockId i = 0; i < order.size(); i++) {
+        renumber[order[i]] = i;
+    }
+
+    std::vector<Block> blocks;
+    blocks.reserve(order.size());
+    for (const BlockId id: order) {
+        Block &block = blocks.emplace_back(std::move(fn.blocks[id]));
+        std::vector<size_t> kept;
+        for (size_t i = 0; i < block.preds.size(); i++) {
+            if (renumber[block.preds[i]] != none) {
+                kept.push_back(i);
+            }
+        }
+        if (kept.size() != block.preds.size()) {
+            for (Instr &phi: block.phis) {
+                std::vector<VReg> incoming;
+                for (const size_t i: kept) {
+                    incoming.push_back(phi.incoming[i]);
+                }
+                phi.incoming = std::move(incoming);
+            }
+            std::vector<BlockId> preds;
+            for (const size_t i: kept) {
+                preds.push_back(block.preds[i]);
+            }
+            block.preds = std::move(preds);
+        }
+        for (BlockId &pred: block.preds) {
+            pred = renumber[pred];
+        }
+        for (BlockId &succ: successors(block)) {
+            succ = renumber[succ];
+        }
+    }
+    fn.blocks = std::move(blocks);
+}
+
+// Puts an empty block on every edge from a block with several successors into a block with phis,
+// so that phi copies can be placed at the end of the predecessor.
+inline void split_critical_edges(Function &fn) {
+    const size_t count = fn.blocks.size();
+    for (BlockId block = 0; block < count; block++) {
+        if (fn.blocks[block].phis.empty()) {
+            continue;
+        }
+        for (size_t i = 0; i < fn.blocks[block].preds.size(); i++) {
+            const BlockId pred = fn.blocks[block].preds[i];
+            const std::span<BlockId> succs = successors(fn.blocks[pred]);
+            if (succs.size() < 2) {
+                continue;
+            }
+            const BlockId split = fn.new_block();
+            fn.blocks[split].instrs.push_back({.op = Opcode::br, .targets = {block}});
+            fn.blocks[split].preds.push_back(pred);
+            *std::find(succs.begin(), succs.end(), block) = split;
+            fn.blocks[block].preds[i] = split;
+        }
+    }
+}
+
+inline const char *type_name(const Type type) {
+    return type == Type::i1 ? "i1" : "i64";
+}
+
+inline const char *cmp_name(const CmpKind cmp) {
+    static constexpr const char *names[] = {"eq", "ne", "lt", "le", "gt", "ge"};
+    return names[static_cast<int>(cmp)];
+}
+
+inline const char *opcode_name(const Opcode op) {
+    static constexpr const char *names[] = {
+        "const", "add", "sub", "mul", "div", "cmp", "zext", "phi", "guard.init", "guard.tick", "br", "cond_br",
+        "exit", "unreachable"
+    };
+    return names[static_cast<int>(op)];
+}
+
+// Textual form, one instruction per line:
+//   bb1:  ; preds bb0, bb2
+//       %3:i64 = phi [%0, bb0], [%5, bb2]
+//       %4:i1 = cmp lt %3, %1
+//       cond_br %4, bb2, bb3
+inline void print(const Function &fn, OutputFile &out) {
+    const auto write_instr = [&](const Instr &instr) {
+        out << "    ";
+        if (instr.dst != none) {
+            out << "%" << instr.dst << ":" << type_name(fn.types[instr.dst]) << " = ";
+        }
+        out << opcode_name(instr.op);
+        switch (instr.op) {
+            case Opcode::constant:
+                out << " " << instr.imm;
+                break;
+            case Opcode::cmp:
+                out << " " << cmp_name(instr.cmp) << " %" << instr.lhs << ", %" << instr.rhs;
+                break;
+            case Opcode::add:
+            case Opcode::sub:
+            case Opcode::mul:
+            case Opcode::div:
+                out << " %" << instr.lhs << ", %" << instr.rhs;
+                break;
+            case Opcode::zext:
+            case Opcode::exit:
+                out << " %" << instr.lhs;
+                break;
+            case Opcode::br:
+                out << " bb" << instr.targets[0];
+                break;
+            case Opcode::cond_br:
+                out << " %" << instr.lhs << ", bb" << instr.targets[0] << ", bb" << instr.targets[1];
+                break;
+            case Opcode::phi:
+            case Opcode::guard_init:
+            case Opcode::guard_tick:
+            case Opcode::unreachable:
+                break;
+        }
+        out << "\n";
+    };
+
+    for (BlockId id = 0; id < fn.blocks.size(); id++) {
+        const Block &block = fn.blocks[id];
+        out << "bb" << id << ":";
+        for (size_t i = 0; i < block.preds.size(); i++) {
+            out << (i == 0 ? "  ; preds bb" : ", bb") << block.preds[i];
+        }
+        out << "\n";
+        for (const Instr &phi: block.phis) {
+            out << "    %" << phi.dst << ":" << type_name(fn.types[phi.dst]) << " = phi";
+            for (size_t i = 0; i < phi.incoming.size(); i++) {
+                out << (i == 0 ? " [%" : ", [%") << phi.incoming[i] << ", bb" << block.preds[i] << "]";
+            }
+            out << "\n";
+        }
+        for (const Instr &instr: block.instrs) {
+            write_instr(instr);
+        }
+    }
+}
+
+// Checks the structural invariants every pass relies on: well-formed blocks and edges, one
+// definition per register, operand types, and that each definition dominates its uses.
+// Returns a description of the first violation found.
+inline std::optional<std::string> verify(const Function &fn) {
+    const auto reg = [](const VReg vreg) { return "%" + std::to_string(vreg); };
+    const auto at = [](const BlockId block) { return " in bb" + std::to_string(block); };
+
+    if (fn.blocks.empty()) {
+        return "function has no blocks";
+    }
+    if (!fn.blocks[0].preds.empty()) {
+        return "entry block has predecessors";
+    }
+
+    const DomTree dom(fn);
+    size_t edge_count = 0;
+    struct Def {
+        BlockId block = none;
+        // Position in the block; phis come before every instruction.
+        int64_t index = 0;
+    };
+    std::vector<Def> defs(fn.types.size());
+
+    for (BlockId id = 0; id < fn.blocks.size(); id++) {
+        const Block &block = fn.blocks[id];
+        if (!dom.reachable(id)) {
+            return "unreachable block" + at(id);
+        }
+        if (block.instrs.empty() || !is_terminator(block.instrs.back().op)) {
+            return "block does not end in a terminator" + at(id);
+        }
+
+        const auto define = [&](const VReg dst, const int64_t index) -> std::optional<std::string> {
+            if (dst >= fn.types.size()) {
+                return "undeclared register " + reg(dst) + at(id);
+            }
+            if (defs[dst].block != none) {
+                return "register " + reg(dst) + " is defined twice";
+            }
+            defs[dst] = {id, index};
+            return {};
+        };
+
+        for (const Instr &phi: block.phis) {
+            if (phi.op != Opcode::phi) {
+                return "non-phi instruction among the phis" + at(id);
+            }
+            if (phi.incoming.size() != block.preds.size()) {
+                return "phi " + reg(phi.dst) + " has " + std::to_string(phi.incoming.size()) +
+                       " incoming values for " + std::to_string(block.preds.size()) + " predecessors" + at(id);
+            }
+            if (auto error = define(phi.dst, -1)) {
+                return error;
+            }
+        }
+        for (size_t i = 0; i < block.instrs.size(); i++) {
+            const Instr &instr = block.instrs[i];
+            if (instr.op == Opcode::phi) {
+                return "phi " + reg(instr.dst) + " after the start of the block" + at(id);
+            }
+            if (is_terminator(instr.op) != (i + 1 == block.instrs.size())) {
+                return std::string("terminator ") + opcode_name(instr.op) + " in the middle of a block" + at(id);
+            }
+            if (instr.dst != none) {
+                if (auto error = define(instr.dst, static_cast<int64_t>(i))) {
+                    return error;
+                }
+            }
+        }
+        // Each edge appears in the predecessors of its target as often as among the branch targets.
+        // With the totals equal, the predecessor lists are exactly the branches.
+        const std::span<const BlockId> succs = successors(block);
+        for (const BlockId succ: succs) {
+            if (succ >= fn.blocks.size()) {
+                return "branch to a missing block" + at(id);
+            }
+            const std::vector<BlockId> &preds = fn.blocks[succ].preds;
+            if (std::count(preds.begin(), preds.end(), id) != std::count(succs.begin(), succs.end(), succ)) {
+                return "predecessors of bb" + std::to_string(succ) + " do not match the branches" + at(id);
+            }
+        }
+        edge_count += succs.size();
+    }
+
+    size_t pred_count = 0;
+    for (const Block &block: fn.blocks) {
+        pred_count += block.preds.size();
+    }
+    if (pred_count != edge_count) {
+        return std::string("predecessor lists do not match the branches");
+    }
+
+    // A use at position index of block is dominated by its definition.
+    const auto check_use = [&](const VReg use, const Type type, const BlockId block,
+                               const int64_t index) -> std::optional<std::string> {
+        if (use >= fn.types.size() || defs[use].block == none) {
+            return "use of undefined register " + reg(use) + at(block);
+        }
+        if (fn.types[use] != type) {
+            return "register " + reg(use) + " should be " + type_name(type) + at(block);
+        }
+        const Def &def = defs[use];
+        if (def.block == block ? def.index >= index : !dom.dominates(def.block, block)) {
+            return "definition of " + reg(use) + " does not dominate its use" + at(block);
+        }
+        return {};
+    };
+
+    for (BlockId id = 0; id < fn.blocks.size(); id++) {
+        const Block &block = fn.blocks[id];
+        for (const Instr &phi: block.phis) {
+            for (size_t i = 0; i < phi.incoming.size(); i++) {
+                // An incoming value is read at the end of its predecessor.
+                if (auto error = check_use(phi.incoming[i], fn.types[phi.dst], block.preds[i], INT64_MAX)) {
+                    return error;
+                }
+            }
+        }
+        for (size_t i = 0; i < block.instrs.size(); i++) {
+            const Instr &instr = block.instrs[i];
+            const auto index = static_cast<int64_t>(i);
+            Type operand = Type::i64;
+            std::optional<Type> result;
+            size_t operands = 0;
+            switch (instr.op) {
+                case Opcode::constant:
+                    result = Type::i64;
+                    break;
+                case Opcode::add:
+                case Opcode::sub:
+                case Opcode::mul:
+                case Opcode::div:
+                    operands = 2;
+                    result = Type::i64;
+                    break;
+                case Opcode::cmp:
+                    operands = 2;
+                    result = Type::i1;
+                    break;
+                case Opcode::zext:
+                    operands = 1;
+                    operand = Type::i1;
+                    result = Type::i64;
+                    break;
+                case Opcode::cond_br:
+                    operands = 1;
+                    operand = Type::i1;
+                    break;
+                case Opcode::exit:
+                    operands = 1;
+                    break;
+                case Opcode::phi:
+                case Opcode::guard_init:
+                case Opcode::guard_tick:
+                case Opcode::br:
+                case Opcode::unreachable:
+                    break;
+            }
+
+            if (result.has_value() != (instr.dst != none) || (result.has_value() && fn.types[instr.dst] != result)) {
+                return std::string("bad result for ") + opcode_name(instr.op) + at(id);
+            }
+            if ((instr.lhs != none) != (operands >= 1) || (instr.rhs != none) != (operands >= 2)) {
+                return std::string("wrong operand count for ") + opcode_name(instr.op) + at(id);
+            }
+            std::optional<std::string> error;
+            for_each_use(instr, [&](const VReg use) {
+                if (!error.has_value()) {
+                    error = check_use(use, operand, id, index);
+                }
+            });
+            if (error.has_value()) {
+                return error;
+            }
+        }
+    }
+    return {};
+}
+
+}
@@ -0,0 +1,420 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "errors.hpp"
+#include "ir.hpp"
+#include "parser.hpp"
+#include "symbols.hpp"
+
+// Builds SSA form straight from the AST, after Braun et al., "Simple and Efficient Construction of
+// Static Single Assignment Form". Each block remembers the value each variable last had in it; a
+// read that misses walks back through the predecessors and places a phi where paths meet. Loop
+// headers stay unsealed, with their phis incomplete, until the back edge is known. Phis that turn
+// out to merge a single value are forwarded to it and removed.
+class IrBuilder {
+public:
+    ir::Function build(const NodeProg &prog) {
+        m_exprs = &prog.exprs;
+        m_cur = new_block();
+        seal(m_cur);
+        m_vars.begin_scope();
+        for (const NodeStmt &stmt: prog.stmts) {
+            gen_stmt(&stmt);
+        }
+        m_vars.end_scope();
+        // Running off the end of the program is not defined, the same as with Generator.
+        if (!terminated()) {
+            emit({.op = ir::Opcode::unreachable});
+        }
+        finish();
+        return std::move(m_fn);
+    }
+
+private:
+    using Var = uint32_t;
+
+    // Opcode of a binary expression, and the comparison when that opcode is cmp.
+    static std::pair<ir::Opcode, ir::CmpKind> bin_op(const ExprKind kind) {
+        using ir::Opcode;
+        using ir::CmpKind;
+        switch (kind) {
+            case ExprKind::add: return {Opcode::add, {}};
+            case ExprKind::sub: return {Opcode::sub, {}};
+            case ExprKind::mul: return {Opcode::mul, {}};
+            case ExprKind::div: return {Opcode::div, {}};
+            case ExprKind::greater: return {Opcode::cmp, CmpKind::gt};
+            case ExprKind::less: return {Opcode::cmp, CmpKind::lt};
+            case ExprKind::equal: return {Opcode::cmp, CmpKind::eq};
+            case ExprKind::greater_eq: return {Opcode::cmp, CmpKind::ge};
+            case ExprKind::less_eq: return {Opcode::cmp, CmpKind::le};
+            default: return {Opcode::cmp, CmpKind::ne};
+        }
+    }
+
+    // Value of expr as an i64.
+    ir::VReg gen_expr(const ExprIndex expr) {
+        const ExprPool &exprs = *m_exprs;
+        if (exprs.kind(expr) == ExprKind::int_lit) {
+            return value(ir::Type::i64, {.op = ir::Opcode::constant, .imm = exprs.value(expr)});
+        }
+        if (exprs.kind(expr) == ExprKind::ident) {
+            return read_var(find_var(exprs.ident(expr)), m_cur);
+        }
+
+        const auto [op, cmp] = bin_op(exprs.kind(expr));
+        const ir::VReg lhs_value = gen_expr(exprs.lhs(expr));
+        const ir::VReg rhs_value = gen_expr(exprs.rhs(expr));
+        if (op != ir::Opcode::cmp) {
+            return value(ir::Type::i64, {.op = op, .lhs = lhs_value, .rhs = rhs_value});
+        }
+        const ir::VReg flag = value(ir::Type::i1, {.op = op, .lhs = lhs_value, .rhs = rhs_value, .cmp = cmp});
+        return value(ir::Type::i64, {.op = ir::Opcode::zext, .lhs = flag});
+    }
+
+    // Value of expr as an i1 that is true when expr is non-zero. Comparisons produce it directly.
+    ir::VReg gen_cond(const ExprIndex expr) {
+        const ExprPool &exprs = *m_exprs;
+        if (is_cmp(exprs.kind(expr))) {
+            const auto [op, cmp] = bin_op(exprs.kind(expr));
+            const ir::VReg lhs_value = gen_expr(exprs.lhs(expr));
+            const ir::VReg rhs_value = gen_expr(exprs.rhs(expr));
+            return value(ir::Type::i1, {.op = op, .lhs = lhs_value, .rhs = rhs_value, .cmp = cmp});
+        }
+
+        const ir::VReg expr_value = gen_expr(expr);
+        const ir::VReg zero = value(ir::Type::i64, {.op = ir::Opcode::constant, .imm = 0});
+        return value(ir::Type::i1, {.op = ir::Opcode::cmp, .lhs = expr_value, .rhs = zero, .cmp = ir::CmpKind::ne});
+    }
+
+    void gen_scope(const NodeStmtScope *scope) {
+        m_vars.begin_scope();
+        for (const NodeStmt *stmt: scope->stmts) {
+            gen_stmt(stmt);
+        }
+        m_vars.end_scope();
+    }
+
+    // Branches on cond into a fresh block for the taken side and returns the block for the other.
+    ir::BlockId gen_branch(const ExprIndex cond) {
+        const ir::VReg flag = gen_cond(cond);
+        const ir::BlockId taken = new_block();
+        const ir::BlockId not_taken = new_block();
+        branch(flag, taken, not_taken);
+        seal(taken);
+        seal(not_taken);
+        m_cur = taken;
+        return not_taken;
+    }
+
+    void gen_if_pred(const NodeStmtIfPred *pred, const ir::BlockId join) {
+        if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred->var)) {
+            const ir::BlockId next = gen_branch((*elif)->expr);
+            gen_scope((*elif)->scope);
+            jump(join);
+            m_cur = next;
+            if ((*elif)->pred.has_value()) {
+                gen_if_pred((*elif)->pred.value(), join);
+            }
+        } else {
+            gen_scope(std::get<NodeStmtIfPredElse *>(pred->var)->scope);
+        }
+    }
+
+    // Header evaluates cond and enters the body; the body ticks the guard, runs, and jumps back.
+    // The header is sealed once the back edge exists.
+    void gen_loop(const ExprIndex cond, const NodeStmtScope *body, const NodeStmt *iter) {
+        emit({.op = ir::Opcode::guard_init});
+        const ir::BlockId header = new_block();
+        jump(header);
+        m_cur = header;
+        const ir::BlockId exit = gen_branch(cond);
+        emit({.op = ir::Opcode::guard_tick});
+        gen_scope(body);
+        if (iter != nullptr) {
+            gen_stmt(iter);
+        }
+        jump(header);
+        seal(header);
+        m_cur = exit;
+    }
+
+    void gen_stmt(const NodeStmt *stmt) {
+        struct StmtVisitor {
+            IrBuilder &gen;
+
+            void operator()(const NodeStmtExit *stmt_exit) const {
+                const ir::VReg code = gen.gen_expr(stmt_exit->expr);
+                gen.emit({.op = ir::Opcode::exit, .lhs = code});
+                // Anything after the exit lands in a block with no predecessors and is dropped.
+                gen.m_cur = gen.new_block();
+                gen.seal(gen.m_cur);
+            }
+
+            void operator()(const NodeStmtMay *stmt_may) const {
+                if (gen.m_vars.find(stmt_may->ident.symbol) != nullptr) {
+                    std::cerr << "Identifier already used: " << stmt_may->ident.value << "\n";
+                    fail();
+                }
+                const ir::VReg init = gen.gen_expr(stmt_may->expr);
+                const Var var = gen.m_var_count++;
+                gen.m_vars.declare(stmt_may->ident.symbol, var);
+                gen.write_var(var, gen.m_cur, init);
+            }
+
+            void operator()(const NodeStmtAssign *stmt_assign) const {
+                const Var *var = gen.m_vars.find(stmt_assign->ident.symbol);
+                if (var == nullptr) {
+                    std::cerr << "Undeclared Identifier" << stmt_assign->ident.value << std::endl;
+                    fail();
+                }
+                gen.write_var(*var, gen.m_cur, gen.gen_expr(stmt_assign->expr));
+            }
+
+            void operator()(const NodeStmtScope *stmt_scope) const {
+                gen.gen_scope(stmt_scope);
+            }
+
+            void operator()(const NodeStmtIf *stmt_if) const {
+                const ir::BlockId join = gen.new_block();
+                const ir::BlockId next = gen.gen_branch(stmt_if->expr);
+                gen.gen_scope(stmt_if->scope);
+                gen.jump(join);
+                gen.m_cur = next;
+                if (stmt_if->pred.has_value()) {
+                    gen.gen_if_pred(stmt_if->pred.value(), join);
+                }
+                gen.jump(join);
+                gen.seal(join);
+                gen.m_cur = join;
+            }
+
+            void operator()(const NodeStmtWhile *stmt_while) const {
+                gen.gen_loop(stmt_while->expr, stmt_while->scope, nullptr);
+            }
+
+            void operator()(const NodeStmtFor *stmt_for) const {
+                gen.m_vars.begin_scope();
+                gen.gen_stmt(stmt_for->init);
+                gen.gen_loop(stmt_for->cond, stmt_for->scope, stmt_for->iter);
+                gen.m_vars.end_scope();
+            }
+        };
+
+        StmtVisitor visitor{.gen = *this};
+        std::visit(visitor, stmt->var);
+    }
+
+    Var find_var(const Token &ident) const {
+        const Var *var = m_vars.find(ident.symbol);
+        if (var == nullptr) {
+            std::cerr << "ERROR: Unknown identifier '" << ident.value << "'\n";
+            fail();
+        }
+        return *var;
+    }
+
+    ir::BlockId new_block() {
+        m_sealed.push_back(false);
+        m_incomplete.emplace_back();
+        return m_fn.new_block();
+    }
+
+    ir::VReg new_vreg(const ir::Type type) {
+        m_forward.push_back(ir::none);
+        return m_fn.new_vreg(type);
+    }
+
+    [[nodiscard]] bool terminated() const {
+        const std::vector<ir::Instr> &instrs = m_fn.blocks[m_cur].instrs;
+        return !instrs.empty() && ir::is_terminator(instrs.back().op);
+    }
+
+    void emit(ir::Instr instr) {
+        m_fn.blocks[m_cur].instrs.push_back(std::move(instr));
+    }
+
+    ir::VReg value(const ir::Type type, ir::Instr instr) {
+        instr.dst = new_vreg(type);
+        const ir::VReg dst = instr.dst;
+        emit(std::move(instr));
+        return dst;
+    }
+
+    // Control that already left the block, through an exit, needs no edge.
+    void jump(const ir::BlockId target) {
+        if (terminated()) {
+            return;
+        }
+        emit({.op = ir::Opcode::br, .targets = {target}});
+        m_fn.blocks[target].preds.push_back(m_cur);
+    }
+
+    void branch(const ir::VReg flag, const ir::BlockId taken, const ir::BlockId not_taken) {
+        emit({.op = ir::Opcode::cond_br, .lhs = flag, .targets = {taken, not_taken}});
+        m_fn.blocks[taken].preds.push_back(m_cur);
+        m_fn.blocks[not_taken].preds.push_back(m_cur);
+    }
+
+    static uint64_t def_key(const Var var, const ir::BlockId block) {
+        return static_cast<uint64_t>(var) << 32 | block;
+    }
+
+    ir::VReg resolve(ir::VReg vreg) const {
+        while (m_forward[vreg] != ir::none) {
+            vreg = m_forward[vreg];
+        }
+        return vreg;
+    }
+
+    void write_var(const Var var, const ir::BlockId block, const ir::VReg vreg) {
+        m_current_defs[def_key(var, block)] = vreg;
+    }
+
+    ir::VReg read_var(const Var var, const ir::BlockId block) {
+        if (const auto it = m_current_defs.find(def_key(var, block)); it != m_current_defs.end()) {
+            return resolve(it->second);
+        }
+
+        const std::vector<ir::BlockId> &preds = m_fn.blocks[block].preds;
+        ir::VReg vreg;
+        if (!m_sealed[block]) {
+            vreg = new_phi(block);
+            m_incomplete[block].emplace_back(var, vreg);
+        } else if (preds.size() == 1) {
+            vreg = read_var(var, preds.front());
+        } else if (preds.empty()) {
+            vreg = undefined(block);
+        } else {
+            // Recording the phi first breaks cycles through loops.
+            vreg = new_phi(block);
+            write_var(var, block, vreg);
+            vreg = add_phi_operands(var, vreg);
+        }
+        write_var(var, block, vreg);
+        return vreg;
+    }
+
+    ir::VReg new_phi(const ir::BlockId block) {
+        const ir::VReg dst = new_vreg(ir::Type::i64);
+        m_phis.emplace(dst, std::pair{block, m_fn.blocks[block].phis.size()});
+        m_fn.blocks[block].phis.push_back({.op = ir::Opcode::phi, .dst = dst});
+        return dst;
+    }
+
+    // Only reachable from a block without predecessors, which is removed before anything reads it.
+    ir::VReg undefined(const ir::BlockId block) {
+        const ir::VReg dst = new_vreg(ir::Type::i64);
+        std::vector<ir::Instr> &instrs = m_fn.blocks[block].instrs;
+        instrs.insert(instrs.begin(), {.op = ir::Opcode::constant, .dst = dst});
+        return dst;
+    }
+
+    ir::VReg add_phi_operands(const Var var, const ir::VReg phi) {
+        const auto [block, index] = m_phis.at(phi);
+        // Reads may add phis to this block, so the phi is looked up again after each one.
+        for (size_t i = 0; i < m_fn.blocks[block].preds.size(); i++) {
+            const ir::VReg incoming = read_var(var, m_fn.blocks[block].preds[i]);
+            m_fn.blocks[block].phis[index].incoming.push_back(incoming);
+        }
+        return try_remove_trivial_phi(phi);
+    }
+
+    ir::VReg try_remove_trivial_phi(const ir::VReg phi) {
+        const auto [block, index] = m_phis.at(phi);
+        ir::VReg same = ir::none;
+        for (const ir::VReg incoming: m_fn.blocks[block].phis[index].incoming) {
+            const ir::VReg vreg = resolve(incoming);
+            if (vreg == same || vreg == phi) {
+                continue;
+            }
+            if (same != ir::none) {
+                return phi;
+            }
+            same = vreg;
+        }
+        if (same == ir::none) {
+            same = undefined(block);
+        }
+        m_forward[phi] = same;
+        return same;
+    }
+
+    void seal(const ir::BlockId block) {
+        for (size_t i = 0; i < m_incomplete[block].size(); i++) {
+            const auto [var, phi] = m_incomplete[block][i];
+            add_phi_operands(var, phi);
+        }
+        m_incomplete[block] = {};
+        m_sealed[block] = true;
+    }
+
+    // Rewrites every operand to its final register, drops forwarded phis and unreachable blocks, and
+    // removes the phis that only became trivial once their users were settled.
+    void finish() {
+        const auto rewrite = [&] {
+            for (ir::Block &block: m_fn.blocks) {
+                std::erase_if(block.phis, [&](const ir::Instr &phi) { return m_forward[phi.dst] != ir::none; });
+                for (ir::Instr &phi: block.phis) {
+                    for (ir::VReg &incoming: phi.incoming) {
+                        incoming = resolve(incoming);
+                    }
+                }
+                for (ir::Instr &instr: block.instrs) {
+                    if (instr.lhs != ir::none) {
+                        instr.lhs = resolve(instr.lhs);
+                    }
+                    if (instr.rhs != ir::none) {
+                        instr.rhs = resolve(instr.rhs);
+                    }
+                }
+            }
+        };
+
+        rewrite();
+        ir::remove_unreachable(m_fn);
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (ir::Block &block: m_fn.blocks) {
+                for (const ir::Instr &phi: block.phis) {
+                    if (m_forward[phi.dst] != ir::none) {
+                        continue;
+                    }
+                    ir::VReg same = ir::none;
+                    bool trivial = true;
+                    for (const ir::VReg incoming: phi.incoming) {
+                        const ir::VReg vreg = resolve(incoming);
+                        if (vreg == same || vreg == phi.dst) {
+                            continue;
+                        }
+                        if (same != ir::none) {
+                            trivial = false;
+                            break;
+                        }
+                        same = vreg;
+                    }
+                    if (trivial && same != ir::none) {
+                        m_forward[phi.dst] = same;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        rewrite();
+    }
+
+    const ExprPool *m_exprs = nullptr;
+    ir::Function m_fn{};
+    ir::BlockId m_cur = 0;
+    ScopedSymbolTable<Var> m_vars{};
+    Var m_var_count = 0;
+    std::unordered_map<uint64_t, ir::VReg> m_current_defs{};
+    std::vector<bool> m_sealed{};
+    std::vector<std::vector<std::pair<Var, ir::VReg>>> m_incomplete{};
+    // Where each phi lives, as (block, index into its phis).
+    std::unordered_map<ir::VReg, std::pair<ir::BlockId, size_t>> m_phis{};
+    // The value a removed trivial phi stands for, or none.
+    std::vector<ir::VReg> m_forward{};
+};
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+
+#include "assembly.hpp"
+#include "ir.hpp"
+#include "runtime.hpp"
+
+// Lowers SSA IR to x86-64 through the same AsmSink as Generator.
+//
+// Blocks are laid out in reverse postorder and each register gets one live interval spanning
+// everything between its definition and its last use, found by iterating block liveness to a
+// fixpoint. Intervals are assigned registers by linear scan; the ones that lose out get a stack
+// slot. Constants that fit an imm32 are never allocated and are used as immediates instead. Phis
+// become parallel copies at the end of each predecessor, which is why critical edges are split
+// first. rax and rdx stay free as scratch registers and for idiv; rcx holds the loop guard.
+class IrLowering {
+public:
+    IrLowering(ir::Function &fn, AsmSink &out, const GenOptions options = {})
+        : m_fn(fn), m_out(out), m_options(options) {
+    }
+
+    void lower() {
+        ir::split_critical_edges(m_fn);
+        m_order = ir::reverse_postorder(m_fn);
+        scan_values();
+        compute_liveness();
+        allocate();
+
+        const int tle_label = static_cast<int>(m_fn.blocks.size());
+        if (m_options.watchdog_ms.has_value()) {
+            m_instr_count += emit_watchdog(m_out, m_options.watchdog_ms.value(), tle_label + 1, tle_label + 2);
+        }
+        if (m_slot_count != 0) {
+            emit(Op::sub, reg_op(Reg::rsp), imm_op(static_cast<int64_t>(m_slot_count * 8)));
+        }
+
+        bool guarded = false;
+        for (size_t i = 0; i < m_order.size(); i++) {
+            const ir::BlockId next = i + 1 < m_order.size() ? m_order[i + 1] : ir::none;
+            guarded |= lower_block(m_order[i], next, tle_label);
+        }
+
+        if (guarded && !m_options.watchdog_ms.has_value()) {
+            emit(Op::label, label_op(tle_label));
+            m_instr_count += emit_tle_exit(m_out);
+        }
+    }
+
+    // Instructions emitted so far, not counting labels.
+    [[nodiscard]] size_t instruction_count() const {
+        return m_instr_count;
+    }
+
+    // Registers that did not fit in a machine register.
+    [[nodiscard]] size_t spill_count() const {
+        return m_slot_count;
+    }
+
+private:
+    struct Interval {
+        ir::VReg vreg;
+        size_t start;
+        size_t end;
+    };
+
+    void emit(const Op op, const Operand dst = {}, const Operand src = {}) {
+        m_instr_count += op != Op::label;
+        m_out.emit({.op = op, .dst = dst, .src = src});
+    }
+
+    void emit_jump(const Cond cond, const int label) {
+        m_instr_count++;
+        m_out.emit({.op = Op::jcc, .dst = label_op(label), .cond = cond});
+    }
+
+    static bool fits_i32(const int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    static bool same_location(const Operand &a, const Operand &b) {
+        return a.kind == b.kind && a.reg == b.reg && a.value == b.value;
+    }
+
+    static Cond cond_of(const ir::CmpKind cmp) {
+        static constexpr Cond conds[] = {Cond::e, Cond::ne, Cond::l, Cond::le, Cond::g, Cond::ge};
+        return conds[static_cast<int>(cmp)];
+    }
+
+    // A comparison whose only use is the cond_br right after it is emitted as part of the branch.
+    [[nodiscard]] bool fused(const ir::Block &block, const size_t index) const {
+        const ir::Instr &instr = block.instrs[index];
+        return instr.op == ir::Opcode::cmp && index + 1 < block.instrs.size() &&
+               block.instrs[index + 1].op == ir::Opcode::cond_br && block.instrs[index + 1].lhs == instr.dst &&
+               m_use_count[instr.dst] == 1;
+    }
+
+    // Records where each register is defined, how often it is read, and which constants can be
+    // immediates. idiv has no immediate form, so divisors always get a location.
+    void scan_values() {
+        const size_t count = m_fn.types.size();
+        m_def_block.assign(count, ir::none);
+        m_use_count.assign(count, 0);
+        m_imm.assign(count, false);
+        m_loc.assign(count, Operand{});
+
+        for (const ir::BlockId id: m_order) {
+            const ir::Block &block = m_fn.blocks[id];
+            for (const ir::Instr &phi: block.phis) {
+                m_def_block[phi.dst] = id;
+                for (const ir::VReg incoming: phi.incoming) {
+                    m_use_count[incoming]++;
+                }
+            }
+            for (const ir::Instr &instr: block.instrs) {
+                if (instr.dst != ir::none) {
+                    m_def_block[instr.dst] = id;
+                    if (instr.op == ir::Opcode::constant && fits_i32(instr.imm)) {
+                        m_imm[instr.dst] = true;
+                        m_loc[instr.dst] = imm_op(instr.imm);
+                    }
+                }
+                ir::for_each_use(instr, [&](const ir::VReg use) { m_use_count[use]++; });
+            }
+        }
+        for (const ir::BlockId id: m_order) {
+            for (const ir::Instr &instr: m_fn.blocks[id].instrs) {
+                if (instr.op == ir::Opcode::div && m_imm[instr.rhs]) {
+                    m_imm[instr.rhs] = false;
+                    m_loc[instr.rhs] = {};
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] bool allocatable(const ir::VReg vreg) const {
+        return !m_imm[vreg];
+    }
+
+    // Sorted live-in and live-out sets per block, then one interval per register covering every
+    // point where it is live. Uses sit at even positions and definitions at the following odd one,
+    // so a result may take over the register of an operand that dies in the same instruction.
+    void compute_liveness() {
+        const size_t block_count = m_fn.blocks.size();
+        std::vector<std::vector<ir::VReg>> upward_uses(block_count);
+        std::vector<std::vector<ir::VReg>> live_in(block_count);
+        std::vector<std::vector<ir::VReg>> live_out(block_count);
+
+        for (const ir::BlockId id: m_order) {
+            std::vector<ir::VReg> &uses = upward_uses[id];
+            for (const ir::Instr &instr: m_fn.blocks[id].instrs) {
+                ir::for_each_use(instr, [&](const ir::VReg use) {
+                    if (m_def_block[use] != id && allocatable(use)) {
+                        uses.push_back(use);
+                    }
+                });
+            }
+            std::sort(uses.begin(), uses.end());
+            uses.erase(std::unique(uses.begin(), uses.end()), uses.end());
+        }
+
+        // Scratch sets, so that a pass that changes nothing allocates nothing.
+        std::vector<ir::VReg> out;
+        std::vector<ir::VReg> in;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto it = m_order.rbegin(); it != m_order.rend(); ++it) {
+                const ir::BlockId id = *it;
+                out.clear();
+                for (const ir::BlockId succ: ir::successors(m_fn.blocks[id])) {
+                    out.insert(out.end(), live_in[succ].begin(), live_in[succ].end());
+                    const ir::Block &succ_block = m_fn.blocks[succ];
+                    const size_t pred_index = std::find(succ_block.preds.begin(), succ_block.preds.end(), id) -
+                                              succ_block.preds.begin();
+                    for (const ir::Instr &phi: succ_block.phis) {
+                        if (allocatable(phi.incoming[pred_index])) {
+                            out.push_back(phi.incoming[pred_index]);
+                        }
+                    }
+                }
+                std::sort(out.begin(), out.end());
+                out.erase(std::unique(out.begin(), out.end()), out.end());
+
+                in.clear();
+                std::set_union(upward_uses[id].begin(), upward_uses[id].end(), out.begin(), out.end(),
+                               std::back_inserter(in));
+                std::erase_if(in, [&](const ir::VReg vreg) { return m_def_block[vreg] == id; });
+                if (in != live_in[id]) {
+                    live_in[id] = in;
+                    changed = true;
+                }
+                if (out != live_out[id]) {
+                    live_out[id] = out;
+                }
+            }
+        }
+
+        std::vector<size_t> start(block_count);
+        std::vector<size_t> end(block_count);
+        size_t pos = 0;
+        for (const ir::BlockId id: m_order) {
+            start[id] = pos * 2;
+            pos += m_fn.blocks[id].instrs.size();
+            end[id] = (pos - 1) * 2;
+        }
+
+        std::vector<size_t> lo(m_fn.types.size(), SIZE_MAX);
+        std::vector<size_t> hi(m_fn.types.size(), 0);
+        const auto extend = [&](const ir::VReg vreg, const size_t at) {
+            lo[vreg] = std::min(lo[vreg], at);
+            hi[vreg] = std::max(hi[vreg], at);
+        };
+
+        for (const ir::BlockId id: m_order) {
+            const ir::Block &block = m_fn.blocks[id];
+            for (const ir::VReg vreg: live_in[id]) {
+                extend(vreg, start[id]);
+            }
+            for (const ir::VReg vreg: live_out[id]) {
+                extend(vreg, end[id]);
+            }
+            for (const ir::Instr &phi: block.phis) {
+                // The copies into a phi happen at the end of each predecessor.
+                extend(phi.dst, start[id]);
+                for (const ir::BlockId pred: block.preds) {
+                    extend(phi.dst, end[pred]);
+                }
+            }
+            for (size_t i = 0; i < block.instrs.size(); i++) {
+                const ir::Instr &instr = block.instrs[i];
+                if (instr.op == ir::Opcode::cond_br && i > 0 && fused(block, i - 1)) {
+                    continue;
+                }
+                // The operands of a fused comparison are read by the branch that follows it.
+                const size_t use = start[id] + (i + fused(block, i)) * 2;
+                ir::for_each_use(instr, [&](const ir::VReg vreg) {
+                    if (allocatable(vreg)) {
+                        extend(vreg, use);
+                    }
+                });
+                if (instr.dst != ir::none && allocatable(instr.dst) && m_use_count[instr.dst] != 0 &&
+                    !fused(block, i)) {
+                    extend(instr.dst, start[id] + i * 2 + 1);
+                }
+            }
+        }
+
+        for (ir::VReg vreg = 0; vreg < m_fn.types.size(); vreg++) {
+            if (lo[vreg] != SIZE_MAX) {
+                m_intervals.push_back({vreg, lo[vreg], hi[vreg]});
+            }
+        }
+        std::sort(m_intervals.begin(), m_intervals.end(), [](const Interval &a, const Interval &b) {
+            return a.start < b.start;
+        });
+    }
+
+    void allocate() {
+        std::vector<Reg> free_regs(s_regs.rbegin(), s_regs.rend());
+        // Indices into m_intervals, by increasing end.
+        std::vector<size_t> active;
+        const auto spill = [&](const ir::VReg vreg) {
+            m_loc[vreg] = stack_op(static_cast<int64_t>(m_slot_count * 8));
+            m_slot_count++;
+        };
+
+        for (size_t i = 0; i < m_intervals.size(); i++) {
+            const Interval &curr = m_intervals[i];
+            while (!active.empty() && m_intervals[active.front()].end < curr.start) {
+                free_regs.push_back(m_loc[m_intervals[active.front()].vreg].reg);
+                active.erase(active.begin());
+            }
+
+            if (free_regs.empty()) {
+                const size_t victim = active.back();
+                if (m_intervals[victim].end <= curr.end) {
+                    spill(curr.vreg);
+                    continue;
+                }
+                free_regs.push_back(m_loc[m_intervals[victim].vreg].reg);
+                spill(m_intervals[victim].vreg);
+                active.pop_back();
+            }
+
+            m_loc[curr.vreg] = reg_op(free_regs.back());
+            free_regs.pop_back();
+            const auto at = std::upper_bound(active.begin(), active.end(), curr.end,
+                                             [&](const size_t end, const size_t index) {
+                                                 return end < m_intervals[index].end;
+                                             });
+            active.insert(at, i);
+        }
+    }
+
+    // Memory-to-memory moves and wide immediates into memory go through rax.
+    void move(const Operand &dst, const Operand &src) {
+        if (same_location(dst, src)) {
+            return;
+        }
+        if (dst.kind == Operand::Kind::mem &&
+            (src.kind == Operand::Kind::mem || (src.kind == Operand::Kind::imm && !fits_i32(src.value)))) {
+            emit(Op::mov, reg_op(Reg::rax), src);
+            emit(Op::mov, dst, reg_op(Reg::rax));
+            return;
+        }
+        emit(Op::mov, dst, src);
+    }
+
+    // Sets the flags from lhs - rhs.
+    void compare(const Operand &lhs, const Operand &rhs) {
+        if (lhs.kind == Operand::Kind::reg ||
+            (lhs.kind == Operand::Kind::mem && rhs.kind != Operand::Kind::mem)) {
+            emit(Op::cmp, lhs, rhs);
+            return;
+        }
+        emit(Op::mov, reg_op(Reg::rax), lhs);
+        emit(Op::cmp, reg_op(Reg::rax), rhs);
+    }
+
+    // Moves each phi's incoming value from pred into place. The moves happen all at once, so they are
+    // ordered to never overwrite a source that is still needed, and cycles are broken through rdx.
+    void gen_phi_copies(const ir::BlockId pred, const ir::BlockId succ) {
+        const ir::Block &block = m_fn.blocks[succ];
+        if (block.phis.empty()) {
+            return;
+        }
+        const size_t pred_index = std::find(block.preds.begin(), block.preds.end(), pred) - block.preds.begin();
+
+        std::vector<std::pair<Operand, Operand>> moves;
+        for (const ir::Instr &phi: block.phis) {
+            const Operand dst = m_loc[phi.dst];
+            const Operand src = m_loc[phi.incoming[pred_index]];
+            if (dst.kind != Operand::Kind::none && !same_location(dst, src)) {
+                moves.emplace_back(dst, src);
+            }
+        }
+
+        while (!moves.empty()) {
+            const auto ready = std::find_if(moves.begin(), moves.end(), [&](const auto &move) {
+                return std::none_of(moves.begin(), moves.end(), [&](const auto &other) {
+                    return same_location(other.second, move.first);
+                });
+            });
+            if (ready != moves.end()) {
+                move(ready->first, ready->second);
+                moves.erase(ready);
+                continue;
+            }
+
+            const Operand saved = moves.front().first;
+            emit(Op::mov, reg_op(Reg::rdx), saved);
+            for (auto &[dst, src]: moves) {
+                if (same_location(src, saved)) {
+                    src = reg_op(Reg::rdx);
+                }
+            }
+        }
+    }
+
+    void gen_arith(const ir::Instr &instr) {
+        const Operand lhs = m_loc[instr.lhs];
+        const Operand rhs = m_loc[instr.rhs];
+        const bool unused = m_use_count[instr.dst] == 0;
+
+        if (instr.op == ir::Opcode::div) {
+            emit(Op::mov, reg_op(Reg::rax), lhs);
+            emit(Op::cqo);
+            emit(Op::idiv, rhs);
+            if (!unused) {
+                move(m_loc[instr.dst], reg_op(Reg::rax));
+            }
+            return;
+        }
+        if (unused) {
+            return;
+        }
+
+        const Op op = instr.op == ir::Opcode::add ? Op::add : instr.op == ir::Opcode::sub ? Op::sub : Op::imul;
+        const Operand dst = m_loc[instr.dst];
+        if (dst.kind == Operand::Kind::reg && !same_location(dst, rhs)) {
+            move(dst, lhs);
+            emit(op, dst, rhs);
+        } else if (dst.kind == Operand::Kind::reg && op != Op::sub) {
+            emit(op, dst, lhs);
+        } else {
+            emit(Op::mov, reg_op(Reg::rax), lhs);
+            emit(op, reg_op(Reg::rax), rhs);
+            move(dst, reg_op(Reg::rax));
+        }
+    }
+
+    // Returns whether the block ticks the loop guard.
+    bool lower_block(const ir::BlockId id, const ir::BlockId next, const int tle_label) {
+        const ir::Block &block = m_fn.blocks[id];
+        const bool watchdog = m_options.watchdog_ms.has_value();
+        bool guarded = false;
+        emit(Op::label, label_op(static_cast<int>(id)));
+
+        for (size_t i = 0; i < block.instrs.size(); i++) {
+            const ir::Instr &instr = block.instrs[i];
+            switch (instr.op) {
+                case ir::Opcode::constant:
+                    if (allocatable(instr.dst) && m_use_count[instr.dst] != 0) {
+                        move(m_loc[instr.dst], imm_op(instr.imm));
+                    }
+                    break;
+                case ir::Opcode::add:
+                case ir::Opcode::sub:
+                case ir::Opcode::mul:
+                case ir::Opcode::div:
+                    gen_arith(instr);
+                    break;
+                case ir::Opcode::cmp: {
+                    if (fused(block, i) || m_use_count[instr.dst] == 0) {
+                        break;
+                    }
+                    const Operand dst = m_loc[instr.dst];
+                    const Reg flag = dst.kind == Operand::Kind::reg ? dst.reg : Reg::rax;
+                    compare(m_loc[instr.lhs], m_loc[instr.rhs]);
+                    m_instr_count += 2;
+                    m_out.emit({.op = Op::setcc, .dst = reg_op(flag), .cond = cond_of(instr.cmp)});
+                    m_out.emit({.op = Op::movzx, .dst = reg_op(flag), .src = reg_op(flag)});
+                    move(dst, reg_op(flag));
+                    break;
+                }
+                case ir::Opcode::zext:
+                    if (m_use_count[instr.dst] != 0) {
+                        move(m_loc[instr.dst], m_loc[instr.lhs]);
+                    }
+                    break;
+                case ir::Opcode::phi:
+                    break;
+                case ir::Opcode::guard_init:
+                    if (!watchdog) {
+                        emit(Op::mov, reg_op(Reg::rcx), imm_op(1000000000));
+                    }
+                    break;
+                case ir::Opcode::guard_tick:
+                    if (!watchdog) {
+                        emit(Op::dec, reg_op(Reg::rcx));
+                        emit(Op::cmp, reg_op(Reg::rcx), imm_op(0));
+                        emit_jump(Cond::le, tle_label);
+                        guarded = true;
+                    }
+                    break;
+                case ir::Opcode::br:
+                    gen_phi_copies(id, instr.targets[0]);
+                    if (instr.targets[0] != next) {
+                        emit(Op::jmp, label_op(static_cast<int>(instr.targets[0])));
+                    }
+                    break;
+                case ir::Opcode::cond_br: {
+                    Cond cond = Cond::ne;
+                    if (i > 0 && fused(block, i - 1)) {
+                        const ir::Instr &cmp = block.instrs[i - 1];
+                        compare(m_loc[cmp.lhs], m_loc[cmp.rhs]);
+                        cond = cond_of(cmp.cmp);
+                    } else {
+                        compare(m_loc[instr.lhs], imm_op(0));
+                    }
+
+                    const int taken = static_cast<int>(instr.targets[0]);
+                    const int not_taken = static_cast<int>(instr.targets[1]);
+                    if (instr.targets[0] == next) {
+                        emit_jump(invert(cond), not_taken);
+                    } else {
+                        emit_jump(cond, taken);
+                        if (instr.targets[1] != next) {
+                            emit(Op::jmp, label_op(not_taken));
+                        }
+                    }
+                    break;
+                }
+                case ir::Opcode::exit:
+                    move(reg_op(Reg::rdi), m_loc[instr.lhs]);
+                    emit(Op::mov, reg_op(Reg::rax), imm_op(60));
+                    emit(Op::syscall);
+                    break;
+                case ir::Opcode::unreachable:
+                    emit(Op::ud2);
+                    break;
+            }
+        }
+        return guarded;
+    }
+
+    static constexpr std::array<Reg, 12> s_regs = {
+        Reg::rbx, Reg::r12, Reg::r13, Reg::r14, Reg::r15, Reg::rsi, Reg::rdi, Reg::rbp,
+        Reg::r8, Reg::r9, Reg::r10, Reg::r11
+    };
+
+    ir::Function &m_fn;
+    AsmSink &m_out;
+    const GenOptions m_options;
+    std::vector<ir::BlockId> m_order{};
+    std::vector<ir::BlockId> m_def_block{};
+    std::vector<uint32_t> m_use_count{};
+    std::vector<bool> m_imm{};
+    std::vector<Operand> m_loc{};
+    std::vector<Interval> m_intervals{};
+    size_t m_slot_count = 0;
+    size_t m_instr_count = 0;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <vector>
+
+#include "errors.hpp"
+
+// Runs an image from X86Encoder in this process, for --run. The image only addresses itself
+// rip-relative, so it works at whatever address mmap picks. It is copied into a writable mapping that
+// is then flipped to read+execute, and entered with a plain call. Programs end with the exit syscall,
+// which takes the process down with the program's status, so control never comes back. A program
+// that runs off its end faults here, just as its executable would.
+[[noreturn]] inline void run_image(const std::vector<uint8_t> &image) {
+    const size_t size = image.empty() ? 1 : image.size();
+    void *code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        std::cerr << "[JIT Error] Unable to map " << size << " bytes" << std::endl;
+        fail();
+    }
+    std::memcpy(code, image.data(), image.size());
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        std::cerr << "[JIT Error] Unable to make the code executable" << std::endl;
+        fail();
+    }
+
+    // The generated code exits the process directly, past stdio, so anything still buffered goes first.
+    std::cout.flush();
+    std::cerr.flush();
+    reinterpret_cast<void (*)()>(code)();
+    std::abort();
+}
@@ -0,0 +1,461 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "ir.hpp"
+
+// Loop optimizations on the SSA IR. Natural loops are found from the back edges of the dominator
+// tree and each is given a preheader, a block that runs once right before the loop is entered.
+// Then, innermost loops first:
+//
+// - Loop-invariant code motion moves every pure instruction whose operands are all defined outside
+//   the loop into the preheader. Division can trap, so it only moves when the divisor is a
+//   constant other than 0 or -1.
+// - Induction variable simplification finds header phis stepped by an invariant amount on the back
+//   edge (`z = z + 1`), and replaces each product of one with an invariant by a new induction
+//   variable that starts at the initial product and is stepped by addition. Arithmetic wraps, so
+//   the two agree on every iteration.
+class LoopOptimizer {
+public:
+    explicit LoopOptimizer(ir::Function &fn) : m_fn(fn) {
+    }
+
+    void optimize() {
+        insert_preheaders();
+
+        const ir::DomTree dom(m_fn);
+        std::vector<Loop> loops = find_loops(dom);
+        // A loop nested in another has strictly fewer blocks, so this visits inner loops first.
+        std::sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) {
+            return a.blocks.size() < b.blocks.size();
+        });
+
+        const std::vector<ir::BlockId> order = ir::reverse_postorder(m_fn);
+        m_rank.assign(m_fn.blocks.size(), 0);
+        for (uint32_t i = 0; i < order.size(); i++) {
+            m_rank[order[i]] = i;
+        }
+
+        scan_defs();
+        for (const Loop &loop: loops) {
+            hoist_invariants(loop);
+            simplify_induction(loop);
+        }
+        rewrite_uses();
+    }
+
+    // Instructions moved into a preheader, not counting constants.
+    [[nodiscard]] size_t hoisted() const {
+        return m_hoisted;
+    }
+
+    // Multiplications replaced by an induction variable.
+    [[nodiscard]] size_t reduced() const {
+        return m_reduced;
+    }
+
+private:
+    struct Loop {
+        ir::BlockId header;
+        ir::BlockId preheader = ir::none;
+        // Sorted; includes the header.
+        std::vector<ir::BlockId> blocks{};
+        std::vector<ir::BlockId> latches{};
+    };
+
+    // An induction variable: a header phi that is `phi op step` on the back edge.
+    struct Induction {
+        ir::VReg init;
+        ir::VReg step;
+        ir::Opcode op;
+        ir::VReg next;
+    };
+
+    static bool contains(const Loop &loop, const ir::BlockId block) {
+        return std::binary_search(loop.blocks.begin(), loop.blocks.end(), block);
+    }
+
+    std::vector<Loop> find_loops(const ir::DomTree &dom) const {
+        std::vector<Loop> loops;
+        std::vector<uint32_t> loop_of(m_fn.blocks.size(), ir::none);
+        for (ir::BlockId block = 0; block < m_fn.blocks.size(); block++) {
+            for (const ir::BlockId succ: ir::successors(m_fn.blocks[block])) {
+                if (!dom.dominates(succ, block)) {
+                    continue;
+                }
+                if (loop_of[succ] == ir::none) {
+                    loop_of[succ] = static_cast<uint32_t>(loops.size());
+                    loops.push_back({.header = succ});
+                }
+                loops[loop_of[succ]].latches.push_back(block);
+            }
+        }
+
+        // The body is everything that reaches a latch without going through the header.
+        std::vector<uint32_t> seen(m_fn.blocks.size(), ir::none);
+        for (uint32_t index = 0; index < loops.size(); index++) {
+            Loop &loop = loops[index];
+            seen[loop.header] = index;
+            loop.blocks.push_back(loop.header);
+            std::vector<ir::BlockId> work;
+            for (const ir::BlockId latch: loop.latches) {
+                if (seen[latch] != index) {
+                    seen[latch] = index;
+                    loop.blocks.push_back(latch);
+                    work.push_back(latch);
+                }
+            }
+            while (!work.empty()) {
+                const ir::BlockId block = work.back();
+                work.pop_back();
+                for (const ir::BlockId pred: m_fn.blocks[block].preds) {
+                    if (seen[pred] != index) {
+                        seen[pred] = index;
+                        loop.blocks.push_back(pred);
+                        work.push_back(pred);
+                    }
+                }
+            }
+            std::sort(loop.blocks.begin(), loop.blocks.end());
+
+            const std::vector<ir::BlockId> &preds = m_fn.blocks[loop.header].preds;
+            const auto outside = [&](const ir::BlockId pred) { return !contains(loop, pred); };
+            if (std::count_if(preds.begin(), preds.end(), outside) == 1) {
+                const ir::BlockId entry = *std::find_if(preds.begin(), preds.end(), outside);
+                if (ir::successors(m_fn.blocks[entry]).size() == 1) {
+                    loop.preheader = entry;
+                }
+            }
+        }
+        return loops;
+    }
+
+    // Gives every loop a single outside predecessor that only branches to the header. Values that
+    // came in along several entry edges are merged by phis in the new block.
+    void insert_preheaders() {
+        const ir::DomTree dom(m_fn);
+        for (const Loop &loop: find_loops(dom)) {
+            if (loop.preheader != ir::none) {
+                continue;
+            }
+
+            const ir::BlockId preheader = m_fn.new_block();
+            ir::Block &header = m_fn.blocks[loop.header];
+            std::vector<size_t> inside;
+            std::vector<size_t> outside;
+            for (size_t i = 0; i < header.preds.size(); i++) {
+                (contains(loop, header.preds[i]) ? inside : outside).push_back(i);
+            }
+
+            std::vector<ir::BlockId> preds;
+            for (const size_t i: outside) {
+                preds.push_back(header.preds[i]);
+            }
+            for (const ir::BlockId pred: preds) {
+                for (ir::BlockId &succ: ir::successors(m_fn.blocks[pred])) {
+                    if (succ == loop.header) {
+                        succ = preheader;
+                    }
+                }
+            }
+            std::sort(preds.begin(), preds.end());
+            preds.erase(std::unique(preds.begin(), preds.end()), preds.end());
+
+            ir::Block entry{};
+            for (const ir::BlockId pred: preds) {
+                const std::span<const ir::BlockId> succs = ir::successors(m_fn.blocks[pred]);
+                entry.preds.insert(entry.preds.end(), std::count(succs.begin(), succs.end(), preheader), pred);
+            }
+
+            for (ir::Instr &phi: header.phis) {
+                ir::Instr merge{.op = ir::Opcode::phi};
+                for (const ir::BlockId pred: entry.preds) {
+                    const size_t i = *std::find_if(outside.begin(), outside.end(), [&](const size_t index) {
+                        return header.preds[index] == pred;
+                    });
+                    merge.incoming.push_back(phi.incoming[i]);
+                }
+
+                ir::VReg value = merge.incoming.front();
+                if (std::any_of(merge.incoming.begin(), merge.incoming.end(),
+                                [&](const ir::VReg incoming) { return incoming != value; })) {
+                    merge.dst = m_fn.new_vreg(m_fn.types[phi.dst]);
+                    value = merge.dst;
+                    entry.phis.push_back(std::move(merge));
+                }
+
+                std::vector<ir::VReg> incoming;
+                for (const size_t i: inside) {
+                    incoming.push_back(phi.incoming[i]);
+                }
+                incoming.push_back(value);
+                phi.incoming = std::move(incoming);
+            }
+
+            std::vector<ir::BlockId> header_preds;
+            for (const size_t i: inside) {
+                header_preds.push_back(header.preds[i]);
+            }
+            header_preds.push_back(preheader);
+            header.preds = std::move(header_preds);
+
+            entry.instrs.push_back({.op = ir::Opcode::br, .targets = {loop.header}});
+            m_fn.blocks[preheader] = std::move(entry);
+        }
+    }
+
+    void scan_defs() {
+        m_def_block.assign(m_fn.types.size(), ir::none);
+        m_replace.assign(m_fn.types.size(), ir::none);
+        for (ir::BlockId id = 0; id < m_fn.blocks.size(); id++) {
+            for (const ir::Instr &phi: m_fn.blocks[id].phis) {
+                m_def_block[phi.dst] = id;
+            }
+            for (const ir::Instr &instr: m_fn.blocks[id].instrs) {
+                if (instr.dst == ir::none) {
+                    continue;
+                }
+                m_def_block[instr.dst] = id;
+                if (instr.op == ir::Opcode::constant) {
+                    m_constants.emplace(instr.dst, instr.imm);
+                }
+            }
+        }
+    }
+
+    ir::VReg new_vreg(const ir::BlockId block) {
+        const ir::VReg vreg = m_fn.new_vreg(ir::Type::i64);
+        m_def_block.push_back(block);
+        m_replace.push_back(ir::none);
+        return vreg;
+    }
+
+    ir::VReg resolve(ir::VReg vreg) const {
+        while (m_replace[vreg] != ir::none) {
+            vreg = m_replace[vreg];
+        }
+        return vreg;
+    }
+
+    [[nodiscard]] bool invariant(const Loop &loop, const ir::VReg vreg) const {
+        return !contains(loop, m_def_block[resolve(vreg)]);
+    }
+
+    [[nodiscard]] bool hoistable(const Loop &loop, const ir::Instr &instr) const {
+        switch (instr.op) {
+            case ir::Opcode::constant:
+            case ir::Opcode::add:
+            case ir::Opcode::sub:
+            case ir::Opcode::mul:
+            case ir::Opcode::cmp:
+            case ir::Opcode::zext:
+                break;
+            case ir::Opcode::div: {
+                const auto divisor = m_constants.find(resolve(instr.rhs));
+                if (divisor == m_constants.end() || divisor->second == 0 || divisor->second == -1) {
+                    return false;
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+        bool operands_invariant = true;
+        ir::for_each_use(instr, [&](const ir::VReg use) { operands_invariant &= invariant(loop, use); });
+        return operands_invariant;
+    }
+
+    // Appends instr to the preheader, ahead of its branch into the loop.
+    void append_to_preheader(const Loop &loop, ir::Instr instr) {
+        std::vector<ir::Instr> &instrs = m_fn.blocks[loop.preheader].instrs;
+        if (instr.dst != ir::none) {
+            m_def_block[instr.dst] = loop.preheader;
+        }
+        instrs.insert(instrs.end() - 1, std::move(instr));
+    }
+
+    // Blocks are visited in reverse postorder, so whatever an instruction depends on has already had
+    // its chance to move. A comparison that feeds the branch right after it stays, so that the two
+    // are still emitted as one cmp and jcc.
+    void hoist_invariants(const Loop &loop) {
+        std::vector<ir::BlockId> order = loop.blocks;
+        std::sort(order.begin(), order.end(), [&](const ir::BlockId a, const ir::BlockId b) {
+            return m_rank[a] < m_rank[b];
+        });
+        for (const ir::BlockId id: order) {
+            std::vector<ir::Instr> &instrs = m_fn.blocks[id].instrs;
+            std::vector<ir::Instr> kept;
+            kept.reserve(instrs.size());
+            for (size_t i = 0; i < instrs.size(); i++) {
+                ir::Instr &instr = instrs[i];
+                const bool feeds_branch = i + 1 < instrs.size() && instrs[i + 1].op == ir::Opcode::cond_br &&
+                                          instrs[i + 1].lhs == instr.dst;
+                if (feeds_branch || !hoistable(loop, instr)) {
+                    kept.push_back(std::move(instr));
+                    continue;
+                }
+                m_hoisted += instr.op != ir::Opcode::constant;
+                for (ir::VReg *use: {&instr.lhs, &instr.rhs}) {
+                    if (*use != ir::none) {
+                        *use = resolve(*use);
+                    }
+                }
+                append_to_preheader(loop, std::move(instr));
+            }
+            m_fn.blocks[id].instrs = std::move(kept);
+        }
+    }
+
+    // The product lhs * rhs, computed in the preheader, folded when both are constants.
+    ir::VReg preheader_product(const Loop &loop, const ir::VReg lhs, const ir::VReg rhs) {
+        const auto lhs_value = m_constants.find(lhs);
+        const auto rhs_value = m_constants.find(rhs);
+        const ir::VReg dst = new_vreg(loop.preheader);
+        if (lhs_value != m_constants.end() && rhs_value != m_constants.end()) {
+            const auto product = static_cast<int64_t>(static_cast<uint64_t>(lhs_value->second) *
+                                                      static_cast<uint64_t>(rhs_value->second));
+            m_constants.emplace(dst, product);
+            append_to_preheader(loop, {.op = ir::Opcode::constant, .dst = dst, .imm = product});
+        } else {
+            append_to_preheader(loop, {.op = ir::Opcode::mul, .dst = dst, .lhs = lhs, .rhs = rhs});
+        }
+        return dst;
+    }
+
+    std::unordered_map<ir::VReg, Induction> find_inductions(const Loop &loop, const size_t latch_index,
+                                                            const size_t entry_index) const {
+        std::unordered_map<ir::VReg, Induction> inductions;
+        for (const ir::Instr &phi: m_fn.blocks[loop.header].phis) {
+            const ir::VReg next = resolve(phi.incoming[latch_index]);
+            const ir::BlockId block = m_def_block[next];
+            if (!contains(loop, block)) {
+                continue;
+            }
+            const std::vector<ir::Instr> &instrs = m_fn.blocks[block].instrs;
+            const auto def = std::find_if(instrs.begin(), instrs.end(), [&](const ir::Instr &instr) {
+                return instr.dst == next;
+            });
+            if (def == instrs.end() || (def->op != ir::Opcode::add && def->op != ir::Opcode::sub)) {
+                continue;
+            }
+            const ir::VReg lhs = resolve(def->lhs);
+            const ir::VReg rhs = resolve(def->rhs);
+            const ir::VReg init = resolve(phi.incoming[entry_index]);
+            if (def->op == ir::Opcode::add && lhs == phi.dst && invariant(loop, rhs)) {
+                inductions.emplace(phi.dst, Induction{init, rhs, ir::Opcode::add, next});
+            } else if (def->op == ir::Opcode::add && rhs == phi.dst && invariant(loop, lhs)) {
+                inductions.emplace(phi.dst, Induction{init, lhs, ir::Opcode::add, next});
+            } else if (def->op == ir::Opcode::sub && lhs == phi.dst && invariant(loop, rhs)) {
+                inductions.emplace(phi.dst, Induction{init, rhs, ir::Opcode::sub, next});
+            }
+        }
+        return inductions;
+    }
+
+    // Repeats until no product is left, so that products of the new induction variables are
+    // reduced as well.
+    void simplify_induction(const Loop &loop) {
+        if (loop.latches.size() != 1) {
+            return;
+        }
+        const std::vector<ir::BlockId> &preds = m_fn.blocks[loop.header].preds;
+        const size_t latch_index = std::find(preds.begin(), preds.end(), loop.latches.front()) - preds.begin();
+        const size_t entry_index = std::find(preds.begin(), preds.end(), loop.preheader) - preds.begin();
+
+        // Induction variable replacing each (phi, factor) product.
+        std::unordered_map<uint64_t, ir::VReg> derived;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            const std::unordered_map<ir::VReg, Induction> inductions = find_inductions(loop, latch_index, entry_index);
+            if (inductions.empty()) {
+                return;
+            }
+
+            for (const ir::BlockId id: loop.blocks) {
+                for (size_t i = 0; i < m_fn.blocks[id].instrs.size(); i++) {
+                    // Deriving a variable may insert into this block, so the instruction is read by value.
+                    const ir::Instr instr = m_fn.blocks[id].instrs[i];
+                    if (instr.op != ir::Opcode::mul || m_replace[instr.dst] != ir::none) {
+                        continue;
+                    }
+                    const ir::VReg lhs = resolve(instr.lhs);
+                    const ir::VReg rhs = resolve(instr.rhs);
+                    const bool lhs_induction = inductions.contains(lhs) && invariant(loop, rhs);
+                    if (!lhs_induction && !(inductions.contains(rhs) && invariant(loop, lhs))) {
+                        continue;
+                    }
+                    const ir::VReg phi = lhs_induction ? lhs : rhs;
+                    const ir::VReg factor = lhs_induction ? rhs : lhs;
+                    const ir::VReg product = instr.dst;
+
+                    const uint64_t key = static_cast<uint64_t>(phi) << 32 | factor;
+                    if (!derived.contains(key)) {
+                        derived.emplace(key, derive(loop, inductions.at(phi), factor, latch_index, entry_index));
+                    }
+                    m_replace[product] = derived.at(key);
+                    m_reduced++;
+                    changed = true;
+                }
+            }
+            for (const ir::BlockId id: loop.blocks) {
+                std::erase_if(m_fn.blocks[id].instrs, [&](const ir::Instr &instr) {
+                    return instr.dst != ir::none && m_replace[instr.dst] != ir::none;
+                });
+            }
+        }
+    }
+
+    // New induction variable equal to induction * factor on every iteration.
+    ir::VReg derive(const Loop &loop, const Induction &induction, const ir::VReg factor, const size_t latch_index,
+                    const size_t entry_index) {
+        const ir::VReg init = preheader_product(loop, induction.init, factor);
+        const ir::VReg step = preheader_product(loop, induction.step, factor);
+
+        const ir::BlockId block = m_def_block[induction.next];
+        const ir::VReg phi = new_vreg(loop.header);
+        const ir::VReg next = new_vreg(block);
+
+        std::vector<ir::Instr> &instrs = m_fn.blocks[block].instrs;
+        const auto after = std::find_if(instrs.begin(), instrs.end(), [&](const ir::Instr &instr) {
+            return instr.dst == induction.next;
+        }) + 1;
+        instrs.insert(after, {.op = induction.op, .dst = next, .lhs = phi, .rhs = step});
+
+        ir::Instr merge{.op = ir::Opcode::phi, .dst = phi};
+        merge.incoming.resize(m_fn.blocks[loop.header].preds.size());
+        merge.incoming[entry_index] = init;
+        merge.incoming[latch_index] = next;
+        m_fn.blocks[loop.header].phis.push_back(std::move(merge));
+        return phi;
+    }
+
+    void rewrite_uses() {
+        for (ir::Block &block: m_fn.blocks) {
+            for (ir::Instr &phi: block.phis) {
+                for (ir::VReg &incoming: phi.incoming) {
+                    incoming = resolve(incoming);
+                }
+            }
+            for (ir::Instr &instr: block.instrs) {
+                if (instr.lhs != ir::none) {
+                    instr.lhs = resolve(instr.lhs);
+                }
+                if (instr.rhs != ir::none) {
+                    instr.rhs = resolve(instr.rhs);
+                }
+            }
+        }
+    }
+
+    ir::Function &m_fn;
+    std::vector<ir::BlockId> m_def_block{};
+    // The register an eliminated one was replaced by, or none.
+    std::vector<ir::VReg> m_replace{};
+    std::unordered_map<ir::VReg, int64_t> m_constants{};
+    // Position of each block in reverse postorder.
+    std::vector<uint32_t> m_rank{};
+    size_t m_hoisted = 0;
+    size_t m_reduced = 0;
+};
@@ -1,45 +1,485 @@
 #include<iostream>
 #include<sstream>
 #include<fstream>
+#include <atomic>
+#include <charconv>
+#include <cstdlib>
+#include <functional>
+#include <new>
 #include <optional>
+#include <string>
+#include <unordered_set>
 #include <vector>
 
+#include "bytecode.hpp"
+#include "cache.hpp"
+#include "elimination.hpp"
+#include "encoding.hpp"
+#include "errors.hpp"
+#include "folding.hpp"
 #include "generation.hpp"
+#include "ir_builder.hpp"
+#include "interpreter.hpp"
+#include "ir_lowering.hpp"
+#include "jit.hpp"
+#include "loops.hpp"
+#include "peephole.hpp"
+#include "pool.hpp"
+#include "report.hpp"
+#include "server.hpp"
+#include "source.hpp"
+#include "unrolling.hpp"
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
+// Counting replacements for the global allocation functions, so --time-report can attribute heap
+// traffic to each phase. The array and nothrow forms forward here by default.
+void *operator new(const std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+struct DriverOptions {
+    bool emit_asm = false;
+    bool use_ir = false;
+    bool emit_ir = false;
+    bool run = false;
+    bool interp = false;
+    // Copies of the body per trip of a partially unrolled loop; 1 turns unrolling off.
+    size_t unroll = 4;
+    GenOptions gen{};
+};
+
+// Buffers a compile borrows instead of building its own. The CLI uses a workspace once, but the compile
+// server keeps one across requests, so the arena block, the interned names and the token and code
+// buffers are already sized when the next request comes in.
+struct Workspace {
+    ArenaAllocator arena{};
+    Interner symbols{};
+    std::vector<Token> tokens{};
+    std::vector<uint8_t> code{};
+
+    // Called before each compile. Names stay interned from one compile to the next until there are too many.
+    void recycle() {
+        arena.reset();
+        if (symbols.size() > s_max_symbols) {
+            symbols.clear();
+        }
+    }
+
+    static constexpr size_t s_max_symbols = 1 << 16;
+};
+
+// Starts a program that --run or --interp built and returns its exit status. The CLI calls it directly;
+// the compile server runs it in a child process.
+using Executor = std::function<int(const std::function<int()> &program)>;
+
+// Everything besides the source that decides the executable compile() writes. The build stamp retires
+// cached entries whenever fue itself is rebuilt.
+static std::string cache_config(const DriverOptions &options) {
+    std::string config = "fue " __DATE__ " " __TIME__;
+    config += options.use_ir ? " ir" : " ast";
+    config += " unroll=" + std::to_string(options.unroll);
+    if (options.gen.watchdog_ms.has_value()) {
+        config += " watchdog=" + std::to_string(options.gen.watchdog_ms.value());
+    }
+    return config;
+}
+
+// Where a batch input writes its outputs: its own path without the .fue extension.
+static std::string output_stem(const std::string_view input_path) {
+    if (input_path.ends_with(".fue")) {
+        return std::string(input_path.substr(0, input_path.size() - 4));
+    }
+    return std::string(input_path) + ".out";
+}
+
+// Compiles one input into the executable stem, going through stem.asm and stem.o with --emit-asm and
+// writing stem.ir with --emit-ir. Besides workspace, everything the compile needs is local, so calls with
+// their own workspaces may run concurrently.
+// With a cache, a program compiled before under the same options is copied out without running any
+// phase; runs that ask for assembly or IR always compile. With --run the machine code is left in image
+// instead of being written out, and with --interp the program is compiled to bytecode and nothing else.
+// Returns false once an error has been reported.
+static bool compile(const char *input_path, const std::string &stem, const DriverOptions &options,
+                    CompileCache *cache, TimeReport &report, Workspace &workspace, std::vector<uint8_t> *image = nullptr,
+                    bc::Program *bytecode = nullptr) {
+    try {
+        const SourceFile source(input_path);
+        report.counter("source bytes", source.view().size());
+
+        std::string cache_key;
+        if (cache != nullptr && !options.emit_asm && !options.emit_ir && !options.run && !options.interp) {
+            auto phase = report.phase("cache lookup");
+            cache_key = CompileCache::key(source.view(), cache_config(options));
+            if (cache->fetch(cache_key, stem)) {
+                report.counter("cache hits", 1);
+                return true;
+            }
+        }
+
+        workspace.recycle();
+        std::vector<Token> token;
+        {
+            auto phase = report.phase("tokenize");
+            Tokenizer tokenizer(source.view(), workspace.symbols);
+            token = tokenizer.tokenize(std::move(workspace.tokens));
+        }
+        report.counter("tokens", token.size());
+        report.counter("identifiers", workspace.symbols.size());
+
+        std::optional<Parser> parser;
+        std::optional<NodeProg> prog;
+        {
+            auto phase = report.phase("parse");
+            parser.emplace(std::move(token), workspace.arena);
+            prog = parser->parse_prog();
+        }
+        workspace.tokens = parser->take_tokens();
+
+        if (!prog.has_value()) {
+            std::cerr << "Invalid Program" << std::endl;
+            fail();
+        }
+        report.counter("ast nodes", parser->allocator().object_count() + prog->exprs.size());
+        report.counter("expression nodes", prog->exprs.size());
+
+        {
+            auto phase = report.phase("fold");
+            ConstantFolder folder(prog->exprs);
+            folder.fold_prog(prog.value());
+        }
+        size_t eliminated = 0;
+        {
+            auto phase = report.phase("dce");
+            DeadCodeEliminator eliminator(parser->allocator(), prog->exprs);
+            eliminator.eliminate_prog(prog.value());
+            eliminated += eliminator.eliminated();
+        }
+        {
+            auto phase = report.phase("unroll");
+            LoopUnroller unroller(parser->allocator(), prog->exprs, options.unroll);
+            unroller.unroll_prog(prog.value());
+            report.counter("unrolled loops", unroller.unrolled());
+            report.counter("partially unrolled", unroller.partially_unrolled());
+
+            // Fully unrolled bodies read the counter as a literal, which folding and DCE can now use.
+            if (unroller.unrolled() > 0) {
+                ConstantFolder folder(prog->exprs);
+                folder.fold_prog(prog.value());
+                DeadCodeEliminator eliminator(parser->allocator(), prog->exprs);
+                eliminator.eliminate_prog(prog.value());
+                eliminated += eliminator.eliminated();
+            }
+        }
+        report.counter("eliminated statements", eliminated);
+        report.counter("arena bytes used", parser->allocator().bytes_used());
+        report.counter("expression pool bytes", prog->exprs.bytes_used());
+        report.counter("arena bytes reserved", parser->allocator().bytes_reserved());
+
+        if (options.interp) {
+            {
+                auto phase = report.phase("bytecode");
+                BytecodeCompiler compiler(prog.value(), options.gen);
+                *bytecode = compiler.compile();
+            }
+            report.counter("bytecode instructions", bytecode->code.size());
+            report.counter("bytecode registers", bytecode->register_count + bytecode->constants.size());
+            return true;
+        }
+
+        std::optional<ir::Function> ir_fn;
+        if (options.use_ir) {
+            {
+                auto phase = report.phase("ir build");
+                IrBuilder builder;
+                ir_fn = builder.build(prog.value());
+            }
+            report.counter("ir blocks", ir_fn->blocks.size());
+            {
+                auto phase = report.phase("loop opt");
+                LoopOptimizer optimizer(ir_fn.value());
+                optimizer.optimize();
+                report.counter("hoisted instructions", optimizer.hoisted());
+                report.counter("reduced multiplications", optimizer.reduced());
+            }
+            {
+                auto phase = report.phase("ir verify");
+                if (const std::optional<std::string> error = ir::verify(ir_fn.value())) {
+                    std::cerr << "[IR Error] " << error.value() << std::endl;
+                    fail();
+                }
+            }
+            report.counter("ir instructions", ir_fn->instruction_count());
+
+            if (options.emit_ir) {
+                auto phase = report.phase("ir write");
+                OutputFile file((stem + ".ir").c_str());
+                ir::print(ir_fn.value(), file);
+                file.close();
+            }
+        }
+
+        // Lowers the program through the IR backend when it was built, and straight from the AST otherwise,
+        // with the peephole pass between the backend and sink.
+        const auto codegen = [&](AsmSink &sink) {
+            PeepholeOptimizer peephole(sink);
+            if (ir_fn.has_value()) {
+                IrLowering lowering(ir_fn.value(), peephole, options.gen);
+                lowering.lower();
+                report.counter("instructions", lowering.instruction_count());
+                report.counter("spilled registers", lowering.spill_count());
+            } else {
+                Generator generator(std::move(prog.value()), peephole, options.gen);
+                generator.gen_prog();
+                report.counter("instructions", generator.instruction_count());
+            }
+            peephole.finish();
+            report.counter("peephole removals", peephole.removed());
+        };
+
+        if (options.emit_asm) {
+            {
+                OutputFile file((stem + ".asm").c_str());
+                {
+                    auto phase = report.phase("codegen");
+                    TextAsm text(file);
+                    codegen(text);
+                }
+                auto phase = report.phase("asm write");
+                file.close();
+            }
+
+            auto phase = report.phase("assemble/link");
+            system(("nasm -f elf64 '" + stem + ".asm'").c_str());
+            system(("ld -o '" + stem + "' '" + stem + ".o'").c_str());
+        } else {
+            X86Encoder encoder(std::move(workspace.code));
+            {
+                auto phase = report.phase("codegen");
+                codegen(encoder);
+            }
+
+            std::vector<uint8_t> code;
+            {
+                auto phase = report.phase("assemble/link");
+                code = encoder.finish();
+            }
+            report.counter("code bytes", code.size());
+
+            if (options.run) {
+                *image = std::move(code);
+                return true;
+            }
+            auto phase = report.phase("elf write");
+            write_elf(stem, code);
+            workspace.code = std::move(code);
+        }
+
+        if (!cache_key.empty()) {
+            auto phase = report.phase("cache store");
+            cache->store(cache_key, stem);
+        }
+    } catch (const CompileError &) {
+        return false;
+    }
+    return true;
+}
+
+// Runs one fue command line; args are the arguments after the program name.
+static int drive(const std::vector<std::string> &args, Workspace &workspace, const Executor &execute) {
+    DriverOptions options;
+    bool time_report = false;
+    bool report_json = false;
+    std::optional<size_t> jobs;
+    std::optional<std::string> cache_dir;
+    uint64_t cache_limit_mib = 256;
+    std::vector<std::string> input_paths;
+    bool usage_error = false;
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string_view arg(args[i]);
+        if (arg == "--emit-asm") {
+            options.emit_asm = true;
+        } else if (arg == "--ir") {
+            options.use_ir = true;
+        } else if (arg == "--emit-ir") {
+            options.use_ir = true;
+            options.emit_ir = true;
+        } else if (arg == "--run") {
+            options.run = true;
+        } else if (arg == "--interp") {
+            options.interp = true;
+        } else if (arg == "--time-report") {
+            time_report = true;
+        } else if (arg == "--time-report=json") {
+            time_report = true;
+            report_json = true;
+        } else if (arg.starts_with("--watchdog=")) {
+            const std::string_view value = arg.substr(std::string_view("--watchdog=").size());
+            uint64_t ms = 0;
+            const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), ms);
+            if (ec != std::errc() || ptr != value.data() + value.size() || ms == 0 || ms > INT32_MAX) {
+                std::cerr << "Invalid watchdog time limit: " << value << " (milliseconds)" << std::endl;
+                return EXIT_FAILURE;
+            }
+            options.gen.watchdog_ms = ms;
+        } else if (arg.starts_with("--unroll=")) {
+            const std::string_view value = arg.substr(std::string_view("--unroll=").size());
+            size_t factor = 0;
+            const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), factor);
+            if (ec != std::errc() || ptr != value.data() + value.size() || factor == 0 || factor > 64) {
+                std::cerr << "Invalid unroll factor: " << value << " (1 to 64)" << std::endl;
+                return EXIT_FAILURE;
+            }
+            options.unroll = factor;
+        } else if (arg.starts_with("--cache=")) {
+            cache_dir = std::string(arg.substr(std::string_view("--cache=").size()));
+        } else if (arg.starts_with("--cache-limit=")) {
+            const std::string_view value = arg.substr(std::string_view("--cache-limit=").size());
+            const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), cache_limit_mib);
+            if (ec != std::errc() || ptr != value.data() + value.size() || cache_limit_mib == 0 ||
+                cache_limit_mib > (1 << 20)) {
+                std::cerr << "Invalid cache limit: " << value << " (MiB)" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg.starts_with("-j")) {
+            std::string_view value = arg.substr(2);
+            if (value.empty() && i + 1 < args.size()) {
+                value = args[++i];
+            }
+            size_t count = 0;
+            const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), count);
+            if (ec != std::errc() || ptr != value.data() + value.size() || count == 0 || count > 1024) {
+                std::cerr << "Invalid job count: " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+            jobs = count;
+        } else if (arg.starts_with("-")) {
+            usage_error = true;
+        } else {
+            input_paths.push_back(args[i]);
+        }
+    }
+
+    const bool run_usage_error = (options.run || options.interp) &&
+                                 (options.emit_asm || jobs.has_value() || input_paths.size() > 1);
+    const bool interp_usage_error = options.interp && (options.run || options.use_ir);
+    if (input_paths.empty() || usage_error || run_usage_error || interp_usage_error || (cache_dir.has_value() && cache_dir->empty())) {
         std::cerr << "Incorrect usage. Correct usage is ..." << std::endl;
-        std::cerr << "fue <input.fue>" << std::endl;
+        std::cerr << "fue [--emit-asm] [--ir | --emit-ir] [--time-report[=json]] [--watchdog=<ms>]" << std::endl;
+        std::cerr << "    [--unroll=<factor>] [--cache=<dir> [--cache-limit=<MiB>]] <input.fue>" << std::endl;
+        std::cerr << "fue --run [--ir | --emit-ir] [--time-report[=json]] [--watchdog=<ms>] <input.fue>" << std::endl;
+        std::cerr << "fue --interp [--time-report[=json]] [--watchdog=<ms>] <input.fue>" << std::endl;
+        std::cerr << "fue -j <jobs> [options] <input.fue>...   (each input writes its output beside itself)" << std::endl;
+        std::cerr << "fue --serve[=<socket>]   (answers requests on stdin, or on a UNIX socket)" << std::endl;
+        std::cerr << "fue --client=<socket> <any of the above>" << std::endl;
         return EXIT_FAILURE;
     }
 
-    std::string content;
-    {
-        std::stringstream content_stream;
-        std::fstream input(argv[1], std::ios::in);
-        content_stream << input.rdbuf();
-        content = content_stream.str();
+    std::optional<CompileCache> cache;
+    if (cache_dir.has_value()) {
+        cache.emplace(cache_dir.value(), cache_limit_mib << 20);
     }
+    CompileCache *const cache_ptr = cache.has_value() ? &cache.value() : nullptr;
+
+    // A single input keeps writing out, out.asm and out.ir; a batch names each output after its input.
+    if (!jobs.has_value() && input_paths.size() == 1) {
+        TimeReport report(time_report);
+        std::vector<uint8_t> image;
+        bc::Program bytecode;
+        const bool compiled = compile(input_paths.front().c_str(), "out", options, cache_ptr, report, workspace, &image,
+                                      &bytecode);
+        if (cache.has_value()) {
+            cache->finish();
+            report.counter("cache evictions", cache->evicted());
+        }
+        if (!compiled) {
+            return EXIT_FAILURE;
+        }
 
-    Tokenizer tokenizer(std::move(content));
-    std::vector<Token> token = tokenizer.tokenize();
+        int status = EXIT_SUCCESS;
+        if (options.interp) {
+            auto phase = report.phase("interpret");
+            status = execute([&] {
+                Interpreter interpreter(bytecode);
+                return interpreter.run();
+            });
+        }
+        if (report.enabled()) {
+            if (report_json) {
+                report.print_json(std::cout);
+            } else {
+                report.print_text(std::cerr);
+            }
+        }
+        if (options.run) {
+            return execute([&]() -> int { run_image(image); });
+        }
+        return status;
+    }
 
-    Parser parser(std::move(token));
-    std::optional<NodeProg> prog = parser.parse_prog();
+    if (time_report) {
+        std::cerr << "--time-report takes a single input" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    if (!prog.has_value()) {
-        std::cerr << "Invalid Program" << std::endl;
-        exit(EXIT_FAILURE);
+    std::vector<std::string> stems;
+    std::unordered_set<std::string> seen;
+    for (const std::string &input_path: input_paths) {
+        stems.push_back(output_stem(input_path));
+        if (!seen.insert(stems.back()).second) {
+            std::cerr << "Two inputs would both write " << stems.back() << std::endl;
+            return EXIT_FAILURE;
+        }
     }
 
-    {
-        Generator generator(prog.value());
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+    std::atomic<size_t> failed{0};
+    WorkPool pool(jobs.value_or(1));
+    pool.run(input_paths.size(), [&](const size_t index) {
+        TimeReport report(false);
+        Workspace batch_workspace;
+        if (!compile(input_paths[index].c_str(), stems[index], options, cache_ptr, report, batch_workspace)) {
+            std::cerr << "Failed to compile " << input_paths[index] << std::endl;
+            failed.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    if (cache.has_value()) {
+        cache->finish();
     }
 
-    system("nasm -f elf64 out.asm");
-    system("ld -o out out.o");
+    return failed.load() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    Workspace workspace;
+
+    // --serve stands alone, and --client forwards everything else on the line to the server.
+    if (args.size() == 1 && (args[0] == "--serve" || args[0].starts_with("--serve="))) {
+        CompileServer server([&](const std::vector<std::string> &request) {
+            return drive(request, workspace, [&](const std::function<int()> &program) { return server.run(program); });
+        });
+        if (args[0] == "--serve") {
+            return server.serve_stdio();
+        }
+        return server.serve_socket(args[0].substr(std::string_view("--serve=").size()));
+    }
+    for (auto it = args.begin(); it != args.end(); ++it) {
+        if (it->starts_with("--client=") && it->size() > std::string_view("--client=").size()) {
+            const std::string path = it->substr(std::string_view("--client=").size());
+            args.erase(it);
+            return run_client(path, args);
+        }
+    }
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return drive(args, workspace, [](const std::function<int()> &program) { return program(); });
+}
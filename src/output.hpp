@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <concepts>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+#include "errors.hpp"
+
+// Write-only file behind a fixed-size buffer. Output reaches the file descriptor as soon as the
+// buffer fills, so memory use does not depend on how much is written.
+class OutputFile {
+public:
+    explicit OutputFile(const char *path) : m_path(path) {
+        m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0) {
+            std::cerr << "Unable to open " << path << std::endl;
+            fail();
+        }
+    }
+
+    OutputFile(const OutputFile &other) = delete;
+
+    OutputFile operator=(const OutputFile &other) = delete;
+
+    // A write error while closing here is still reported, but cannot fail the compile; callers
+    // that need to know close() explicitly first.
+    ~OutputFile() {
+        try {
+            close();
+        } catch (const CompileError &) {
+        }
+    }
+
+    OutputFile &operator<<(const std::string_view text) {
+        if (text.size() > m_buffer.size() - m_size) {
+            flush();
+            if (text.size() > m_buffer.size()) {
+                write_all(text.data(), text.size());
+                return *this;
+            }
+        }
+        text.copy(m_buffer.data() + m_size, text.size());
+        m_size += text.size();
+        return *this;
+    }
+
+    OutputFile &operator<<(const char c) {
+        if (m_size == m_buffer.size()) {
+            flush();
+        }
+        m_buffer[m_size++] = c;
+        return *this;
+    }
+
+    template<std::integral T>
+    OutputFile &operator<<(const T value) {
+        if (m_buffer.size() - m_size < 24) {
+            flush();
+        }
+        const auto [ptr, ec] = std::to_chars(m_buffer.data() + m_size, m_buffer.data() + m_buffer.size(), value);
+        m_size = ptr - m_buffer.data();
+        return *this;
+    }
+
+    void flush() {
+        write_all(m_buffer.data(), m_size);
+        m_size = 0;
+    }
+
+    void close() {
+        if (m_fd < 0) {
+            return;
+        }
+        flush();
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+private:
+    void write_all(const char *data, size_t size) {
+        while (size > 0) {
+            const ssize_t count = write(m_fd, data, size);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                std::cerr << "Unable to write " << m_path << std::endl;
+                ::close(m_fd);
+                m_fd = -1;
+                m_size = 0;
+                fail();
+            }
+            data += count;
+            size -= count;
+        }
+    }
+
+    std::string m_path;
+    int m_fd = -1;
+    size_t m_size = 0;
+    std::array<char, 64 * 1024> m_buffer{};
+};
@@ -1,560 +1,573 @@
-#pragma once
-#include <variant>
-
-#include "arena.hpp"
-#include "tokenization.hpp"
-
-struct NodeTermIntLit {
-    Token int_lit;
-};
-
-struct NodeTermIdent {
-    Token ident;
-};
-
-struct NodeExpr;
-
-struct NodeTermParen {
-    NodeExpr *expr;
-};
-
-struct BinExprAdd {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprMulti {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprSub {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprDiv {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprGreater {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprLess {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprEqual {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprGreaterEqual {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprLessEqual {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct BinExprNotEqual {
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExpr {
-    std::variant<BinExprAdd *, BinExprMulti *, BinExprSub *, BinExprDiv *,
-        BinExprGreater *, BinExprLess *, BinExprEqual *, BinExprGreaterEqual *,
-        BinExprLessEqual *, BinExprNotEqual *> var;
-};
-
-struct NodeTerm {
-    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *> var;
-};
-
-struct NodeExpr {
-    std::variant<NodeTerm *, NodeBinExpr *> var;
-};
-
-struct NodeStmtExit {
-    NodeExpr *expr;
-};
-
-struct NodeStmtMay {
-    Token ident;
-    NodeExpr *expr{};
-};
-
-struct NodeStmt;
-
-struct NodeStmtScope {
-    std::vector<NodeStmt *> stmts;
-};
-
-struct NodeStmtIfPred;
-
-struct NodeStmtIfPredElif {
-    NodeExpr *expr{};
-    NodeStmtScope *scope{};
-    std::optional<NodeStmtIfPred *> pred;
-};
-
-struct NodeStmtIfPredElse {
-    NodeStmtScope *scope;
-};
-
-struct NodeStmtIfPred {
-    std::variant<NodeStmtIfPredElif *, NodeStmtIfPredElse *> var;
-};
-
-struct NodeStmtElse {
-    NodeExpr *expr;
-    NodeStmtScope *scope;
-};
-
-struct NodeStmtIf {
-    NodeExpr *expr{};
-    NodeStmtScope *scope{};
-    std::optional<NodeStmtIfPred *> pred;
-};
-
-struct NodeStmtAssign {
-    Token ident;
-    NodeExpr *expr{};
-};
-
-struct NodeStmtWhile {
-    NodeExpr *expr{};
-    NodeStmtScope *scope{};
-};
-
-struct NodeStmtFor {
-    NodeStmt *init{};
-    NodeExpr *cond{};
-    NodeStmt *iter{};
-    NodeStmtScope *scope{};
-};
-
-struct NodeStmt {
-    std::variant<NodeStmtExit *, NodeStmtMay *, NodeStmtScope *, NodeStmtIf *, NodeStmtAssign *, NodeStmtWhile *, NodeStmtFor *> var;
-};
-
-struct NodeProg {
-    std::vector<NodeStmt> stmts;
-};
-
-class Parser {
-public:
-    explicit Parser(std::vector<Token> tokens) : m_tokens(std::move(tokens)), m_allocator(1024 * 1024 * 4) {
-    }
-
-    void get_error(const std::string &msg) const {
-        std::cerr << "[Parsing Error] Expected " << msg << " on line " << peek(-1)->line << "\n";
-        exit(EXIT_FAILURE);
-    }
-
-    std::optional<NodeTerm *> parse_term() {
-        if (const auto int_lit = try_engulf(TokenType::int_lit)) {
-            auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
-            term_int_lit->int_lit = int_lit.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_int_lit;
-            return term;
-        }
-
-        if (const auto ident = try_engulf(TokenType::ident)) {
-            auto term_ident = m_allocator.alloc<NodeTermIdent>();
-            term_ident->ident = ident.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_ident;
-            return term;
-        }
-
-        if (const auto open_paren = try_engulf(TokenType::open_paren)) {
-            const auto expr = parse_expr();
-            if (!expr.has_value()) {
-                get_error("expression");
-            }
-
-            try_engulf(TokenType::close_paren, "`)`");
-            auto term_paren = m_allocator.alloc<NodeTermParen>();
-            term_paren->expr = expr.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_paren;
-            return term;
-        }
-
-        return {};
-    }
-
-    std::optional<NodeExpr *> parse_expr(const int min_prec = 0) {
-        std::optional<NodeTerm *> term_lhs = parse_term();
-        if (!term_lhs.has_value()) {
-            return {};
-        }
-
-        auto expr_lhs = m_allocator.alloc<NodeExpr>();
-        expr_lhs->var = term_lhs.value();
-
-        while (true) {
-            std::optional<Token> curr_token = peek();
-            std::optional<int> prec;
-
-            if (curr_token.has_value()) {
-                prec = bin_prec(curr_token->type);
-                if (!prec.has_value() || prec < min_prec) {
-                    break;
-                }
-            } else
-                break;
-
-            auto [type, line, value] = engulf();
-            const int next_min_prec = prec.value() + 1;
-            auto expr_rhs = parse_expr(next_min_prec);
-
-            if (!expr_rhs.has_value()) {
-                get_error("expression");
-            }
-
-            auto expr = m_allocator.alloc<NodeBinExpr>();
-            const auto expr_lhs_temp = m_allocator.alloc<NodeExpr>();
-
-            if (type == TokenType::plus) {
-                auto add = m_allocator.alloc<BinExprAdd>();
-                expr_lhs_temp->var = expr_lhs->var;
-                add->lhs = expr_lhs_temp;
-                add->rhs = expr_rhs.value();
-                expr->var = add;
-            } else if (type == TokenType::star) {
-                auto multi = m_allocator.alloc<BinExprMulti>();
-                expr_lhs_temp->var = expr_lhs->var;
-                multi->lhs = expr_lhs_temp;
-                multi->rhs = expr_rhs.value();
-                expr->var = multi;
-            } else if (type == TokenType::minus) {
-                auto sub = m_allocator.alloc<BinExprSub>();
-                expr_lhs_temp->var = expr_lhs->var;
-                sub->lhs = expr_lhs_temp;
-                sub->rhs = expr_rhs.value();
-                expr->var = sub;
-            } else if (type == TokenType::fslash) {
-                auto div = m_allocator.alloc<BinExprDiv>();
-                expr_lhs_temp->var = expr_lhs->var;
-                div->lhs = expr_lhs_temp;
-                div->rhs = expr_rhs.value();
-                expr->var = div;
-            } else if (type == TokenType::big) {
-                auto greater = m_allocator.alloc<BinExprGreater>();
-                expr_lhs_temp->var = expr_lhs->var;
-                greater->lhs = expr_lhs_temp;
-                greater->rhs = expr_rhs.value();
-                expr->var = greater;
-            } else if (type == TokenType::small) {
-                auto less = m_allocator.alloc<BinExprLess>();
-                expr_lhs_temp->var = expr_lhs->var;
-                less->lhs = expr_lhs_temp;
-                less->rhs = expr_rhs.value();
-                expr->var = less;
-            } else if (type == TokenType::iseq) {
-                auto eq = m_allocator.alloc<BinExprEqual>();
-                expr_lhs_temp->var = expr_lhs->var;
-                eq->lhs = expr_lhs_temp;
-                eq->rhs = expr_rhs.value();
-                expr->var = eq;
-            } else if (type == TokenType::big_eq) {
-                auto greater = m_allocator.alloc<BinExprGreaterEqual>();
-                expr_lhs_temp->var = expr_lhs->var;
-                greater->lhs = expr_lhs_temp;
-                greater->rhs = expr_rhs.value();
-                expr->var = greater;
-            } else if (type == TokenType::small_eq) {
-                auto less = m_allocator.alloc<BinExprLessEqual>();
-                expr_lhs_temp->var = expr_lhs->var;
-                less->lhs = expr_lhs_temp;
-                less->rhs = expr_rhs.value();
-                expr->var = less;
-            } else if (type == TokenType::no_eq) {
-                auto not_equal = m_allocator.alloc<BinExprNotEqual>();
-                expr_lhs_temp->var = expr_lhs->var;
-                not_equal->lhs = expr_lhs_temp;
-                not_equal->rhs = expr_rhs.value();
-                expr->var = not_equal;
-            }
-
-            expr_lhs->var = expr;
-        }
-
-        return expr_lhs;
-    }
-
-    std::optional<NodeStmtScope *> parse_scope() {
-        if (!try_engulf(TokenType::curly_open))
-            return {};
-
-        auto scope = m_allocator.alloc<NodeStmtScope>();
-        while (auto stmt = parse_stmt()) {
-            scope->stmts.push_back(stmt.value());
-        }
-
-        try_engulf(TokenType::curly_close, "'}'");
-        return scope;
-    }
-
-    std::optional<NodeStmtIfPred *> parse_if_pred() {
-        if (try_engulf(TokenType::elif)) {
-            try_engulf(TokenType::open_paren, "Expected `(`");
-            const auto elif = m_allocator.alloc<NodeStmtIfPredElif>();
-            if (const auto expr = parse_expr()) {
-                elif->expr = expr.value();
-            } else {
-                get_error("expression");
-            }
-
-            try_engulf(TokenType::close_paren, "`)`");
-            if (const auto scope = parse_scope()) {
-                elif->scope = scope.value();
-            } else {
-                get_error("Scope");
-            }
-
-            elif->pred = parse_if_pred();
-            auto pred = m_allocator.alloc<NodeStmtIfPred>();
-            pred->var = elif;
-            return pred;
-        }
-
-        if (try_engulf(TokenType::else_)) {
-            auto else_ = m_allocator.alloc<NodeStmtIfPredElse>();
-            if (const auto scope = parse_scope()) {
-                else_->scope = scope.value();
-            } else {
-                get_error("Scope");
-            }
-
-            const auto pred = m_allocator.alloc<NodeStmtIfPred>();
-            pred->var = else_;
-            return pred;
-        }
-
-        return {};
-    }
-
-    std::optional<NodeStmtAssign *> parse_assign() {
-        const auto assign = m_allocator.alloc<NodeStmtAssign>();
-        if (peek().has_value() && peek().value().type == TokenType::ident &&
-            peek(1).has_value() && peek(1).value().type == TokenType::equal) {
-            assign->ident = engulf();
-            engulf();
-
-            if (const auto expr = parse_expr()) {
-                assign->expr = expr.value();
-            } else {
-                get_error("expression");
-            }
-        }
-        return assign;
-    }
-
-    std::optional<NodeStmt *> parse_stmt() {
-        if (peek().has_value() && peek().value().type == TokenType::exit &&
-            peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
-            engulf();
-            engulf();
-
-            auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
-            if (const auto node_expr = parse_expr()) {
-                stmt_exit->expr = node_expr.value();
-            } else {
-                get_error("expression");
-            }
-
-            try_engulf(TokenType::close_paren, "')'");
-            try_engulf(TokenType::semi, "';'");
-
-
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_exit;
-            return stmt;
-        }
-
-        if (peek().has_value() && peek().value().type == TokenType::may &&
-            peek(1).has_value() && peek(1).value().type == TokenType::ident
-            && peek(2).has_value() && peek(2).value().type == TokenType::equal) {
-            engulf();
-            auto stmt_may = m_allocator.alloc<NodeStmtMay>();
-            stmt_may->ident = engulf();
-            engulf();
-
-            if (const auto expr = parse_expr()) {
-                stmt_may->expr = expr.value();
-            } else {
-                get_error("expression");
-            }
-
-            try_engulf(TokenType::semi, "';'");
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_may;
-            return stmt;
-        }
-
-        if (peek().has_value() && peek().value().type == TokenType::ident &&
-            peek(1).has_value() && peek(1).value().type == TokenType::equal) {
-            const auto assign = m_allocator.alloc<NodeStmtAssign>();
-            assign->ident = engulf();
-            engulf();
-
-            if (const auto expr = parse_expr()) {
-                assign->expr = expr.value();
-            } else {
-                get_error("expression");
-            }
-
-            try_engulf(TokenType::semi, "';'");
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = assign;
-            return stmt;
-        }
-
-        if (peek().has_value() && peek().value().type == TokenType::curly_open) {
-            if (auto scope = parse_scope()) {
-                auto stmt = m_allocator.alloc<NodeStmt>();
-                stmt->var = scope.value();
-                return stmt;
-            }
-            get_error("Scope");
-        }
-
-        if (auto if_ = try_engulf(TokenType::if_)) {
-            try_engulf(TokenType::open_paren, "'('");
-            auto stmt_if = m_allocator.alloc<NodeStmtIf>();
-
-            if (const auto expr = parse_expr()) {
-                stmt_if->expr = expr.value();
-            } else {
-                get_error("expression");
-            }
-
-            try_engulf(TokenType::close_paren, "')'");
-            if (const auto scope = parse_scope()) {
-                stmt_if->scope = scope.value();
-            } else {
-                get_error("Scope");
-            }
-
-            stmt_if->pred = parse_if_pred();
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_if;
-            return stmt;
-        }
-
-        if (try_engulf(TokenType::w_loop)) {
-            try_engulf(TokenType::open_paren, "'('");
-            auto stmt_while = m_allocator.alloc<NodeStmtWhile>();
-            if (const auto expr = parse_expr()) {
-                stmt_while->expr = expr.value();
-            } else {
-                get_error("Expression");
-            }
-
-            try_engulf(TokenType::semi, "';'");
-            try_engulf(TokenType::close_paren, "')'");
-            
-            if (const auto scope = parse_scope()) {
-                stmt_while->scope = scope.value();
-            }
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_while;
-            return stmt;
-        }
-
-        if (try_engulf(TokenType::f_loop)) {
-            try_engulf(TokenType::open_paren, "`(`");
-            auto stmt_for = m_allocator.alloc<NodeStmtFor>();
-
-            if(const auto init = parse_stmt()) {
-                stmt_for->init = init.value();
-            } else {
-                get_error("an initialization expression");
-            }
-
-            if(const auto cond = parse_expr()) {
-                stmt_for->cond = cond.value();
-            } else {
-                get_error("the conditional expression");
-            }
-
-            try_engulf(TokenType::semi, "';");
-
-            if(const auto iter = parse_stmt()) {
-                stmt_for->iter = iter.value();
-            } else {
-                get_error("the movement expression");
-            }
-
-            try_engulf(TokenType::close_paren, "`)`");
-
-            if(const auto scope = parse_scope()) {
-                stmt_for->scope = scope.value();
-            } else {
-                get_error("a body for for loop");
-            }
-
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_for;
-            return stmt;
-        }
-
-        return {};
-    }
-
-    std::optional<NodeProg> parse_prog() {
-        NodeProg prog;
-        while (peek().has_value()) {
-            if (auto stmt = parse_stmt()) {
-                prog.stmts.push_back(*stmt.value());
-            } else {
-                get_error("this Statement");
-            }
-        }
-
-        return prog;
-    }
-
-private:
-    [[nodiscard]] inline std::optional<Token> peek(const int offset = 0) const {
-        if (m_index + offset >= m_tokens.size()) {
-            return {};
-        }
-        return m_tokens.at(m_index + offset);
-    }
-
-    Token engulf() {
-        return m_tokens.at(m_index++);
-    }
-
-    Token try_engulf(const TokenType type, const std::string &err_msg) {
-        if (peek().has_value() && peek().value().type == type) {
-            return engulf();
-        }
-
-        get_error(err_msg);
-        return {};
-    }
-
-    std::optional<Token> try_engulf(const TokenType type) {
-        if (peek().has_value() && peek().value().type == type) {
-            return engulf();
-        }
-        return {};
-    }
-
-    const std::vector<Token> m_tokens;
-    size_t m_index = 0;
-    ArenaAllocator m_allocator;
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <variant>
+
+#include "arena.hpp"
+#include "errors.hpp"
+#include "tokenization.hpp"
+
+using ExprIndex = uint32_t;
+
+enum class ExprKind : uint8_t {
+    int_lit, ident, add, sub, mul, div, greater, less, equal, greater_eq, less_eq, not_equal
+};
+
+inline bool is_cmp(const ExprKind kind) {
+    return kind >= ExprKind::greater;
+}
+
+// Expressions as a struct-of-arrays pool addressed by 32-bit index. The parser appends children before
+// their parent, so the nodes of a subtree occupy [first(i), i]; parentheses leave no node behind.
+// A literal keeps its value in the two operand slots and an identifier its symbol. Folding only strands
+// literals and reassociated additions inside a range, so scanning one sees the identifiers and
+// divisions of the tree.
+class ExprPool {
+public:
+    ExprIndex add_lit(const int64_t value) {
+        const auto index = static_cast<ExprIndex>(m_kinds.size());
+        push(ExprKind::int_lit, index, static_cast<uint32_t>(value), static_cast<uint32_t>(static_cast<uint64_t>(value) >> 32));
+        return index;
+    }
+
+    ExprIndex add_ident(const Token &ident) {
+        const auto index = static_cast<ExprIndex>(m_kinds.size());
+        push(ExprKind::ident, index, ident.symbol, 0);
+        if (ident.symbol >= m_names.size()) {
+            m_names.resize(ident.symbol + 1);
+        }
+        m_names[ident.symbol] = ident.value;
+        return index;
+    }
+
+    ExprIndex add_bin(const ExprKind kind, const ExprIndex lhs, const ExprIndex rhs) {
+        const auto index = static_cast<ExprIndex>(m_kinds.size());
+        push(kind, m_first[lhs], lhs, rhs);
+        return index;
+    }
+
+    // Appends a copy of the subtree at i, stranded nodes and all, and returns the copy's root. Reads of
+    // symbol, when one is given, become literals holding value.
+    ExprIndex clone(const ExprIndex i, const std::optional<Symbol> symbol = {}, const int64_t value = 0) {
+        const ExprIndex first = m_first[i];
+        const auto base = static_cast<ExprIndex>(m_kinds.size());
+        for (ExprIndex j = first; j <= i; j++) {
+            const ExprKind kind = m_kinds[j];
+            if (kind == ExprKind::ident && symbol.has_value() && m_lhs[j] == symbol.value()) {
+                add_lit(value);
+            } else if (kind == ExprKind::int_lit || kind == ExprKind::ident) {
+                push(kind, static_cast<ExprIndex>(m_kinds.size()), m_lhs[j], m_rhs[j]);
+            } else {
+                push(kind, m_first[j] - first + base, m_lhs[j] - first + base, m_rhs[j] - first + base);
+            }
+        }
+        return i - first + base;
+    }
+
+    // Turns node i into a literal in place; its former children drop out of its range.
+    void set_lit(const ExprIndex i, const int64_t value) {
+        m_kinds[i] = ExprKind::int_lit;
+        m_first[i] = i;
+        m_lhs[i] = static_cast<uint32_t>(value);
+        m_rhs[i] = static_cast<uint32_t>(static_cast<uint64_t>(value) >> 32);
+    }
+
+    // Points a binary node at new operands from within its own range.
+    void set_operands(const ExprIndex i, const ExprIndex lhs, const ExprIndex rhs) {
+        m_lhs[i] = lhs;
+        m_rhs[i] = rhs;
+    }
+
+    [[nodiscard]] ExprKind kind(const ExprIndex i) const {
+        return m_kinds[i];
+    }
+
+    [[nodiscard]] ExprIndex first(const ExprIndex i) const {
+        return m_first[i];
+    }
+
+    [[nodiscard]] ExprIndex lhs(const ExprIndex i) const {
+        return m_lhs[i];
+    }
+
+    [[nodiscard]] ExprIndex rhs(const ExprIndex i) const {
+        return m_rhs[i];
+    }
+
+    [[nodiscard]] int64_t value(const ExprIndex i) const {
+        return static_cast<int64_t>(static_cast<uint64_t>(m_rhs[i]) << 32 | m_lhs[i]);
+    }
+
+    [[nodiscard]] std::optional<int64_t> lit_value(const ExprIndex i) const {
+        if (m_kinds[i] != ExprKind::int_lit) {
+            return {};
+        }
+        return value(i);
+    }
+
+    // The identifier node i reads. Only the symbol and its name are kept, not the line.
+    [[nodiscard]] Token ident(const ExprIndex i) const {
+        return {.type = TokenType::ident, .line = 0, .value = m_names[m_lhs[i]], .symbol = m_lhs[i]};
+    }
+
+    [[nodiscard]] size_t size() const {
+        return m_kinds.size();
+    }
+
+    [[nodiscard]] size_t bytes_used() const {
+        return m_kinds.size() * (sizeof(ExprKind) + 3 * sizeof(uint32_t)) + m_names.size() * sizeof(std::string_view);
+    }
+
+private:
+    void push(const ExprKind kind, const ExprIndex first, const uint32_t lhs, const uint32_t rhs) {
+        if (m_kinds.size() == std::numeric_limits<ExprIndex>::max()) {
+            std::cerr << "[Parsing Error] Too many expression nodes" << std::endl;
+            fail();
+        }
+        m_kinds.push_back(kind);
+        m_first.push_back(first);
+        m_lhs.push_back(lhs);
+        m_rhs.push_back(rhs);
+    }
+
+    std::vector<ExprKind> m_kinds{};
+    std::vector<ExprIndex> m_first{};
+    std::vector<uint32_t> m_lhs{};
+    std::vector<uint32_t> m_rhs{};
+    std::vector<std::string_view> m_names{};
+};
+
+struct NodeStmtExit {
+    ExprIndex expr;
+};
+
+struct NodeStmtMay {
+    Token ident;
+    ExprIndex expr{};
+};
+
+struct NodeStmt;
+
+struct NodeStmtScope {
+    std::vector<NodeStmt *> stmts;
+};
+
+struct NodeStmtIfPred;
+
+struct NodeStmtIfPredElif {
+    ExprIndex expr{};
+    NodeStmtScope *scope{};
+    std::optional<NodeStmtIfPred *> pred;
+};
+
+struct NodeStmtIfPredElse {
+    NodeStmtScope *scope;
+};
+
+struct NodeStmtIfPred {
+    std::variant<NodeStmtIfPredElif *, NodeStmtIfPredElse *> var;
+};
+
+struct NodeStmtElse {
+    ExprIndex expr;
+    NodeStmtScope *scope;
+};
+
+struct NodeStmtIf {
+    ExprIndex expr{};
+    NodeStmtScope *scope{};
+    std::optional<NodeStmtIfPred *> pred;
+};
+
+struct NodeStmtAssign {
+    Token ident;
+    ExprIndex expr{};
+};
+
+struct NodeStmtWhile {
+    ExprIndex expr{};
+    NodeStmtScope *scope{};
+};
+
+struct NodeStmtFor {
+    NodeStmt *init{};
+    ExprIndex cond{};
+    NodeStmt *iter{};
+    NodeStmtScope *scope{};
+};
+
+struct NodeStmt {
+    std::variant<NodeStmtExit *, NodeStmtMay *, NodeStmtScope *, NodeStmtIf *, NodeStmtAssign *, NodeStmtWhile *, NodeStmtFor *> var;
+};
+
+struct NodeProg {
+    std::vector<NodeStmt> stmts;
+    ExprPool exprs;
+};
+
+class Parser {
+public:
+    // AST nodes are allocated from allocator, which has to outlive the NodeProg.
+    Parser(std::vector<Token> tokens, ArenaAllocator &allocator) : m_tokens(std::move(tokens)), m_allocator(allocator) {
+    }
+
+    void get_error(const std::string &msg) const {
+        std::cerr << "[Parsing Error] Expected " << msg << " on line " << peek(-1)->line << "\n";
+        fail();
+    }
+
+    std::optional<ExprIndex> parse_term() {
+        if (const auto int_lit = try_engulf(TokenType::int_lit)) {
+            return m_exprs.add_lit(int_lit.value().number);
+        }
+
+        if (const auto ident = try_engulf(TokenType::ident)) {
+            return m_exprs.add_ident(ident.value());
+        }
+
+        if (const auto open_paren = try_engulf(TokenType::open_paren)) {
+            const auto expr = parse_expr();
+            if (!expr.has_value()) {
+                get_error("expression");
+            }
+
+            try_engulf(TokenType::close_paren, "`)`");
+            return expr.value();
+        }
+
+        return {};
+    }
+
+    std::optional<ExprIndex> parse_expr(const int min_prec = 0) {
+        std::optional<ExprIndex> expr_lhs = parse_term();
+        if (!expr_lhs.has_value()) {
+            return {};
+        }
+
+        while (true) {
+            std::optional<Token> curr_token = peek();
+            std::optional<int> prec;
+
+            if (curr_token.has_value()) {
+                prec = bin_prec(curr_token->type);
+                if (!prec.has_value() || prec < min_prec) {
+                    break;
+                }
+            } else
+                break;
+
+            const ExprKind kind = bin_kind(engulf().type);
+            const int next_min_prec = prec.value() + 1;
+            auto expr_rhs = parse_expr(next_min_prec);
+
+            if (!expr_rhs.has_value()) {
+                get_error("expression");
+            }
+
+            expr_lhs = m_exprs.add_bin(kind, expr_lhs.value(), expr_rhs.value());
+        }
+
+        return expr_lhs;
+    }
+
+    std::optional<NodeStmtScope *> parse_scope() {
+        if (!try_engulf(TokenType::curly_open))
+            return {};
+
+        auto scope = m_allocator.alloc<NodeStmtScope>();
+        while (auto stmt = parse_stmt()) {
+            scope->stmts.push_back(stmt.value());
+        }
+
+        try_engulf(TokenType::curly_close, "'}'");
+        return scope;
+    }
+
+    std::optional<NodeStmtIfPred *> parse_if_pred() {
+        if (try_engulf(TokenType::elif)) {
+            try_engulf(TokenType::open_paren, "Expected `(`");
+            const auto elif = m_allocator.alloc<NodeStmtIfPredElif>();
+            if (const auto expr = parse_expr()) {
+                elif->expr = expr.value();
+            } else {
+                get_error("expression");
+            }
+
+            try_engulf(TokenType::close_paren, "`)`");
+            if (const auto scope = parse_scope()) {
+                elif->scope = scope.value();
+            } else {
+                get_error("Scope");
+            }
+
+            elif->pred = parse_if_pred();
+            auto pred = m_allocator.alloc<NodeStmtIfPred>();
+            pred->var = elif;
+            return pred;
+        }
+
+        if (try_engulf(TokenType::else_)) {
+            auto else_ = m_allocator.alloc<NodeStmtIfPredElse>();
+            if (const auto scope = parse_scope()) {
+                else_->scope = scope.value();
+            } else {
+                get_error("Scope");
+            }
+
+            const auto pred = m_allocator.alloc<NodeStmtIfPred>();
+            pred->var = else_;
+            return pred;
+        }
+
+        return {};
+    }
+
+    std::optional<NodeStmtAssign *> parse_assign() {
+        const auto assign = m_allocator.alloc<NodeStmtAssign>();
+        if (peek().has_value() && peek().value().type == TokenType::ident &&
+            peek(1).has_value() && peek(1).value().type == TokenType::equal) {
+            assign->ident = engulf();
+            engulf();
+
+            if (const auto expr = parse_expr()) {
+                assign->expr = expr.value();
+            } else {
+                get_error("expression");
+            }
+        }
+        return assign;
+    }
+
+    std::optional<NodeStmt *> parse_stmt() {
+        if (peek().has_value() && peek().value().type == TokenType::exit &&
+            peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
+            engulf();
+            engulf();
+
+            auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
+            if (const auto node_expr = parse_expr()) {
+                stmt_exit->expr = node_expr.value();
+            } else {
+                get_error("expression");
+            }
+
+            try_engulf(TokenType::close_paren, "')'");
+            try_engulf(TokenType::semi, "';'");
+
+
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_exit;
+            return stmt;
+        }
+
+        if (peek().has_value() && peek().value().type == TokenType::may &&
+            peek(1).has_value() && peek(1).value().type == TokenType::ident
+            && peek(2).has_value() && peek(2).value().type == TokenType::equal) {
+            engulf();
+            auto stmt_may = m_allocator.alloc<NodeStmtMay>();
+            stmt_may->ident = engulf();
+            engulf();
+
+            if (const auto expr = parse_expr()) {
+                stmt_may->expr = expr.value();
+            } else {
+                get_error("expression");
+            }
+
+            try_engulf(TokenType::semi, "';'");
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_may;
+            return stmt;
+        }
+
+        if (peek().has_value() && peek().value().type == TokenType::ident &&
+            peek(1).has_value() && peek(1).value().type == TokenType::equal) {
+            const auto assign = m_allocator.alloc<NodeStmtAssign>();
+            assign->ident = engulf();
+            engulf();
+
+            if (const auto expr = parse_expr()) {
+                assign->expr = expr.value();
+            } else {
+                get_error("expression");
+            }
+
+            try_engulf(TokenType::semi, "';'");
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = assign;
+            return stmt;
+        }
+
+        if (peek().has_value() && peek().value().type == TokenType::curly_open) {
+            if (auto scope = parse_scope()) {
+                auto stmt = m_allocator.alloc<NodeStmt>();
+                stmt->var = scope.value();
+                return stmt;
+            }
+            get_error("Scope");
+        }
+
+        if (auto if_ = try_engulf(TokenType::if_)) {
+            try_engulf(TokenType::open_paren, "'('");
+            auto stmt_if = m_allocator.alloc<NodeStmtIf>();
+
+            if (const auto expr = parse_expr()) {
+                stmt_if->expr = expr.value();
+            } else {
+                get_error("expression");
+            }
+
+            try_engulf(TokenType::close_paren, "')'");
+            if (const auto scope = parse_scope()) {
+                stmt_if->scope = scope.value();
+            } else {
+                get_error("Scope");
+            }
+
+            stmt_if->pred = parse_if_pred();
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_if;
+            return stmt;
+        }
+
+        if (try_engulf(TokenType::w_loop)) {
+            try_engulf(TokenType::open_paren, "'('");
+            auto stmt_while = m_allocator.alloc<NodeStmtWhile>();
+            if (const auto expr = parse_expr()) {
+                stmt_while->expr = expr.value();
+            } else {
+                get_error("Expression");
+            }
+
+            try_engulf(TokenType::semi, "';'");
+            try_engulf(TokenType::close_paren, "')'");
+            
+            if (const auto scope = parse_scope()) {
+                stmt_while->scope = scope.value();
+            }
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_while;
+            return stmt;
+        }
+
+        if (try_engulf(TokenType::f_loop)) {
+            try_engulf(TokenType::open_paren, "`(`");
+            auto stmt_for = m_allocator.alloc<NodeStmtFor>();
+
+            if(const auto init = parse_stmt()) {
+                stmt_for->init = init.value();
+            } else {
+                get_error("an initialization expression");
+            }
+
+            if(const auto cond = parse_expr()) {
+                stmt_for->cond = cond.value();
+            } else {
+                get_error("the conditional expression");
+            }
+
+            try_engulf(TokenType::semi, "';");
+
+            if(const auto iter = parse_stmt()) {
+                stmt_for->iter = iter.value();
+            } else {
+                get_error("the movement expression");
+            }
+
+            try_engulf(TokenType::close_paren, "`)`");
+
+            if(const auto scope = parse_scope()) {
+                stmt_for->scope = scope.value();
+            } else {
+                get_error("a body for for loop");
+            }
+
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_for;
+            return stmt;
+        }
+
+        return {};
+    }
+
+    std::optional<NodeProg> parse_prog() {
+        NodeProg prog;
+        while (peek().has_value()) {
+            if (auto stmt = parse_stmt()) {
+                prog.stmts.push_back(*stmt.value());
+            } else {
+                get_error("this Statement");
+            }
+        }
+
+        prog.exprs = std::move(m_exprs);
+        return prog;
+    }
+
+    ArenaAllocator &allocator() {
+        return m_allocator;
+    }
+
+    // Hands the token buffer back once parsing is done, so that it can be refilled.
+    std::vector<Token> take_tokens() {
+        return std::move(m_tokens);
+    }
+
+private:
+    static ExprKind bin_kind(const TokenType type) {
+        switch (type) {
+            case TokenType::plus:
+                return ExprKind::add;
+            case TokenType::minus:
+                return ExprKind::sub;
+            case TokenType::star:
+                return ExprKind::mul;
+            case TokenType::fslash:
+                return ExprKind::div;
+            case TokenType::big:
+                return ExprKind::greater;
+            case TokenType::small:
+                return ExprKind::less;
+            case TokenType::iseq:
+                return ExprKind::equal;
+            case TokenType::big_eq:
+                return ExprKind::greater_eq;
+            case TokenType::small_eq:
+                return ExprKind::less_eq;
+            default:
+                return ExprKind::not_equal;
+        }
+    }
+
+    [[nodiscard]] inline std::optional<Token> peek(const int offset = 0) const {
+        if (m_index + offset >= m_tokens.size()) {
+            return {};
+        }
+        return m_tokens.at(m_index + offset);
+    }
+
+    Token engulf() {
+        return m_tokens.at(m_index++);
+    }
+
+    Token try_engulf(const TokenType type, const std::string &err_msg) {
+        if (peek().has_value() && peek().value().type == type) {
+            return engulf();
+        }
+
+        get_error(err_msg);
+        return {};
+    }
+
+    std::optional<Token> try_engulf(const TokenType type) {
+        if (peek().has_value() && peek().value().type == type) {
+            return engulf();
+        }
+        return {};
+    }
+
+    std::vector<Token> m_tokens;
+    size_t m_index = 0;
+    ArenaAllocator &m_allocator;
+    ExprPool m_exprs;
 };
\ No newline at end of file
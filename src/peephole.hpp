@@ -0,0 +1,564 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "assembly.hpp"
+
+// Sits between a backend and the real sink and cleans up what passes through. Instructions are held
+// back until every rule can see the window it needs and every forward jump among them has reached its
+// label, up to a fixed limit, so memory use does not grow with the program. Rules are looked up in a
+// table by the opcode that starts their window and tried at each position in turn. After a rewrite the scan backs up far
+// enough to retry every window that overlaps it, so windows are rewritten to a fixpoint; every rule
+// removes at least one instruction, so this terminates. Rules that drop a register write ask a bounded
+// forward walk whether anything can still read the old value. The walk follows jumps and treats the
+// exit syscall as the end of every path; if it leaves the buffer or gives up, the value counts as live.
+class PeepholeOptimizer final : public AsmSink {
+public:
+    explicit PeepholeOptimizer(AsmSink &out) : m_out(out) {
+        // The prefix is only dropped once this many have retired, so the buffer tops out near twice that.
+        m_slots.reserve(2 * s_max_buffered);
+    }
+
+    PeepholeOptimizer(const PeepholeOptimizer &other) = delete;
+
+    PeepholeOptimizer operator=(const PeepholeOptimizer &other) = delete;
+
+    void emit(const Instr &instr) override {
+        if (instr.op == Op::label || instr.op == Op::jmp || instr.op == Op::jcc) {
+            const auto label = static_cast<size_t>(instr.dst.value);
+            if (label >= m_labels.size()) {
+                m_labels.resize(label + 1);
+            }
+            LabelState &state = m_labels[label];
+            if (instr.op == Op::label) {
+                state.pos = m_end;
+                m_forward_jumps -= state.waiting;
+                state.waiting = 0;
+            } else if (state.pos == SIZE_MAX) {
+                state.waiting++;
+                m_forward_jumps++;
+            }
+        }
+        m_slots.push_back({instr, false});
+        m_end++;
+        advance();
+    }
+
+    // Rewrites what is still buffered and passes it on. Must be called once the backend is done.
+    void finish() {
+        m_finished = true;
+        advance();
+        while (m_begin < m_end) {
+            retire();
+        }
+    }
+
+    // Instructions the rules removed.
+    [[nodiscard]] size_t removed() const {
+        return m_removed_count;
+    }
+
+private:
+    struct Rule {
+        Op first;
+        bool (PeepholeOptimizer::*apply)(size_t pos);
+    };
+
+    struct Slot {
+        Instr instr;
+        bool removed;
+    };
+
+    struct LabelState {
+        // Where the label was emitted, or SIZE_MAX until it is.
+        size_t pos = SIZE_MAX;
+        // Jumps emitted before it.
+        size_t waiting = 0;
+    };
+
+    // The longest window any rule matches, how far ahead of the scan instructions are buffered, how many
+    // are kept behind it for backing up, and how many may wait for a forward jump's label.
+    static constexpr size_t s_window = 3;
+    static constexpr size_t s_lookahead = 64;
+    static constexpr size_t s_keep = 32;
+    static constexpr size_t s_max_buffered = 16384;
+
+    // Registers are bits 0-15; the flags and memory get one bit each.
+    using Mask = uint32_t;
+    static constexpr Mask flags = 1u << 16;
+    static constexpr Mask memory = 1u << 17;
+
+    struct Effects {
+        Mask reads = 0;
+        Mask writes = 0;
+    };
+
+    static Mask bit(const Reg reg) {
+        return 1u << static_cast<int>(reg);
+    }
+
+    // What reading operand touches: the register itself, or the memory and the registers of its address.
+    static Mask operand_reads(const Operand &operand) {
+        switch (operand.kind) {
+            case Operand::Kind::reg:
+                return bit(operand.reg);
+            case Operand::Kind::mem:
+                return memory | bit(operand.reg) | (operand.scale != 0 ? bit(operand.index) : 0);
+            default:
+                return 0;
+        }
+    }
+
+    // What writing operand reads (an address) and writes.
+    static Effects operand_writes(const Operand &operand) {
+        if (operand.kind == Operand::Kind::reg) {
+            return {0, bit(operand.reg)};
+        }
+        if (operand.kind == Operand::Kind::mem) {
+            return {operand_reads(operand) & ~memory, memory};
+        }
+        return {};
+    }
+
+    static Effects effects(const Instr &instr) {
+        const Mask rsp = bit(Reg::rsp);
+        const Mask rax = bit(Reg::rax);
+        const Mask rdx = bit(Reg::rdx);
+        const auto read_modify_write = [&](const Mask extra_writes) {
+            const Effects dst = operand_writes(instr.dst);
+            return Effects{dst.reads | operand_reads(instr.dst) | operand_reads(instr.src), dst.writes | extra_writes};
+        };
+
+        switch (instr.op) {
+            case Op::mov:
+            case Op::movzx: {
+                const Effects dst = operand_writes(instr.dst);
+                return {dst.reads | operand_reads(instr.src), dst.writes};
+            }
+            case Op::lea: {
+                const Effects dst = operand_writes(instr.dst);
+                return {dst.reads | (operand_reads(instr.src) & ~memory), dst.writes};
+            }
+            case Op::push:
+                return {operand_reads(instr.dst) | rsp, rsp | memory};
+            case Op::pop:
+                return {rsp | memory, operand_writes(instr.dst).writes | rsp};
+            case Op::add:
+            case Op::sub:
+            case Op::dec:
+            case Op::neg:
+            case Op::shl:
+            case Op::shr:
+            case Op::sar:
+                return read_modify_write(flags);
+            case Op::imul:
+                if (instr.src.kind == Operand::Kind::none) {
+                    return {operand_reads(instr.dst) | rax, rax | rdx | flags};
+                }
+                return read_modify_write(flags);
+            case Op::cmp:
+            case Op::test:
+                return {operand_reads(instr.dst) | operand_reads(instr.src), flags};
+            case Op::idiv:
+                return {operand_reads(instr.dst) | rax | rdx, rax | rdx | flags};
+            case Op::cqo:
+                return {rax, rdx};
+            case Op::jcc:
+                return {flags, 0};
+            case Op::setcc:
+                // Only the low byte changes, so the rest of the register is read through.
+                return {operand_reads(instr.dst) | flags, operand_writes(instr.dst).writes};
+            case Op::syscall:
+                return {rax | bit(Reg::rdi) | bit(Reg::rsi) | rdx | bit(Reg::r10) | bit(Reg::r8) | bit(Reg::r9) | memory,
+                        rax | bit(Reg::rcx) | bit(Reg::r11)};
+            default:
+                return {};
+        }
+    }
+
+    static bool is_control(const Instr &instr) {
+        return instr.op == Op::label || instr.op == Op::jmp || instr.op == Op::jcc || instr.op == Op::ud2;
+    }
+
+    static bool fits_i32(const int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    Instr &code(const size_t pos) {
+        return m_slots[pos - m_base].instr;
+    }
+
+    [[nodiscard]] const Instr &code(const size_t pos) const {
+        return m_slots[pos - m_base].instr;
+    }
+
+    [[nodiscard]] bool removed(const size_t pos) const {
+        return m_slots[pos - m_base].removed;
+    }
+
+    void remove(const size_t pos) {
+        m_slots[pos - m_base].removed = true;
+        m_removed_count++;
+    }
+
+    // Scans forward while the rules can see far enough ahead, then passes on what is behind the scan.
+    void advance() {
+        if (!m_finished && m_forward_jumps > 0 && m_end - m_begin < s_max_buffered) {
+            return;
+        }
+        while (m_cursor < m_end && (m_finished || m_cursor + s_lookahead < m_end)) {
+            if (!rewrite(m_cursor)) {
+                m_cursor = next(m_cursor);
+                continue;
+            }
+            for (size_t back = 0; back < s_window && m_cursor > m_begin; back++) {
+                m_cursor = prev(m_cursor);
+            }
+            if (removed(m_cursor)) {
+                m_cursor = next(m_cursor);
+            }
+        }
+        while (m_begin + s_keep < m_cursor) {
+            retire();
+        }
+    }
+
+    void retire() {
+        if (!removed(m_begin)) {
+            m_out.emit(code(m_begin));
+        }
+        m_begin++;
+        if (m_begin - m_base >= s_max_buffered) {
+            m_slots.erase(m_slots.begin(), m_slots.begin() + static_cast<ptrdiff_t>(m_begin - m_base));
+            m_base = m_begin;
+        }
+    }
+
+    bool rewrite(const size_t pos) {
+        for (const Rule &rule: s_rules) {
+            if (rule.first == code(pos).op && (this->*rule.apply)(pos)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The closest instruction before pos that has not been removed, stopping at the oldest buffered one.
+    [[nodiscard]] size_t prev(size_t pos) const {
+        do {
+            pos--;
+        } while (pos > m_begin && removed(pos));
+        return pos;
+    }
+
+    // The next instruction after pos that has not been removed, or m_end.
+    [[nodiscard]] size_t next(size_t pos) const {
+        do {
+            pos++;
+        } while (pos < m_end && removed(pos));
+        return pos;
+    }
+
+    // Whether the syscall at pos is exit: rax was last set to 60 on the straight-line path into it.
+    [[nodiscard]] bool is_exit(const size_t pos) const {
+        for (size_t i = pos; i-- > m_begin;) {
+            if (removed(i)) {
+                continue;
+            }
+            const Instr &instr = code(i);
+            if (is_control(instr)) {
+                return false;
+            }
+            if (effects(instr).writes & bit(Reg::rax)) {
+                return instr.op == Op::mov && instr.dst.kind == Operand::Kind::reg && instr.src.kind == Operand::Kind::imm &&
+                       instr.src.value == 60;
+            }
+        }
+        return false;
+    }
+
+    // Whether what resource holds after pos may still be read. Paths are followed through jumps for a
+    // bounded number of steps; one that runs out of steps or out of the buffer counts as reading it.
+    // Running off the end of the program reads nothing.
+    [[nodiscard]] bool live_after(const size_t pos, const Mask resource) const {
+        std::array<size_t, 8> pending{};
+        size_t pending_count = 0;
+        pending[pending_count++] = next(pos);
+        size_t budget = 48;
+
+        while (pending_count > 0) {
+            size_t at = pending[--pending_count];
+            while (true) {
+                if (at >= m_end) {
+                    if (!m_finished) {
+                        return true;
+                    }
+                    break;
+                }
+                if (budget-- == 0) {
+                    return true;
+                }
+                const Instr &instr = code(at);
+                if (instr.op == Op::syscall && is_exit(at)) {
+                    if (resource & (bit(Reg::rax) | bit(Reg::rdi))) {
+                        return true;
+                    }
+                    break;
+                }
+                const Effects effect = effects(instr);
+                if (effect.reads & resource) {
+                    return true;
+                }
+                if (effect.writes & resource || instr.op == Op::ud2) {
+                    break;
+                }
+                if (instr.op == Op::jmp || instr.op == Op::jcc) {
+                    const auto label = static_cast<size_t>(instr.dst.value);
+                    const size_t target = m_labels[label].pos;
+                    if (target == SIZE_MAX || target < m_begin) {
+                        return true;
+                    }
+                    if (instr.op == Op::jmp) {
+                        at = target;
+                        continue;
+                    }
+                    if (pending_count == pending.size()) {
+                        return true;
+                    }
+                    pending[pending_count++] = target;
+                }
+                at = next(at);
+            }
+        }
+        return false;
+    }
+
+    // mov r, r
+    bool remove_self_move(const size_t pos) {
+        const Instr &instr = code(pos);
+        if (instr.op != Op::mov || instr.dst.kind != Operand::Kind::reg || instr.src.kind != Operand::Kind::reg ||
+            instr.dst.reg != instr.src.reg) {
+            return false;
+        }
+        remove(pos);
+        return true;
+    }
+
+    // add/sub rsp, imm pairs merge, and an adjustment by 0 goes away, as long as nothing reads its flags.
+    bool fold_stack_adjust(const size_t pos) {
+        const auto adjustment = [&](const size_t at) -> std::optional<int64_t> {
+            if (at >= m_end) {
+                return {};
+            }
+            const Instr &instr = code(at);
+            if ((instr.op != Op::add && instr.op != Op::sub) || instr.dst.kind != Operand::Kind::reg ||
+                instr.dst.reg != Reg::rsp || instr.src.kind != Operand::Kind::imm) {
+                return {};
+            }
+            return instr.op == Op::add ? instr.src.value : -instr.src.value;
+        };
+
+        const std::optional<int64_t> first = adjustment(pos);
+        if (!first.has_value()) {
+            return false;
+        }
+        const size_t second_pos = next(pos);
+        const std::optional<int64_t> second = adjustment(second_pos);
+        const size_t last = second.has_value() ? second_pos : pos;
+        const int64_t total = first.value() + second.value_or(0);
+        if ((total != 0 && !second.has_value()) || !fits_i32(total) || live_after(last, flags)) {
+            return false;
+        }
+
+        remove(pos);
+        if (total == 0 && second.has_value()) {
+            remove(second_pos);
+        } else if (second.has_value()) {
+            code(second_pos).op = total > 0 ? Op::add : Op::sub;
+            code(second_pos).src = imm_op(total > 0 ? total : -total);
+        }
+        return true;
+    }
+
+    // push a; pop b becomes mov b, a.
+    bool fold_push_pop(const size_t pos) {
+        const size_t pop_pos = next(pos);
+        if (code(pos).op != Op::push || pop_pos >= m_end || code(pop_pos).op != Op::pop) {
+            return false;
+        }
+        code(pop_pos) = {.op = Op::mov, .dst = code(pop_pos).dst, .src = code(pos).dst};
+        remove(pos);
+        return true;
+    }
+
+    // A jmp to a label that follows it, with only labels in between.
+    bool remove_jump_to_next(const size_t pos) {
+        if (code(pos).op != Op::jmp) {
+            return false;
+        }
+        for (size_t at = next(pos); at < m_end && code(at).op == Op::label; at = next(at)) {
+            if (code(at).dst.value == code(pos).dst.value) {
+                remove(pos);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // jcc a; jmp b; a: becomes jncc b; a:
+    bool invert_branch_over_jump(const size_t pos) {
+        const size_t jmp_pos = next(pos);
+        const size_t label_pos = next(jmp_pos);
+        if (code(pos).op != Op::jcc || label_pos >= m_end || code(jmp_pos).op != Op::jmp ||
+            code(label_pos).op != Op::label || code(label_pos).dst.value != code(pos).dst.value) {
+            return false;
+        }
+        code(pos).cond = invert(code(pos).cond);
+        code(pos).dst = code(jmp_pos).dst;
+        remove(jmp_pos);
+        return true;
+    }
+
+    // mov a, b; mov b, a drops the second move, which copies back what is already there.
+    bool remove_move_back(const size_t pos) {
+        const size_t back_pos = next(pos);
+        if (back_pos >= m_end) {
+            return false;
+        }
+        const Instr &first = code(pos);
+        const Instr &second = code(back_pos);
+        if (first.op != Op::mov || second.op != Op::mov || first.dst.kind != Operand::Kind::reg ||
+            first.src.kind != Operand::Kind::reg || second.dst.kind != Operand::Kind::reg ||
+            second.src.kind != Operand::Kind::reg || first.dst.reg != second.src.reg || first.src.reg != second.dst.reg) {
+            return false;
+        }
+        remove(back_pos);
+        return true;
+    }
+
+    // A register write nothing reads.
+    bool remove_dead_move(const size_t pos) {
+        const Instr &instr = code(pos);
+        if ((instr.op != Op::mov && instr.op != Op::lea && instr.op != Op::movzx) ||
+            instr.dst.kind != Operand::Kind::reg || instr.dst.reg == Reg::rsp || live_after(pos, bit(instr.dst.reg))) {
+            return false;
+        }
+        remove(pos);
+        return true;
+    }
+
+    // mov t, s followed closely by the only read of t: the reader takes s directly and the move goes.
+    bool forward_copy(const size_t pos) {
+        const Instr &copy = code(pos);
+        if (copy.op != Op::mov || copy.dst.kind != Operand::Kind::reg || copy.dst.reg == Reg::rsp ||
+            (copy.src.kind != Operand::Kind::reg && copy.src.kind != Operand::Kind::imm)) {
+            return false;
+        }
+        const Mask temp = bit(copy.dst.reg);
+        const Mask source = operand_reads(copy.src);
+
+        size_t at = next(pos);
+        for (int distance = 0; distance < 4 && at < m_end; distance++, at = next(at)) {
+            const Instr &instr = code(at);
+            if (is_control(instr)) {
+                return false;
+            }
+            const Effects effect = effects(instr);
+            if (effect.reads & temp) {
+                break;
+            }
+            if (effect.writes & (temp | source)) {
+                return false;
+            }
+        }
+        if (at >= m_end || !(effects(code(at)).reads & temp)) {
+            return false;
+        }
+
+        std::optional<Instr> rewritten = substitute(code(at), copy.dst.reg, copy.src);
+        if (!rewritten.has_value() || (effects(rewritten.value()).reads & temp) || live_after(at, temp)) {
+            return false;
+        }
+        code(at) = rewritten.value();
+        remove(pos);
+        return true;
+    }
+
+    // instr with its read of reg replaced by value, when an encodable form exists.
+    static std::optional<Instr> substitute(Instr instr, const Reg reg, const Operand &value) {
+        const bool is_reg = value.kind == Operand::Kind::reg;
+        const bool reads_src = instr.src.kind == Operand::Kind::reg && instr.src.reg == reg;
+        const bool reads_dst = instr.dst.kind == Operand::Kind::reg && instr.dst.reg == reg;
+        switch (instr.op) {
+            case Op::mov:
+                if (reads_src && (is_reg || instr.dst.kind == Operand::Kind::reg || fits_i32(value.value))) {
+                    instr.src = value;
+                    return instr;
+                }
+                return {};
+            case Op::add:
+            case Op::sub:
+            case Op::cmp:
+            case Op::imul:
+                if (reads_src && (is_reg || fits_i32(value.value))) {
+                    instr.src = value;
+                    return instr;
+                }
+                if (instr.op == Op::cmp && reads_dst && is_reg) {
+                    instr.dst = value;
+                    return instr;
+                }
+                return {};
+            case Op::test:
+                if (!is_reg) {
+                    return {};
+                }
+                if (reads_src) {
+                    instr.src = value;
+                }
+                if (reads_dst) {
+                    instr.dst = value;
+                }
+                return instr;
+            case Op::push:
+            case Op::idiv:
+                if (reads_dst && is_reg) {
+                    instr.dst = value;
+                    return instr;
+                }
+                return {};
+            default:
+                return {};
+        }
+    }
+
+    static constexpr std::array<Rule, 11> s_rules = {{
+        {Op::mov, &PeepholeOptimizer::remove_self_move},
+        {Op::mov, &PeepholeOptimizer::remove_move_back},
+        {Op::mov, &PeepholeOptimizer::forward_copy},
+        {Op::mov, &PeepholeOptimizer::remove_dead_move},
+        {Op::lea, &PeepholeOptimizer::remove_dead_move},
+        {Op::movzx, &PeepholeOptimizer::remove_dead_move},
+        {Op::add, &PeepholeOptimizer::fold_stack_adjust},
+        {Op::sub, &PeepholeOptimizer::fold_stack_adjust},
+        {Op::push, &PeepholeOptimizer::fold_push_pop},
+        {Op::jmp, &PeepholeOptimizer::remove_jump_to_next},
+        {Op::jcc, &PeepholeOptimizer::invert_branch_over_jump},
+    }};
+
+    AsmSink &m_out;
+    // Instructions by position since the first emit; m_slots starts at m_base and [m_begin, m_end) is
+    // still buffered. The scan is at m_cursor.
+    std::vector<Slot> m_slots{};
+    size_t m_base = 0;
+    size_t m_begin = 0;
+    size_t m_cursor = 0;
+    size_t m_end = 0;
+    bool m_finished = false;
+    std::vector<LabelState> m_labels{};
+    size_t m_forward_jumps = 0;
+    size_t m_removed_count = 0;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs a batch of independent jobs on a fixed number of threads. Jobs are dealt round-robin onto one
+// deque per worker; a worker takes from the back of its own deque and, once that runs dry, steals from
+// the front of the others, so a few slow inputs do not leave the rest of the pool idle.
+class WorkPool {
+public:
+    explicit WorkPool(const size_t workers) : m_queues(std::max<size_t>(workers, 1)) {
+    }
+
+    WorkPool(const WorkPool &other) = delete;
+
+    WorkPool operator=(const WorkPool &other) = delete;
+
+    // Calls job(i) for every i in [0, count) and returns when all of them have finished. The calling
+    // thread works as worker 0.
+    void run(const size_t count, const std::function<void(size_t)> &job) {
+        for (size_t i = 0; i < count; i++) {
+            m_queues[i % m_queues.size()].jobs.push_back(i);
+        }
+
+        std::vector<std::thread> threads;
+        const size_t workers = std::min(m_queues.size(), std::max<size_t>(count, 1));
+        for (size_t worker = 1; worker < workers; worker++) {
+            threads.emplace_back([this, worker, &job] { work(worker, job); });
+        }
+        work(0, job);
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    void work(const size_t worker, const std::function<void(size_t)> &job) {
+        while (const std::optional<size_t> index = take(worker)) {
+            job(index.value());
+        }
+    }
+
+    // The next job for worker: its own newest, or else the oldest job of another worker.
+    std::optional<size_t> take(const size_t worker) {
+        {
+            Queue &own = m_queues[worker];
+            const std::lock_guard lock(own.mutex);
+            if (!own.jobs.empty()) {
+                const size_t index = own.jobs.back();
+                own.jobs.pop_back();
+                return index;
+            }
+        }
+
+        for (size_t offset = 1; offset < m_queues.size(); offset++) {
+            Queue &victim = m_queues[(worker + offset) % m_queues.size()];
+            const std::lock_guard lock(victim.mutex);
+            if (!victim.jobs.empty()) {
+                const size_t index = victim.jobs.front();
+                victim.jobs.pop_front();
+                return index;
+            }
+        }
+        return {};
+    }
+
+    std::vector<Queue> m_queues;
+};
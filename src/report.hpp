@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <vector>
+
+// Bumped by the driver's replacement operator new.
+inline std::atomic<uint64_t> allocation_count{0};
+
+// Per-phase wall/CPU time, heap allocations and peak RSS, plus free-form counters, for --time-report.
+class TimeReport {
+public:
+    struct Phase {
+        std::string name;
+        double wall_ms;
+        double cpu_ms;
+        uint64_t allocations;
+        long peak_rss_kb;
+    };
+
+    // Measures from construction to destruction; does nothing when the report is disabled.
+    class Scope {
+    public:
+        Scope(TimeReport &report, const std::string_view name) : m_report(report), m_name(name) {
+            if (m_report.m_enabled) {
+                m_wall = std::chrono::steady_clock::now();
+                m_cpu = cpu_now();
+                m_allocations = allocation_count.load(std::memory_order_relaxed);
+            }
+        }
+
+        Scope(const Scope &other) = delete;
+
+        Scope operator=(const Scope &other) = delete;
+
+        ~Scope() {
+            if (!m_report.m_enabled) {
+                return;
+            }
+
+            const std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - m_wall;
+            m_report.m_phases.push_back({
+                .name = std::string(m_name),
+                .wall_ms = wall.count(),
+                .cpu_ms = cpu_now() - m_cpu,
+                .allocations = allocation_count.load(std::memory_order_relaxed) - m_allocations,
+                .peak_rss_kb = peak_rss_kb(),
+            });
+        }
+
+    private:
+        TimeReport &m_report;
+        std::string_view m_name;
+        std::chrono::steady_clock::time_point m_wall{};
+        double m_cpu = 0;
+        uint64_t m_allocations = 0;
+    };
+
+    explicit TimeReport(const bool enabled = false) : m_enabled(enabled) {
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return m_enabled;
+    }
+
+    Scope phase(const std::string_view name) {
+        return {*this, name};
+    }
+
+    void counter(const std::string_view name, const uint64_t value) {
+        if (m_enabled) {
+            m_counters.emplace_back(name, value);
+        }
+    }
+
+    void print_text(std::ostream &out) const {
+        out << "===== fue time report =====\n";
+        out << std::left << std::setw(16) << "phase" << std::right << std::setw(12) << "wall (ms)"
+            << std::setw(12) << "cpu (ms)" << std::setw(14) << "allocations" << std::setw(16) << "peak rss (KiB)"
+            << "\n";
+
+        double wall = 0;
+        double cpu = 0;
+        uint64_t allocations = 0;
+        out << std::fixed << std::setprecision(3);
+        for (const Phase &phase: m_phases) {
+            out << std::left << std::setw(16) << phase.name << std::right << std::setw(12) << phase.wall_ms
+                << std::setw(12) << phase.cpu_ms << std::setw(14) << phase.allocations << std::setw(16)
+                << phase.peak_rss_kb << "\n";
+            wall += phase.wall_ms;
+            cpu += phase.cpu_ms;
+            allocations += phase.allocations;
+        }
+        out << std::left << std::setw(16) << "total" << std::right << std::setw(12) << wall << std::setw(12) << cpu
+            << std::setw(14) << allocations << std::setw(16) << peak_rss_kb() << "\n";
+
+        for (const auto &[name, value]: m_counters) {
+            out << std::left << std::setw(28) << name << std::right << value << "\n";
+        }
+        out.flush();
+    }
+
+    void print_json(std::ostream &out) const {
+        out << "{\"phases\":[";
+        for (size_t i = 0; i < m_phases.size(); i++) {
+            const Phase &phase = m_phases[i];
+            out << (i == 0 ? "" : ",") << "{\"name\":\"" << phase.name << "\",\"wall_ms\":" << phase.wall_ms
+                << ",\"cpu_ms\":" << phase.cpu_ms << ",\"allocations\":" << phase.allocations
+                << ",\"peak_rss_kb\":" << phase.peak_rss_kb << "}";
+        }
+        out << "],\"counters\":{";
+        for (size_t i = 0; i < m_counters.size(); i++) {
+            out << (i == 0 ? "" : ",") << "\"" << m_counters[i].first << "\":" << m_counters[i].second;
+        }
+        out << "}}" << std::endl;
+    }
+
+private:
+    static double cpu_now() {
+        timespec ts{};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return static_cast<double>(ts.tv_sec) * 1e3 + static_cast<double>(ts.tv_nsec) / 1e6;
+    }
+
+    static long peak_rss_kb() {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    bool m_enabled;
+    std::vector<Phase> m_phases{};
+    std::vector<std::pair<std::string, uint64_t>> m_counters{};
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+
+#include "assembly.hpp"
+
+struct GenOptions {
+    // Arm a SIGALRM timer at _start instead of guarding every loop iteration with rcx.
+    std::optional<uint64_t> watchdog_ms{};
+};
+
+// Code sequences shared by every backend. Each returns the number of instructions it emitted,
+// not counting labels.
+
+// Prints the time-limit message and exits with status 0.
+inline size_t emit_tle_exit(AsmSink &out) {
+    out.emit({.op = Op::mov, .dst = reg_op(Reg::rax), .src = imm_op(1)});
+    out.emit({.op = Op::mov, .dst = reg_op(Reg::rdi), .src = imm_op(1)});
+    out.emit({.op = Op::mov, .dst = reg_op(Reg::rsi), .src = msg_op()});
+    out.emit({.op = Op::mov, .dst = reg_op(Reg::rdx), .src = msg_len_op()});
+    out.emit({.op = Op::syscall});
+
+    out.emit({.op = Op::mov, .dst = reg_op(Reg::rax), .src = imm_op(60)});
+    out.emit({.op = Op::mov, .dst = reg_op(Reg::rdi), .src = imm_op(0)});
+    out.emit({.op = Op::syscall});
+    return 8;
+}
+
+// Installs the time-limit message as the SIGALRM handler and starts a one-shot ITIMER_REAL.
+// x86-64 signal delivery insists on SA_RESTORER; the handler exits, so the restorer never runs.
+inline size_t emit_watchdog(AsmSink &out, const uint64_t ms, const int handler_label, const int start_label) {
+    size_t count = 0;
+    const auto emit = [&](const Op op, const Operand dst = {}, const Operand src = {}) {
+        count += op != Op::label;
+        out.emit({.op = op, .dst = dst, .src = src});
+    };
+
+    emit(Op::jmp, label_op(start_label));
+    emit(Op::label, label_op(handler_label));
+    count += emit_tle_exit(out);
+    emit(Op::label, label_op(start_label));
+
+    emit(Op::sub, reg_op(Reg::rsp), imm_op(64));
+    emit(Op::lea, reg_op(Reg::rax), label_op(handler_label));
+    emit(Op::mov, stack_op(0), reg_op(Reg::rax));        // sa_handler
+    emit(Op::mov, stack_op(8), imm_op(0x04000000));      // sa_flags: SA_RESTORER
+    emit(Op::mov, stack_op(16), reg_op(Reg::rax));       // sa_restorer
+    emit(Op::mov, stack_op(24), imm_op(0));              // sa_mask
+    emit(Op::mov, reg_op(Reg::rax), imm_op(13));         // rt_sigaction
+    emit(Op::mov, reg_op(Reg::rdi), imm_op(14));         // SIGALRM
+    emit(Op::mov, reg_op(Reg::rsi), reg_op(Reg::rsp));
+    emit(Op::mov, reg_op(Reg::rdx), imm_op(0));
+    emit(Op::mov, reg_op(Reg::r10), imm_op(8));
+    emit(Op::syscall);
+
+    emit(Op::mov, stack_op(32), imm_op(0));              // it_interval
+    emit(Op::mov, stack_op(40), imm_op(0));
+    emit(Op::mov, stack_op(48), imm_op(static_cast<int64_t>(ms / 1000)));          // it_value.tv_sec
+    emit(Op::mov, stack_op(56), imm_op(static_cast<int64_t>(ms % 1000 * 1000)));   // it_value.tv_usec
+    emit(Op::mov, reg_op(Reg::rax), imm_op(38));         // setitimer
+    emit(Op::mov, reg_op(Reg::rdi), imm_op(0));          // ITIMER_REAL
+    emit(Op::lea, reg_op(Reg::rsi), stack_op(32));
+    emit(Op::mov, reg_op(Reg::rdx), imm_op(0));
+    emit(Op::syscall);
+    emit(Op::add, reg_op(Reg::rsp), imm_op(64));
+    return count;
+}
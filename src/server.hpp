@@ -0,0 +1,391 @@
+#pragma once
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// The compile server's protocol. Every message is a frame: a 4-byte little-endian length, then that
+// many bytes. A request holds the client's working directory and then its fue arguments, each ending
+// in a NUL. A response holds the exit status and the signal that ended the program (0 for none) as
+// 4-byte numbers, then what fue wrote to stdout and to stderr, each behind its own length.
+namespace wire {
+
+struct Request {
+    std::string cwd;
+    std::vector<std::string> args;
+};
+
+struct Response {
+    int status = 0;
+    int signal = 0;
+    std::string out{};
+    std::string err{};
+};
+
+// Frames larger than this are treated as a broken connection.
+inline constexpr uint32_t max_frame = 256u << 20;
+
+inline bool read_all(const int fd, char *data, size_t size) {
+    while (size > 0) {
+        const ssize_t count = read(fd, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+inline bool write_all(const int fd, const char *data, size_t size) {
+    while (size > 0) {
+        const ssize_t count = write(fd, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+inline void put32(std::string &out, const uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out += static_cast<char>((value >> (i * 8)) & 0xff);
+    }
+}
+
+// Reads a 4-byte number at pos and moves past it, or returns nothing when the data is too short.
+inline std::optional<uint32_t> get32(const std::string_view data, size_t &pos) {
+    if (data.size() - pos < 4) {
+        return {};
+    }
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= static_cast<uint32_t>(static_cast<uint8_t>(data[pos + i])) << (i * 8);
+    }
+    pos += 4;
+    return value;
+}
+
+// Returns false once the other end has closed the connection or sent something unreadable.
+inline bool read_frame(const int fd, std::string &frame) {
+    char header[4];
+    if (!read_all(fd, header, sizeof(header))) {
+        return false;
+    }
+    size_t pos = 0;
+    const uint32_t size = get32(std::string_view(header, sizeof(header)), pos).value();
+    if (size > max_frame) {
+        return false;
+    }
+    frame.resize(size);
+    return read_all(fd, frame.data(), size);
+}
+
+inline bool write_frame(const int fd, const std::string_view frame) {
+    std::string header;
+    put32(header, static_cast<uint32_t>(frame.size()));
+    return write_all(fd, header.data(), header.size()) && write_all(fd, frame.data(), frame.size());
+}
+
+inline std::string encode(const Request &request) {
+    std::string frame = request.cwd;
+    frame += '\0';
+    for (const std::string &arg: request.args) {
+        frame += arg;
+        frame += '\0';
+    }
+    return frame;
+}
+
+inline std::optional<Request> decode_request(const std::string_view frame) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (start < frame.size()) {
+        const size_t end = frame.find('\0', start);
+        if (end == std::string_view::npos) {
+            return {};
+        }
+        fields.emplace_back(frame.substr(start, end - start));
+        start = end + 1;
+    }
+    if (fields.empty()) {
+        return {};
+    }
+    Request request{.cwd = std::move(fields.front())};
+    request.args.assign(std::make_move_iterator(fields.begin() + 1), std::make_move_iterator(fields.end()));
+    return request;
+}
+
+inline std::string encode(const Response &response) {
+    std::string frame;
+    put32(frame, static_cast<uint32_t>(response.status));
+    put32(frame, static_cast<uint32_t>(response.signal));
+    put32(frame, static_cast<uint32_t>(response.out.size()));
+    frame += response.out;
+    put32(frame, static_cast<uint32_t>(response.err.size()));
+    frame += response.err;
+    return frame;
+}
+
+inline std::optional<Response> decode_response(const std::string_view frame) {
+    size_t pos = 0;
+    const auto status = get32(frame, pos);
+    const auto signal = get32(frame, pos);
+    Response response{.status = static_cast<int>(status.value_or(0)), .signal = static_cast<int>(signal.value_or(0))};
+    for (std::string *text: {&response.out, &response.err}) {
+        const auto size = get32(frame, pos);
+        if (!size.has_value() || frame.size() - pos < size.value()) {
+            return {};
+        }
+        *text = frame.substr(pos, size.value());
+        pos += size.value();
+    }
+    if (!status.has_value() || !signal.has_value() || pos != frame.size()) {
+        return {};
+    }
+    return response;
+}
+
+}
+
+// fue --serve. Requests are handled one at a time, each in its client's working directory and with
+// std::cout and std::cerr captured for the response, so the handler can be the ordinary driver. A
+// program the handler wants to run goes through run(), which starts it in a child process: a trap or
+// the exit syscall then ends the child instead of the server.
+class CompileServer {
+public:
+    // Takes the arguments of one request and returns the exit status.
+    using Handler = std::function<int(const std::vector<std::string> &args)>;
+
+    explicit CompileServer(Handler handler) : m_handler(std::move(handler)) {
+        // A client that hangs up early must not take the server down with it.
+        std::signal(SIGPIPE, SIG_IGN);
+    }
+
+    CompileServer(const CompileServer &other) = delete;
+
+    CompileServer operator=(const CompileServer &other) = delete;
+
+    // Answers requests on stdin until it closes. Responses go to the original stdout, and anything else
+    // that would have been written there (say by the assembler) goes to stderr instead.
+    int serve_stdio() {
+        const int out = dup(STDOUT_FILENO);
+        if (out < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            std::cerr << "[Server Error] Unable to set up stdout" << std::endl;
+            return EXIT_FAILURE;
+        }
+        serve_stream(STDIN_FILENO, out);
+        close(out);
+        return EXIT_SUCCESS;
+    }
+
+    // Listens on a UNIX socket at path, serving one connection at a time. Returns only on error. A
+    // socket left at path by an earlier server is replaced; any other file there is an error.
+    int serve_socket(const std::string &path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "[Server Error] Socket path is too long: " << path << std::endl;
+            return EXIT_FAILURE;
+        }
+        address.sun_family = AF_UNIX;
+        path.copy(address.sun_path, path.size());
+
+        struct stat info{};
+        if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+            unlink(path.c_str());
+        }
+
+        const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listener, 64) != 0) {
+            std::cerr << "[Server Error] Unable to listen on " << path << ": " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        while (true) {
+            const int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (connection < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                std::cerr << "[Server Error] Unable to accept: " << std::strerror(errno) << std::endl;
+                close(listener);
+                return EXIT_FAILURE;
+            }
+            serve_stream(connection, connection);
+            close(connection);
+        }
+    }
+
+    // Runs program in a child process whose stdout and stderr are appended to the captured output, and
+    // returns its exit status. A program killed by a signal reports 128 plus the signal, as a shell would,
+    // and the signal is passed on to the client.
+    int run(const std::function<int()> &program) {
+        FILE *out = tmpfile();
+        FILE *err = tmpfile();
+        if (out == nullptr || err == nullptr) {
+            std::cerr << "[Server Error] Unable to create capture files" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        const pid_t pid = fork();
+        if (pid == 0) {
+            dup2(fileno(out), STDOUT_FILENO);
+            dup2(fileno(err), STDERR_FILENO);
+            std::cout.rdbuf(m_stdout);
+            std::cerr.rdbuf(m_stderr);
+            std::signal(SIGPIPE, SIG_DFL);
+            const int status = program();
+            std::cout.flush();
+            std::cerr.flush();
+            _exit(status);
+        }
+
+        int status = EXIT_FAILURE;
+        if (pid < 0) {
+            std::cerr << "[Server Error] Unable to start the program: " << std::strerror(errno) << std::endl;
+        } else {
+            int wait_status = 0;
+            while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR) {
+            }
+            if (WIFSIGNALED(wait_status)) {
+                m_signal = WTERMSIG(wait_status);
+                status = 128 + m_signal;
+            } else {
+                status = WEXITSTATUS(wait_status);
+            }
+        }
+        std::cout << read_capture(out);
+        std::cerr << read_capture(err);
+        return status;
+    }
+
+private:
+    void serve_stream(const int in, const int out) {
+        std::string frame;
+        while (wire::read_frame(in, frame)) {
+            wire::Response response;
+            if (const std::optional<wire::Request> request = wire::decode_request(frame)) {
+                response = handle(request.value());
+            } else {
+                response = {.status = EXIT_FAILURE, .err = "[Server Error] Malformed request\n"};
+            }
+            if (!wire::write_frame(out, wire::encode(response))) {
+                return;
+            }
+        }
+    }
+
+    wire::Response handle(const wire::Request &request) {
+        if (chdir(request.cwd.c_str()) != 0) {
+            return {.status = EXIT_FAILURE, .err = "[Server Error] Unable to enter " + request.cwd + "\n"};
+        }
+
+        std::ostringstream out;
+        std::ostringstream err;
+        m_stdout = std::cout.rdbuf(out.rdbuf());
+        m_stderr = std::cerr.rdbuf(err.rdbuf());
+        m_signal = 0;
+
+        wire::Response response;
+        try {
+            response.status = m_handler(request.args);
+        } catch (const std::exception &e) {
+            std::cerr << "[Server Error] " << e.what() << std::endl;
+            response.status = EXIT_FAILURE;
+        }
+
+        std::cout.rdbuf(m_stdout);
+        std::cerr.rdbuf(m_stderr);
+        response.signal = m_signal;
+        response.out = std::move(out).str();
+        response.err = std::move(err).str();
+        return response;
+    }
+
+    static std::string read_capture(FILE *file) {
+        std::string text;
+        rewind(file);
+        char buffer[4096];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            text.append(buffer, count);
+        }
+        fclose(file);
+        return text;
+    }
+
+    Handler m_handler;
+    std::streambuf *m_stdout = nullptr;
+    std::streambuf *m_stderr = nullptr;
+    int m_signal = 0;
+};
+
+// fue --client. Sends the working directory and the rest of the command line to the server at path,
+// then plays back its answer: the output, then the exit status, or the signal that ended the program.
+inline int run_client(const std::string &path, const std::vector<std::string> &args) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "[Client Error] Socket path is too long: " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    address.sun_family = AF_UNIX;
+    path.copy(address.sun_path, path.size());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        std::cerr << "[Client Error] Unable to reach the compile server at " << path << ": " << std::strerror(errno)
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    char *cwd = getcwd(nullptr, 0);
+    if (cwd == nullptr) {
+        std::cerr << "[Client Error] Unable to read the working directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const wire::Request request{.cwd = cwd, .args = args};
+    free(cwd);
+
+    std::string frame;
+    std::optional<wire::Response> response;
+    if (wire::write_frame(fd, wire::encode(request)) && wire::read_frame(fd, frame)) {
+        response = wire::decode_response(frame);
+    }
+    close(fd);
+    if (!response.has_value()) {
+        std::cerr << "[Client Error] The compile server at " << path << " did not answer" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << response->out << std::flush;
+    std::cerr << response->err << std::flush;
+    if (response->signal != 0) {
+        std::signal(response->signal, SIG_DFL);
+        std::raise(response->signal);
+    }
+    return response->status;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "errors.hpp"
+
+// Read-only view of an input file. Regular files are mapped straight into memory;
+// pipes and other streams are drained into a single owned buffer.
+class SourceFile {
+public:
+    explicit SourceFile(const char *path) {
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Unable to open " << path << std::endl;
+            fail();
+        }
+
+        struct stat info{};
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                m_mapped = mapped;
+                m_view = std::string_view(static_cast<const char *>(mapped), info.st_size);
+                close(fd);
+                return;
+            }
+        }
+
+        read_all(fd, path);
+        close(fd);
+        m_view = m_buffer;
+    }
+
+    SourceFile(const SourceFile &other) = delete;
+
+    SourceFile operator=(const SourceFile &other) = delete;
+
+    ~SourceFile() {
+        if (m_mapped != nullptr) {
+            munmap(m_mapped, m_view.size());
+        }
+    }
+
+    [[nodiscard]] std::string_view view() const {
+        return m_view;
+    }
+
+private:
+    void read_all(const int fd, const char *path) {
+        size_t size = 0;
+        m_buffer.resize(64 * 1024);
+        while (true) {
+            const ssize_t count = read(fd, m_buffer.data() + size, m_buffer.size() - size);
+            if (count < 0) {
+                std::cerr << "Unable to read " << path << std::endl;
+                close(fd);
+                fail();
+            }
+            if (count == 0) {
+                break;
+            }
+            size += count;
+            if (size == m_buffer.size()) {
+                m_buffer.resize(m_buffer.size() * 2);
+            }
+        }
+        m_buffer.resize(size);
+    }
+
+    void *m_mapped = nullptr;
+    std::string m_buffer{};
+    std::string_view m_view{};
+};
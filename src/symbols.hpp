@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using Symbol = uint32_t;
+
+// Maps every distinct identifier to a dense integer id. Names are copied once, so ids stay valid
+// after the source buffer they were lexed from is gone.
+class Interner {
+public:
+    Symbol intern(const std::string_view name) {
+        if (const auto it = m_ids.find(name); it != m_ids.end()) {
+            return it->second;
+        }
+
+        const std::string_view stored = m_names.emplace_back(name);
+        const auto id = static_cast<Symbol>(m_ids.size());
+        m_ids.emplace(stored, id);
+        return id;
+    }
+
+    [[nodiscard]] std::string_view name(const Symbol symbol) const {
+        return m_names[symbol];
+    }
+
+    [[nodiscard]] size_t size() const {
+        return m_names.size();
+    }
+
+    // Forgets every name. Ids handed out before must not be used afterwards.
+    void clear() {
+        m_ids.clear();
+        m_names.clear();
+    }
+
+private:
+    std::deque<std::string> m_names{};
+    std::unordered_map<std::string_view, Symbol> m_ids{};
+};
+
+// Shadow stack keyed by symbol id: each symbol points at its innermost binding, and closing a
+// scope restores whatever that scope shadowed. Lookups are O(1); scopes cost O(1) per binding.
+template<typename T>
+class ScopedSymbolTable {
+public:
+    struct Entry {
+        Symbol symbol;
+        T value;
+        int64_t shadowed;
+    };
+
+    void begin_scope() {
+        m_scopes.push_back(m_entries.size());
+    }
+
+    void end_scope() {
+        const size_t begin = m_scopes.back();
+        while (m_entries.size() > begin) {
+            const Entry &entry = m_entries.back();
+            m_heads[entry.symbol] = entry.shadowed;
+            m_entries.pop_back();
+        }
+        m_scopes.pop_back();
+    }
+
+    void declare(const Symbol symbol, T value) {
+        if (symbol >= m_heads.size()) {
+            m_heads.resize(symbol + 1, -1);
+        }
+        m_entries.push_back({symbol, std::move(value), m_heads[symbol]});
+        m_heads[symbol] = static_cast<int64_t>(m_entries.size() - 1);
+    }
+
+    [[nodiscard]] const T *find(const Symbol symbol) const {
+        if (symbol >= m_heads.size() || m_heads[symbol] < 0) {
+            return nullptr;
+        }
+        return &m_entries[m_heads[symbol]].value;
+    }
+
+    // Bindings declared in the innermost open scope.
+    [[nodiscard]] std::span<const Entry> scope_entries() const {
+        return std::span<const Entry>(m_entries).subspan(m_scopes.back());
+    }
+
+private:
+    std::vector<Entry> m_entries{};
+    std::vector<int64_t> m_heads{};
+    std::vector<size_t> m_scopes{};
+};
@@ -1,198 +1,243 @@
-#pragma once
-
-enum class TokenType {
-    exit, int_lit, semi, open_paren, close_paren, ident, may,
-    equal, plus, star, minus, fslash, curly_open, curly_close,
-    if_, elif, else_, big, small, iseq, big_eq, small_eq, no_eq,
-    w_loop, f_loop
-};
-
-inline std::optional<int> bin_prec(const TokenType type) {
-    switch (type) {
-        case TokenType::star:
-        case TokenType::fslash:
-            return 2;
-
-        case TokenType::plus:
-        case TokenType::minus:
-            return 1;
-
-        case TokenType::big:
-        case TokenType::small:
-        case TokenType::iseq:
-        case TokenType::big_eq:
-        case TokenType::small_eq:
-        case TokenType::no_eq:
-            return 0;
-
-        default:
-            return {};
-    }
-}
-
-struct Token {
-    TokenType type;
-    int line;
-    std::optional<std::string> value{};
-};
-
-class Tokenizer {
-public:
-    explicit Tokenizer(std::string src) : m_src(std::move(src)) {
-        
-    }
-
-    std::vector<Token> tokenize() {
-        std::vector<Token> tokens;
-        std::string buf;
-        int line_count = 1;
-
-        while (peek().has_value()) {
-            if (std::isalpha(peek().value()) || peek().value() == '_') {
-                buf.push_back(engulf());
-
-                while (peek().has_value() && std::isalnum(peek().value()) || peek().value() == '_') {
-                    buf.push_back(engulf());
-                }
-
-                if (buf == "exit") {
-                    tokens.push_back({TokenType::exit, line_count});
-                    buf.clear();
-                } else if (buf == "may") {
-                    tokens.push_back({TokenType::may, line_count});
-                    buf.clear();
-                } else if (buf == "if") {
-                    tokens.push_back({TokenType::if_, line_count});
-                    buf.clear();
-                } else if (buf == "elif") {
-                    tokens.push_back({TokenType::elif, line_count});
-                    buf.clear();
-                } else if (buf == "else") {
-                    tokens.push_back({TokenType::else_, line_count});
-                    buf.clear();
-                } else if (buf == "while") {
-                    tokens.push_back({TokenType::w_loop, line_count});
-                    buf.clear();
-                } else if (buf == "for") {
-                    tokens.push_back({TokenType::f_loop, line_count});
-                    buf.clear();
-                } else {
-                    tokens.push_back({TokenType::ident, line_count, buf});
-                    buf.clear();
-                }
-            } else if (std::isdigit(peek().value())) {
-                buf.push_back(engulf());
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buf.push_back(engulf());
-                }
-
-                tokens.push_back({TokenType::int_lit, line_count, buf});
-                buf.clear();
-            } else if (peek().value() == '-' && peek(1).has_value() && peek(1).value() == '-') {
-                engulf();
-                engulf();
-
-                while (peek().has_value() && peek().value() != '\n') {
-                    engulf();
-                }
-            } else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '*') {
-                engulf();
-                engulf();
-
-                while (peek().has_value()) {
-                    if (peek().value() == '\n') {
-                        line_count++;
-                    }
-
-                    if (peek().value() == '*' && peek(1).has_value() && peek(1).value() == '/')
-                        break;
-
-                    engulf();
-                }
-
-                if (peek().has_value())
-                    engulf();
-                if (peek().has_value())
-                    engulf();
-            } else if (peek().value() == '(') {
-                engulf();
-                tokens.push_back({TokenType::open_paren, line_count});
-            } else if (peek().value() == ')') {
-                engulf();
-                tokens.push_back({TokenType::close_paren, line_count});
-            } else if (peek().value() == ';') {
-                engulf();
-                tokens.push_back({TokenType::semi, line_count});
-            } else if (peek().value() == '=' && peek(1).has_value() && peek(1).value() != '=') {
-                engulf();
-                tokens.push_back({TokenType::equal, line_count});
-            } else if (peek().value() == '+') {
-                engulf();
-                tokens.push_back({TokenType::plus, line_count});
-            } else if (peek().value() == '*') {
-                engulf();
-                tokens.push_back({TokenType::star, line_count});
-            } else if (peek().value() == '/') {
-                engulf();
-                tokens.push_back({TokenType::fslash, line_count});
-            } else if (peek().value() == '-') {
-                engulf();
-                tokens.push_back({TokenType::minus, line_count});
-            } else if (peek().value() == '{') {
-                engulf();
-                tokens.push_back({TokenType::curly_open, line_count});
-            } else if (peek().value() == '}') {
-                engulf();
-                tokens.push_back({TokenType::curly_close, line_count});
-            } else if (peek().value() == '>' && peek(1).has_value() && peek(1).value() != '=') {
-                engulf();
-                tokens.push_back({TokenType::big, line_count});
-            } else if (peek().value() == '<' && peek(1).has_value() && peek(1).value() != '=') {
-                engulf();
-                tokens.push_back({TokenType::small, line_count});
-            } else if (peek().value() == '=' && peek(1).has_value() && peek(1).value() == '=') {
-                engulf();
-                engulf();
-                tokens.push_back({TokenType::iseq, line_count});
-            } else if (peek().value() == '>' && peek(1).has_value() && peek(1).value() == '=') {
-                engulf();
-                engulf();
-                tokens.push_back({TokenType::big_eq, line_count});
-            } else if (peek().value() == '<' && peek(1).has_value() && peek(1).value() == '=') {
-                engulf();
-                engulf();
-                tokens.push_back({TokenType::small_eq, line_count});
-            } else if (peek().value() == '!' && peek(1).has_value() && peek(1).value() == '=') {
-                engulf();
-                engulf();
-                tokens.push_back({TokenType::no_eq, line_count});
-            } else if (peek().value() == '\n') {
-                engulf();
-                line_count++;
-            } else if (std::isspace(peek().value())) {
-                engulf();
-            } else {
-                std::cerr << "Invalid Token!" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        m_index = 0;
-        return tokens;
-    }
-
-private:
-    const std::string m_src;
-    size_t m_index = 0;
-
-    [[nodiscard]] std::optional<char> peek(const int offset = 0) const {
-        if (m_index + offset >= m_src.length()) {
-            return {};
-        }
-        return m_src[m_index + offset];
-    }
-
-    char engulf() {
-        return m_src[m_index++];
-    }
-};
\ No newline at end of file
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <string_view>
+
+#include "errors.hpp"
+#include "symbols.hpp"
+
+enum class TokenType {
+    exit, int_lit, semi, open_paren, close_paren, ident, may,
+    equal, plus, star, minus, fslash, curly_open, curly_close,
+    if_, elif, else_, big, small, iseq, big_eq, small_eq, no_eq,
+    w_loop, f_loop
+};
+
+inline std::optional<int> bin_prec(const TokenType type) {
+    switch (type) {
+        case TokenType::star:
+        case TokenType::fslash:
+            return 2;
+
+        case TokenType::plus:
+        case TokenType::minus:
+            return 1;
+
+        case TokenType::big:
+        case TokenType::small:
+        case TokenType::iseq:
+        case TokenType::big_eq:
+        case TokenType::small_eq:
+        case TokenType::no_eq:
+            return 0;
+
+        default:
+            return {};
+    }
+}
+
+struct Token {
+    TokenType type;
+    int line;
+    std::string_view value{};
+    Symbol symbol = 0;
+    // The value of an int_lit, read once here.
+    int64_t number = 0;
+};
+
+namespace lexer {
+    enum CharClass : uint8_t {
+        alpha = 1 << 0,
+        digit = 1 << 1,
+        space = 1 << 2,
+    };
+
+    inline constexpr std::array<uint8_t, 256> char_classes = [] {
+        std::array<uint8_t, 256> table{};
+        for (int c = 'a'; c <= 'z'; c++) {
+            table[c] |= alpha;
+            table[c - 'a' + 'A'] |= alpha;
+        }
+        table['_'] |= alpha;
+        for (int c = '0'; c <= '9'; c++) {
+            table[c] |= digit;
+        }
+        for (const char c: {' ', '\t', '\n', '\v', '\f', '\r'}) {
+            table[static_cast<unsigned char>(c)] |= space;
+        }
+        return table;
+    }();
+
+    inline constexpr bool is(const char c, const uint8_t cls) {
+        return char_classes[static_cast<unsigned char>(c)] & cls;
+    }
+
+    struct Keyword {
+        std::string_view text;
+        TokenType type = TokenType::ident;
+    };
+
+    inline constexpr Keyword keywords[] = {
+        {"exit", TokenType::exit}, {"may", TokenType::may}, {"if", TokenType::if_}, {"elif", TokenType::elif},
+        {"else", TokenType::else_}, {"while", TokenType::w_loop}, {"for", TokenType::f_loop},
+    };
+
+    // Perfect hash over the keyword set: a single string compare classifies any identifier.
+    inline constexpr size_t keyword_hash(const std::string_view word) {
+        return (word.size() + 2 * static_cast<unsigned char>(word.front()) + static_cast<unsigned char>(word.back())) & 15;
+    }
+
+    inline constexpr std::array<Keyword, 16> keyword_table = [] {
+        std::array<Keyword, 16> table{};
+        for (const Keyword &keyword: keywords) {
+            table[keyword_hash(keyword.text)] = keyword;
+        }
+        return table;
+    }();
+
+    static_assert([] {
+        for (const Keyword &keyword: keywords) {
+            if (keyword_table[keyword_hash(keyword.text)].text != keyword.text) {
+                return false;
+            }
+        }
+        return true;
+    }(), "keyword_hash is not perfect over the keyword set");
+
+    inline constexpr TokenType classify(const std::string_view word) {
+        const Keyword &candidate = keyword_table[keyword_hash(word)];
+        return candidate.text == word ? candidate.type : TokenType::ident;
+    }
+}
+
+class Tokenizer {
+public:
+    Tokenizer(const std::string_view src, Interner &symbols) : m_src(src), m_symbols(symbols) {
+        
+    }
+
+    // Tokens view into the source buffer, which has to outlive them. They are written into tokens,
+    // so a buffer left over from an earlier source can be handed in to reuse its capacity.
+    std::vector<Token> tokenize(std::vector<Token> tokens = {}) {
+        tokens.clear();
+        tokens.reserve(m_src.size() / 4 + 1);
+        int line_count = 1;
+
+        while (m_index < m_src.size()) {
+            const char c = m_src[m_index];
+            const size_t start = m_index;
+
+            if (lexer::is(c, lexer::alpha)) {
+                while (++m_index < m_src.size() && lexer::is(m_src[m_index], lexer::alpha | lexer::digit)) {
+                }
+
+                const std::string_view word = view(start);
+                const TokenType type = lexer::classify(word);
+                if (type == TokenType::ident) {
+                    tokens.push_back({TokenType::ident, line_count, word, m_symbols.intern(word)});
+                } else {
+                    tokens.push_back({type, line_count});
+                }
+            } else if (lexer::is(c, lexer::digit)) {
+                while (++m_index < m_src.size() && lexer::is(m_src[m_index], lexer::digit)) {
+                }
+
+                tokens.push_back({TokenType::int_lit, line_count, view(start), 0, number(view(start), line_count)});
+            } else if (c == '-' && peek(1) == '-') {
+                while (m_index < m_src.size() && m_src[m_index] != '\n') {
+                    m_index++;
+                }
+            } else if (c == '/' && peek(1) == '*') {
+                m_index += 2;
+
+                while (m_index < m_src.size()) {
+                    if (m_src[m_index] == '\n') {
+                        line_count++;
+                    }
+
+                    if (m_src[m_index] == '*' && peek(1) == '/')
+                        break;
+
+                    m_index++;
+                }
+
+                m_index = std::min(m_index + 2, m_src.size());
+            } else if (c == '\n') {
+                m_index++;
+                line_count++;
+            } else if (lexer::is(c, lexer::space)) {
+                m_index++;
+            } else {
+                const std::optional<TokenType> type = punctuation(c, peek(1));
+                if (!type.has_value()) {
+                    std::cerr << "Invalid Token!" << std::endl;
+                    fail();
+                }
+
+                m_index += is_two_char(type.value()) ? 2 : 1;
+                tokens.push_back({type.value(), line_count});
+            }
+        }
+
+        m_index = 0;
+        return tokens;
+    }
+
+private:
+    const std::string_view m_src;
+    Interner &m_symbols;
+    size_t m_index = 0;
+
+    [[nodiscard]] char peek(const int offset) const {
+        if (m_index + offset >= m_src.length()) {
+            return '\0';
+        }
+        return m_src[m_index + offset];
+    }
+
+    [[nodiscard]] std::string_view view(const size_t start) const {
+        return m_src.substr(start, m_index - start);
+    }
+
+    // Literals wrap modulo 2^64, so 18446744073709551615 reads as -1; anything wider is an error.
+    static int64_t number(const std::string_view text, const int line) {
+        uint64_t value;
+        const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec != std::errc() || ptr != text.data() + text.size()) {
+            std::cerr << "Integer literal out of range: " << text << " on line " << line << "\n";
+            fail();
+        }
+        return static_cast<int64_t>(value);
+    }
+
+    static std::optional<TokenType> punctuation(const char c, const char next) {
+        switch (c) {
+            case '(': return TokenType::open_paren;
+            case ')': return TokenType::close_paren;
+            case ';': return TokenType::semi;
+            case '+': return TokenType::plus;
+            case '*': return TokenType::star;
+            case '/': return TokenType::fslash;
+            case '-': return TokenType::minus;
+            case '{': return TokenType::curly_open;
+            case '}': return TokenType::curly_close;
+            case '=': return next == '=' ? TokenType::iseq : TokenType::equal;
+            case '>': return next == '=' ? TokenType::big_eq : TokenType::big;
+            case '<': return next == '=' ? TokenType::small_eq : TokenType::small;
+            case '!':
+                if (next == '=') {
+                    return TokenType::no_eq;
+                }
+                return {};
+            default:
+                return {};
+        }
+    }
+
+    static bool is_two_char(const TokenType type) {
+        return type == TokenType::iseq || type == TokenType::big_eq || type == TokenType::small_eq ||
+               type == TokenType::no_eq;
+    }
+};
@@ -0,0 +1,523 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+#include "parser.hpp"
+#include "symbols.hpp"
+
+// Unrolls for loops with a trip count known at compile time: the counter starts at a literal, is
+// compared with a literal and is stepped by a literal, and the body neither assigns nor redeclares
+// it. Loops inside a body are handled first, and a body that still holds a loop is left alone.
+//
+// - Short loops are fully unrolled into one copy of the body per iteration. Each copy reads the
+//   counter as the literal it holds on that iteration, so a second round of folding and DCE can
+//   finish off the arithmetic and the counter stores.
+// - Longer loops become a main loop whose body holds factor copies, and which runs until the counter
+//   reaches its value after the last whole group, followed by the original loop for the remainder.
+//
+// Trip counts are only trusted when the counter never wraps and the loop stays under the iteration
+// guard, so the guard cannot fire in the loops that are rewritten.
+class LoopUnroller {
+public:
+    LoopUnroller(ArenaAllocator &allocator, ExprPool &exprs, const size_t factor)
+        : m_allocator(allocator), m_exprs(exprs), m_factor(factor) {
+    }
+
+    void unroll_prog(NodeProg &prog) {
+        if (m_factor <= 1) {
+            return;
+        }
+        for (NodeStmt &stmt: prog.stmts) {
+            unroll_stmt(&stmt);
+        }
+    }
+
+    // Loops replaced by straight-line copies of their body.
+    [[nodiscard]] size_t unrolled() const {
+        return m_unrolled;
+    }
+
+    // Loops split into an unrolled main loop and a remainder loop.
+    [[nodiscard]] size_t partially_unrolled() const {
+        return m_partially_unrolled;
+    }
+
+private:
+    // The counter of a loop with a known trip count. Iteration k sees it at start + k * step.
+    struct Induction {
+        Token ident;
+        int64_t start;
+        int64_t step;
+        int64_t trips;
+
+        [[nodiscard]] int64_t at(const int64_t k) const {
+            return static_cast<int64_t>(static_cast<__int128>(start) + static_cast<__int128>(k) * step);
+        }
+    };
+
+    // Full unrolling is limited to this many iterations; either way, the copies of the body together
+    // may cost at most s_max_cost, counting each statement and expression node as one.
+    static constexpr int64_t s_max_full_trips = 64;
+    static constexpr int64_t s_max_cost = 256;
+    // The loop guard fires on the billionth iteration.
+    static constexpr int64_t s_guard_trips = 1000000000;
+
+    // Unrolls the loops in stmt. Returns true if it still holds a loop afterwards.
+    bool unroll_stmt(NodeStmt *stmt) {
+        struct UnrollVisitor {
+            LoopUnroller &unroller;
+            NodeStmt *stmt;
+
+            bool operator()(NodeStmtExit *) const {
+                return false;
+            }
+
+            bool operator()(NodeStmtMay *) const {
+                return false;
+            }
+
+            bool operator()(NodeStmtAssign *) const {
+                return false;
+            }
+
+            bool operator()(NodeStmtScope *stmt_scope) const {
+                return unroller.unroll_scope(stmt_scope);
+            }
+
+            bool operator()(NodeStmtIf *stmt_if) const {
+                bool has_loop = unroller.unroll_scope(stmt_if->scope);
+                std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                        has_loop |= unroller.unroll_scope((*elif)->scope);
+                        pred = (*elif)->pred;
+                    } else {
+                        has_loop |= unroller.unroll_scope(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope);
+                        pred = {};
+                    }
+                }
+                return has_loop;
+            }
+
+            bool operator()(NodeStmtWhile *stmt_while) const {
+                unroller.unroll_scope(stmt_while->scope);
+                return true;
+            }
+
+            bool operator()(NodeStmtFor *stmt_for) const {
+                if (unroller.unroll_scope(stmt_for->scope)) {
+                    return true;
+                }
+                return !unroller.unroll_for(stmt, stmt_for);
+            }
+        };
+
+        return std::visit(UnrollVisitor{.unroller = *this, .stmt = stmt}, stmt->var);
+    }
+
+    bool unroll_scope(NodeStmtScope *scope) {
+        bool has_loop = false;
+        for (NodeStmt *stmt: scope->stmts) {
+            has_loop |= unroll_stmt(stmt);
+        }
+        return has_loop;
+    }
+
+    // Replaces the loop in stmt when its trip count is known and the copies fit the budget. Returns
+    // true if no loop is left in its place.
+    bool unroll_for(NodeStmt *stmt, const NodeStmtFor *stmt_for) {
+        const std::optional<Induction> induction = analyse(stmt_for);
+        if (!induction.has_value()) {
+            return false;
+        }
+
+        const int64_t trips = induction->trips;
+        const int64_t cost = scope_cost(stmt_for->scope) + stmt_cost(stmt_for->iter);
+        if (trips <= s_max_full_trips && trips * cost <= s_max_cost) {
+            unroll_fully(stmt, stmt_for, induction.value());
+            return true;
+        }
+
+        const auto factor = static_cast<int64_t>(m_factor);
+        if (trips >= 2 * factor && factor * cost <= s_max_cost) {
+            unroll_partially(stmt, stmt_for, induction.value());
+        }
+        return false;
+    }
+
+    // { init; body with the counter at start; counter = start + step; ...; counter = start + trips * step; }
+    void unroll_fully(NodeStmt *stmt, const NodeStmtFor *stmt_for, const Induction &induction) {
+        auto scope = m_allocator.alloc<NodeStmtScope>();
+        scope->stmts.push_back(stmt_for->init);
+        for (int64_t k = 0; k < induction.trips; k++) {
+            scope->stmts.push_back(wrap(clone_scope(stmt_for->scope, induction.ident.symbol, induction.at(k))));
+            scope->stmts.push_back(store(induction.ident, m_exprs.add_lit(induction.at(k + 1))));
+        }
+        stmt->var = scope;
+        m_unrolled++;
+    }
+
+    // { init; while (counter != end of the last whole group) { factor copies of body; iter; } original loop }
+    void unroll_partially(NodeStmt *stmt, const NodeStmtFor *stmt_for, const Induction &induction) {
+        const auto factor = static_cast<int64_t>(m_factor);
+        const int64_t main_trips = induction.trips - induction.trips % factor;
+
+        auto main_body = m_allocator.alloc<NodeStmtScope>();
+        for (int64_t k = 0; k < factor; k++) {
+            main_body->stmts.push_back(wrap(clone_scope(stmt_for->scope)));
+            main_body->stmts.push_back(clone_stmt(stmt_for->iter));
+        }
+        auto main_loop = m_allocator.alloc<NodeStmtWhile>();
+        const ExprIndex counter = m_exprs.add_ident(induction.ident);
+        const ExprIndex end = m_exprs.add_lit(induction.at(main_trips));
+        main_loop->expr = m_exprs.add_bin(ExprKind::not_equal, counter, end);
+        main_loop->scope = main_body;
+
+        auto scope = m_allocator.alloc<NodeStmtScope>();
+        scope->stmts.push_back(stmt_for->init);
+        scope->stmts.push_back(wrap(main_loop));
+        if (main_trips < induction.trips) {
+            // The remainder runs the original loop from where the main loop stopped.
+            auto remainder_body = m_allocator.alloc<NodeStmtScope>();
+            remainder_body->stmts.push_back(wrap(stmt_for->scope));
+            remainder_body->stmts.push_back(stmt_for->iter);
+            auto remainder = m_allocator.alloc<NodeStmtWhile>();
+            remainder->expr = stmt_for->cond;
+            remainder->scope = remainder_body;
+            scope->stmts.push_back(wrap(remainder));
+        }
+        stmt->var = scope;
+        m_partially_unrolled++;
+    }
+
+    // The counter of stmt_for and its trip count, if they are known and safe to rely on.
+    [[nodiscard]] std::optional<Induction> analyse(const NodeStmtFor *stmt_for) const {
+        Token ident;
+        ExprIndex init;
+        if (const auto may = std::get_if<NodeStmtMay *>(&stmt_for->init->var)) {
+            ident = (*may)->ident;
+            init = (*may)->expr;
+        } else if (const auto assign = std::get_if<NodeStmtAssign *>(&stmt_for->init->var)) {
+            ident = (*assign)->ident;
+            init = (*assign)->expr;
+        } else {
+            return {};
+        }
+        const std::optional<int64_t> start = m_exprs.lit_value(init);
+        const std::optional<int64_t> step = step_of(stmt_for->iter, ident.symbol);
+        if (!start.has_value() || !step.has_value() || step.value() == 0 || writes(stmt_for->scope, ident.symbol)) {
+            return {};
+        }
+
+        // Read the condition as `counter <kind> bound`.
+        const ExprIndex cond = stmt_for->cond;
+        ExprKind kind = m_exprs.kind(cond);
+        if (!is_cmp(kind)) {
+            return {};
+        }
+        std::optional<int64_t> bound;
+        if (is_counter(m_exprs.lhs(cond), ident.symbol)) {
+            bound = m_exprs.lit_value(m_exprs.rhs(cond));
+        } else if (is_counter(m_exprs.rhs(cond), ident.symbol)) {
+            bound = m_exprs.lit_value(m_exprs.lhs(cond));
+            kind = mirror(kind);
+        }
+        if (!bound.has_value()) {
+            return {};
+        }
+
+        const std::optional<int64_t> trips = trip_count(kind, start.value(), bound.value(), step.value());
+        if (!trips.has_value() || trips.value() >= s_guard_trips) {
+            return {};
+        }
+        // The counter is stored once more after the last iteration.
+        const __int128 last = static_cast<__int128>(start.value()) + static_cast<__int128>(trips.value()) * step.value();
+        if (last < INT64_MIN || last > INT64_MAX) {
+            return {};
+        }
+        return Induction{.ident = ident, .start = start.value(), .step = step.value(), .trips = trips.value()};
+    }
+
+    // Iterations of `for (counter = start; counter <kind> bound; counter = counter + step)`, or nothing
+    // when the counter would have to wrap to get there.
+    static std::optional<int64_t> trip_count(const ExprKind kind, const int64_t start, const int64_t bound,
+                                             const int64_t step) {
+        const __int128 distance = static_cast<__int128>(bound) - start;
+        const __int128 size = step;
+        __int128 trips;
+        switch (kind) {
+            case ExprKind::less:
+                if (start >= bound) {
+                    return 0;
+                }
+                if (step < 0) {
+                    return {};
+                }
+                trips = (distance + size - 1) / size;
+                break;
+            case ExprKind::less_eq:
+                if (start > bound) {
+                    return 0;
+                }
+                if (step < 0) {
+                    return {};
+                }
+                trips = distance / size + 1;
+                break;
+            case ExprKind::greater:
+                if (start <= bound) {
+                    return 0;
+                }
+                if (step > 0) {
+                    return {};
+                }
+                trips = (-distance - size - 1) / -size;
+                break;
+            case ExprKind::greater_eq:
+                if (start < bound) {
+                    return 0;
+                }
+                if (step > 0) {
+                    return {};
+                }
+                trips = -distance / -size + 1;
+                break;
+            case ExprKind::equal:
+                return start == bound ? 1 : 0;
+            default:
+                if (distance % size != 0 || distance / size < 0) {
+                    return {};
+                }
+                trips = distance / size;
+                break;
+        }
+        if (trips > INT64_MAX) {
+            return {};
+        }
+        return static_cast<int64_t>(trips);
+    }
+
+    static ExprKind mirror(const ExprKind kind) {
+        switch (kind) {
+            case ExprKind::greater: return ExprKind::less;
+            case ExprKind::less: return ExprKind::greater;
+            case ExprKind::greater_eq: return ExprKind::less_eq;
+            case ExprKind::less_eq: return ExprKind::greater_eq;
+            default: return kind;
+        }
+    }
+
+    [[nodiscard]] bool is_counter(const ExprIndex expr, const Symbol symbol) const {
+        return m_exprs.kind(expr) == ExprKind::ident && m_exprs.ident(expr).symbol == symbol;
+    }
+
+    // The step of `counter = counter + c`, `counter = c + counter` or `counter = counter - c`.
+    [[nodiscard]] std::optional<int64_t> step_of(const NodeStmt *iter, const Symbol symbol) const {
+        const auto assign = std::get_if<NodeStmtAssign *>(&iter->var);
+        if (assign == nullptr || (*assign)->ident.symbol != symbol) {
+            return {};
+        }
+        const ExprIndex expr = (*assign)->expr;
+        const ExprIndex lhs = m_exprs.lhs(expr);
+        const ExprIndex rhs = m_exprs.rhs(expr);
+        if (m_exprs.kind(expr) == ExprKind::add) {
+            if (is_counter(lhs, symbol)) {
+                return m_exprs.lit_value(rhs);
+            }
+            if (is_counter(rhs, symbol)) {
+                return m_exprs.lit_value(lhs);
+            }
+        } else if (m_exprs.kind(expr) == ExprKind::sub && is_counter(lhs, symbol)) {
+            const std::optional<int64_t> step = m_exprs.lit_value(rhs);
+            if (step.has_value() && step.value() != INT64_MIN) {
+                return -step.value();
+            }
+        }
+        return {};
+    }
+
+    // True if anything in scope assigns or declares symbol.
+    [[nodiscard]] bool writes(const NodeStmtScope *scope, const Symbol symbol) const {
+        return std::ranges::any_of(scope->stmts, [&](const NodeStmt *stmt) {
+            return writes(stmt, symbol);
+        });
+    }
+
+    [[nodiscard]] bool writes(const NodeStmt *stmt, const Symbol symbol) const {
+        struct WriteVisitor {
+            const LoopUnroller &unroller;
+            const Symbol symbol;
+
+            bool operator()(const NodeStmtExit *) const {
+                return false;
+            }
+
+            bool operator()(const NodeStmtMay *stmt_may) const {
+                return stmt_may->ident.symbol == symbol;
+            }
+
+            bool operator()(const NodeStmtAssign *stmt_assign) const {
+                return stmt_assign->ident.symbol == symbol;
+            }
+
+            bool operator()(const NodeStmtScope *stmt_scope) const {
+                return unroller.writes(stmt_scope, symbol);
+            }
+
+            bool operator()(const NodeStmtIf *stmt_if) const {
+                if (unroller.writes(stmt_if->scope, symbol)) {
+                    return true;
+                }
+                std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                        if (unroller.writes((*elif)->scope, symbol)) {
+                            return true;
+                        }
+                        pred = (*elif)->pred;
+                    } else {
+                        return unroller.writes(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope, symbol);
+                    }
+                }
+                return false;
+            }
+
+            bool operator()(const NodeStmtWhile *stmt_while) const {
+                return unroller.writes(stmt_while->scope, symbol);
+            }
+
+            bool operator()(const NodeStmtFor *stmt_for) const {
+                return unroller.writes(stmt_for->init, symbol) || unroller.writes(stmt_for->iter, symbol) ||
+                       unroller.writes(stmt_for->scope, symbol);
+            }
+        };
+
+        return std::visit(WriteVisitor{.unroller = *this, .symbol = symbol}, stmt->var);
+    }
+
+    [[nodiscard]] int64_t expr_cost(const ExprIndex expr) const {
+        return expr - m_exprs.first(expr) + 1;
+    }
+
+    [[nodiscard]] int64_t scope_cost(const NodeStmtScope *scope) const {
+        int64_t cost = 0;
+        for (const NodeStmt *stmt: scope->stmts) {
+            cost += stmt_cost(stmt);
+        }
+        return cost;
+    }
+
+    // Only called on loop-free statements.
+    [[nodiscard]] int64_t stmt_cost(const NodeStmt *stmt) const {
+        if (const auto stmt_exit = std::get_if<NodeStmtExit *>(&stmt->var)) {
+            return 1 + expr_cost((*stmt_exit)->expr);
+        }
+        if (const auto stmt_may = std::get_if<NodeStmtMay *>(&stmt->var)) {
+            return 1 + expr_cost((*stmt_may)->expr);
+        }
+        if (const auto stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->var)) {
+            return 1 + expr_cost((*stmt_assign)->expr);
+        }
+        if (const auto stmt_scope = std::get_if<NodeStmtScope *>(&stmt->var)) {
+            return scope_cost(*stmt_scope);
+        }
+        const NodeStmtIf *stmt_if = std::get<NodeStmtIf *>(stmt->var);
+        int64_t cost = 1 + expr_cost(stmt_if->expr) + scope_cost(stmt_if->scope);
+        std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                cost += 1 + expr_cost((*elif)->expr) + scope_cost((*elif)->scope);
+                pred = (*elif)->pred;
+            } else {
+                cost += scope_cost(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope);
+                pred = {};
+            }
+        }
+        return cost;
+    }
+
+    template<typename T>
+    NodeStmt *wrap(T *node) {
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        stmt->var = node;
+        return stmt;
+    }
+
+    NodeStmt *store(const Token &ident, const ExprIndex expr) {
+        auto assign = m_allocator.alloc<NodeStmtAssign>();
+        assign->ident = ident;
+        assign->expr = expr;
+        return wrap(assign);
+    }
+
+    // Copies of loop-free statements with their own expression nodes, since folding rewrites those in
+    // place, and their own declarations, since the generator allocates registers per declaration. Reads
+    // of symbol become value when one is given.
+    NodeStmtScope *clone_scope(const NodeStmtScope *scope, const std::optional<Symbol> symbol = {},
+                               const int64_t value = 0) {
+        auto copy = m_allocator.alloc<NodeStmtScope>();
+        copy->stmts.reserve(scope->stmts.size());
+        for (const NodeStmt *stmt: scope->stmts) {
+            copy->stmts.push_back(clone_stmt(stmt, symbol, value));
+        }
+        return copy;
+    }
+
+    NodeStmt *clone_stmt(const NodeStmt *stmt, const std::optional<Symbol> symbol = {}, const int64_t value = 0) {
+        const auto expr = [&](const ExprIndex index) {
+            return m_exprs.clone(index, symbol, value);
+        };
+
+        if (const auto stmt_exit = std::get_if<NodeStmtExit *>(&stmt->var)) {
+            auto copy = m_allocator.alloc<NodeStmtExit>();
+            copy->expr = expr((*stmt_exit)->expr);
+            return wrap(copy);
+        }
+        if (const auto stmt_may = std::get_if<NodeStmtMay *>(&stmt->var)) {
+            auto copy = m_allocator.alloc<NodeStmtMay>();
+            copy->ident = (*stmt_may)->ident;
+            copy->expr = expr((*stmt_may)->expr);
+            return wrap(copy);
+        }
+        if (const auto stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->var)) {
+            return store((*stmt_assign)->ident, expr((*stmt_assign)->expr));
+        }
+        if (const auto stmt_scope = std::get_if<NodeStmtScope *>(&stmt->var)) {
+            return wrap(clone_scope(*stmt_scope, symbol, value));
+        }
+
+        const NodeStmtIf *stmt_if = std::get<NodeStmtIf *>(stmt->var);
+        auto copy = m_allocator.alloc<NodeStmtIf>();
+        copy->expr = expr(stmt_if->expr);
+        copy->scope = clone_scope(stmt_if->scope, symbol, value);
+        std::optional<NodeStmtIfPred *> *link = &copy->pred;
+        std::optional<NodeStmtIfPred *> pred = stmt_if->pred;
+        while (pred.has_value()) {
+            auto pred_copy = m_allocator.alloc<NodeStmtIfPred>();
+            if (const auto elif = std::get_if<NodeStmtIfPredElif *>(&pred.value()->var)) {
+                auto elif_copy = m_allocator.alloc<NodeStmtIfPredElif>();
+                elif_copy->expr = expr((*elif)->expr);
+                elif_copy->scope = clone_scope((*elif)->scope, symbol, value);
+                pred_copy->var = elif_copy;
+                *link = pred_copy;
+                link = &elif_copy->pred;
+                pred = (*elif)->pred;
+            } else {
+                auto else_copy = m_allocator.alloc<NodeStmtIfPredElse>();
+                else_copy->scope = clone_scope(std::get<NodeStmtIfPredElse *>(pred.value()->var)->scope, symbol, value);
+                pred_copy->var = else_copy;
+                *link = pred_copy;
+                pred = {};
+            }
+        }
+        return wrap(copy);
+    }
+
+    ArenaAllocator &m_allocator;
+    ExprPool &m_exprs;
+    const size_t m_factor;
+    size_t m_unrolled = 0;
+    size_t m_partially_unrolled = 0;
+};